@@ -0,0 +1,44 @@
+/*
+ * EVERYTHING HERE IS FOR LOCAL USE ONLY.
+ * FOR EXPORTED OBJECTS PLEASE SEE rbf.h.
+ */
+
+#ifndef __RBF_DISTANCE_H__
+#define __RBF_DISTANCE_H__
+
+typedef int (*u8_dist_fn)(const feature_type *v1, const feature_type *v2, size_t dim);
+typedef void (*u8_dists_fn)(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists);
+
+// One set of distance kernels per instruction set (see rbf_distance.c).
+typedef struct {
+    const char *name;
+    bool (*cpu_supports)();
+    u8_dist_fn l2_square;
+    u8_dist_fn l1;
+    u8_dist_fn dot;
+    u8_dist_fn hamming;
+    u8_dists_fn l2_square_many;
+    u8_dists_fn l1_many;
+    u8_dists_fn dot_many;
+    u8_dists_fn hamming_many;
+} distance_kernels;
+
+extern const distance_kernels distance_kernel_sets[];
+extern const size_t num_distance_kernel_sets;
+const distance_kernels *best_distance_kernels();
+
+// Using the best kernels for this CPU:
+int l2_square_dist_u8(const feature_type *v1, const feature_type *v2, size_t dim);
+int l1_dist_u8(const feature_type *v1, const feature_type *v2, size_t dim);
+int dot_u8(const feature_type *v1, const feature_type *v2, size_t dim);
+void l2_square_dists_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists);
+void l1_dists_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists);
+void dots_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists);
+
+bool test_distance_kernels();
+
+#endif /* __RBF_DISTANCE_H__ */
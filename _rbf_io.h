@@ -0,0 +1,15 @@
+/*
+ * EVERYTHING HERE IS FOR LOCAL USE ONLY.
+ * FOR EXPORTED OBJECTS PLEASE SEE rbf.h.
+ */
+
+#ifndef __RBF_IO_H__
+#define __RBF_IO_H__
+
+bool tree_nodes_valid(const RandomBinaryTree *tree, colnum_type num_features);
+
+bool test_save_load_forest();
+bool test_load_corrupt_forest();
+bool test_train_forest_rows();
+
+#endif /* __RBF_IO_H__ */
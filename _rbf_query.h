@@ -6,7 +6,31 @@
 #ifndef __RBF_QUERY_H__
 #define __RBF_QUERY_H__
 
+// The batch queries go through the forest a tree at a time for blocks of this many points.
+#define QUERY_BLOCK_POINTS 64
+
+nodenum_type find_leaf(const RandomBinaryTree *tree, const feature_type *point);
+void find_leaves(const RandomBinaryTree *tree, const feature_type *points, size_t point_dimension, size_t num_points,
+        nodenum_type *ret_leaves);
+void find_trees_leaves(const RandomBinaryForest *forest, size_t first_tree, size_t num_trees, const feature_type *point,
+        nodenum_type *ret_leaves);
+RbfLeafView find_subtree(const RandomBinaryTree *tree, treeindex_type tree_num, const feature_type *point,
+        rownum_type min_rows);
+
+uint32_t *start_visit(rownum_type num_rows, uint32_t *ret_epoch);
+
+void sort_rows_by_l2(const feature_type *ref_points, const feature_type *point, size_t point_dimension,
+        rownum_type *rows, size_t count);
+
 bool test_query();
 bool test_query_sorted();
+bool test_dedup_results();
+bool test_find_leaves();
+bool test_query_leaves();
+bool test_query_subtrees();
+bool test_parallel_query();
+bool test_query_probe();
+bool test_query_knn();
+bool test_query_csr();
 
 #endif /* __RBF_QUERY_H__ */
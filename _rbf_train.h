@@ -6,13 +6,66 @@
 #ifndef __RBF_TRAIN_H__
 #define __RBF_TRAIN_H__
 
+typedef struct {
+    uint64_t state;
+} rbf_rng;
+
+rbf_rng rng_init(uint64_t seed, uint64_t stream);
+uint64_t rng_next(rbf_rng *rng);
+rbf_rng rng_split(rbf_rng *rng);
+
+// A node's sampled features and its histograms for them (see RbfConfig.share_features_levels).
+typedef struct {
+    colnum_type *feat_subset;
+    stats_type *feat_freqs;
+    stats_type *weighted_totals;
+} node_hists;
+
+void alloc_node_hists(node_hists *hists, colnum_type num_feats);
+void free_node_hists(node_hists *hists);
+
+// Per-thread scratch memory for _split_node (see alloc_split_scratch).
+typedef struct {
+    bool *feats_already_selected;
+    colnum_type *feat_subset;
+    stats_type *feat_freqs;
+    stats_type *weighted_totals;
+    stats_type *sub_hists;
+    uint8_t *goes_right;        // for branchless_partition, grown to the biggest view the thread has split
+    rownum_type *misplaced;     // ditto
+    rownum_type partition_capacity;     // rows goes_right and misplaced have room for
+    node_hists *child_hists;    // 2 per tree level, if nodes share features with their parent
+    int num_threads;    // only set in the first element of the array
+    size_t tree_depth;  // ditto
+} split_scratch;
+
+split_scratch *alloc_split_scratch(RbfConfig *cfg, int num_threads);
+void free_split_scratch(split_scratch *scratch);
+
 void feature_column_to_bins(rownum_type *row_index, feature_type feature_array[],
        colnum_type feature_num, colnum_type num_features, rownum_type index_start, rownum_type index_end,
        // returns:
        stats_type *ret_counts, stats_type *ret_weighted_total);
 
+// features_to_bins: rows per tile, sub-histograms per feature, and the view size from which it uses them
+#define HIST_TILE_ROWS 256
+#define HIST_COPIES 4
+#define SUB_HIST_MIN_ROWS 256
+
+void features_to_bins(rownum_type *row_index, feature_type *feat_array, rownum_type num_rows,
+        const colnum_type *feat_nums, colnum_type num_feats, rownum_type index_start, rownum_type index_end,
+        stats_type *sub_hists,
+        // returns:
+        stats_type *ret_counts, stats_type *ret_weighted_totals);
+
+void sibling_hists(rownum_type *row_index, feature_type *feat_array, rownum_type num_rows,
+        const node_hists *parent_hists, colnum_type num_feats,
+        rownum_type index_start, rownum_type index_split, rownum_type index_end, stats_type *sub_hists,
+        // returns:
+        node_hists *ret_left_hists, node_hists *ret_right_hists);
+
 void select_random_features_and_get_frequencies(rownum_type *row_index, feature_type *feat_array, bool *feats_already_selected,
-        RbfConfig *cfg, rownum_type index_start, rownum_type index_end,
+        RbfConfig *cfg, rbf_rng *rng, rownum_type index_start, rownum_type index_end, stats_type *sub_hists,
         // returns:
         colnum_type *ret_feat_subset, stats_type *ret_feat_freqs, stats_type *ret_feat_weighted_totals);
 
@@ -28,12 +81,26 @@ void get_simple_best_feature(stats_type *feature_frequencies,
 rownum_type quick_partition(rownum_type *row_index, feature_type *feature_array,
         colnum_type num_features, rownum_type index_start, rownum_type index_end, colnum_type feature_num, feature_type split_value);
 
+rownum_type branchless_partition(rownum_type *row_index, feature_type *feat_array,
+        rownum_type num_rows, rownum_type index_start, rownum_type index_end, colnum_type feat_num, feature_type split_val,
+        uint8_t *goes_right, rownum_type *misplaced);
+
+void pack_tree_row_index(RandomBinaryTree *tree);
+
 bool test_feature_column_to_bins();
+bool test_features_to_bins();
+bool test_sibling_hists();
 bool test_select_random_features_and_get_frequencies();
 bool test_split_one_feature();
 bool test_get_simple_best_feature();
 bool test_quick_partition();
+bool test_branchless_partition();
 bool test_transpose();
+bool test_train_tree_layout();
+bool test_pack_row_index();
+bool test_train_reproducible();
+bool test_store_ordered_points();
+bool test_free_forest();
 void print_time(char *msg);
 
 #endif /* __RBF_TRAIN_H__ */
@@ -7,6 +7,8 @@
 #define __RBF_UTILS_H__
 
 void die_alloc_err(char *func_name, char *vars);
+void transpose_rows(const feature_type *input, size_t rows, size_t cols, size_t row_start, size_t row_end,
+        feature_type *output);
 
 typedef struct {
     feature_type *query_point;
@@ -15,6 +17,12 @@ typedef struct {
     size_t point_dimension;
 } results_comparison_node;
 
+int row_index_bits(rownum_type num_rows);
+size_t packed_row_index_size(rownum_type num_rows, int bits);
+uint8_t *pack_row_index(const rownum_type *row_index, rownum_type num_rows, int bits);
+void unpack_row_index(const uint8_t *packed, int bits, rownum_type index_start, rownum_type index_end,
+        rownum_type *ret_rows);
+
 int l2_square_dist(feature_type *v1, feature_type *v2, size_t vec_size);
 
 #endif /* __RBF_UTILS_H__ */
@@ -49,23 +49,6 @@ label_type get_winner(label_type *labels, size_t count) {
 }
 
 
-/*
- * Given results from multiple trees, merge them into a single array.
- */
-rownum_type *merge_indices(RbfResults *results, size_t num_trees) {
-    rownum_type *indices = malloc(sizeof(rownum_type) * results->total_count);
-    size_t all_indices_pos = 0;
-    for (size_t tree_num = 0; tree_num < num_trees; tree_num++) {
-        size_t this_tree_results_count = results->tree_result_counts[tree_num];
-        for (size_t this_tree_result_i = 0; this_tree_result_i < this_tree_results_count; this_tree_result_i++) {
-            indices[all_indices_pos] = results->tree_results[tree_num][this_tree_result_i];
-            all_indices_pos += 1;
-        }
-    }
-    return indices;
-}
-
-
 /*
  * Given an array of row-indices, return the corresponding labels.
  */
@@ -86,33 +69,30 @@ label_type *get_labels(rownum_type *indices, size_t count, label_type *train_lab
 void eval_plurality(RandomBinaryForest *forest, RbfConfig cfg, feature_type *test_data, label_type *train_labels,
         label_type *test_labels, size_t num_test_rows, size_t num_features) {
     print_time("started eval_plurality");
-    RbfResults *rbf_results = batch_query_forest_all_results(forest, test_data, num_features, num_test_rows);
+    RbfBatchResults *rbf_results = batch_query_forest_all_results(forest, test_data, num_features, num_test_rows);
 
     int *matches = malloc(sizeof(int) * num_test_rows);
     #pragma omp parallel for
     for (size_t i = 0; i < num_test_rows; i++) {
-        RbfResults results = rbf_results[i];
-        rownum_type *merged_indices = merge_indices(&results, cfg.num_trees);
-        label_type *labels = get_labels(merged_indices, results.total_count, train_labels);
-        matches[i] = (get_winner(labels, results.total_count) == test_labels[i]);
+        // a point's results from all the trees are already next to each other:
+        size_t start = rbf_results->offsets[i * cfg.num_trees];
+        size_t count = rbf_results->offsets[(i + 1) * cfg.num_trees] - start;
+        label_type *labels = get_labels(&(rbf_results->ids[start]), count, train_labels);
+        matches[i] = (get_winner(labels, count) == test_labels[i]);
+        free(labels);
     }
 
     int match_count = 0;
     for (size_t i = 0; i < num_test_rows; i++) {
         match_count += matches[i];
     }
+    free(matches);
+    free_batch_results(rbf_results);
     print_time("finished eval_plurality");
     printf("match count: %d\n", match_count);
 }
 
 
-size_t min(size_t i, size_t j) {
-    if (i < j) {
-        return i;
-    }
-    return j;
-}
-
 /**
  * Given a forest and a set of test points, evaluate each point based on the nearest
  * `num_neighbors` neighbors by L2 distance.
@@ -121,34 +101,37 @@ void eval_deduped_l2(RandomBinaryForest *forest, RbfConfig cfg, size_t num_neigh
                      feature_type *train_data, feature_type *test_data, label_type *train_labels, label_type *test_labels,
                      size_t num_test_rows, size_t num_features) {
     print_time("started eval_l2");
-    // get deduped result indices sorted by l2 distance of reference (training) points from query points:
-    size_t *counts;
-    rownum_type **results = batch_query_forest_dedup_results_sorted(forest, train_data,
-        test_data, num_features, num_test_rows, l2_compare, &counts);
-
-    // for each query row, get labels of first `num_neighbors` results for that row, then get winner
+    // get the nearest `num_neighbors` deduped results by l2 distance of reference (training) points from query points:
+    rownum_type *results = malloc(sizeof(rownum_type) * num_test_rows * num_neighbors);
+    double *dists = malloc(sizeof(double) * num_test_rows * num_neighbors);
+    size_t *counts = malloc(sizeof(size_t) * num_test_rows);
+    batch_query_forest_knn(forest, train_data, test_data, num_features, num_test_rows, RBF_L2, num_neighbors,
+                           (rownum_type) num_neighbors, results, dists, counts);
+
+    // for each query row, get labels of its nearest results, then get winner
     int match_count = 0;
+    label_type *labels = malloc(sizeof(label_type) * num_neighbors);
     for (size_t i = 0; i < num_test_rows; i++) {
-        label_type *labels = malloc(sizeof(label_type) * counts[i]);
-        size_t count = min(counts[i], num_neighbors);
-        for (size_t j = 0; j < count; j++) {
-            labels[j] = train_labels[results[i][j]];
+        for (size_t j = 0; j < counts[i]; j++) {
+            labels[j] = train_labels[results[i * num_neighbors + j]];
         }
-        match_count += (get_winner(labels, count) == test_labels[i]);
-        free(labels);
+        match_count += (get_winner(labels, counts[i]) == test_labels[i]);
     }
+    free(labels);
+    free(results);
+    free(dists);
+    free(counts);
     print_time("finished eval_l2");
     printf("match count: %d\n", match_count);
 }
 
 int main() {
-    srand(2719);
-
-    // read training data
-    size_t bytes;
-    feature_type *pre_train_data = read_file("fashion/train_images.bin", &bytes);
-    size_t train_bytes = bytes;
+    // map the training points (they're only read, so there's no need for a copy in memory as well as
+    // in the page cache) and read the labels
+    size_t train_bytes, bytes;
+    feature_type *train_data = map_feature_file("fashion/train_images.bin", &train_bytes);
     label_type *train_labels = (label_type *) read_file("fashion/train_labels.bin", &bytes);
+    assert(train_data);
     size_t num_rows = bytes;
     size_t num_features = train_bytes / bytes;
 
@@ -158,21 +141,33 @@ int main() {
                       4, // leaf_size
                num_rows,
            num_features,
-                     28};  // num_features_to_compare
-
-    feature_type *train_data = transpose(pre_train_data, cfg.num_rows, cfg.num_features);
-    free(pre_train_data);
+                     28,  // num_features_to_compare
+                  false,  // pack_row_index
+                  2719,  // seed
+                  5000,  // task_min_rows
+                     0,  // share_features_levels
+                    64}; // parallel_query_min_trees
 
     print_time("started training");
-    RandomBinaryForest *forest = train_forest(train_data, &cfg);
+    RandomBinaryForest *forest = train_forest_rows(train_data, &cfg, NULL);
     print_time("finished training");
+    assert(forest);
 
-    // read test data
-    feature_type *test_data = read_file("fashion/test_images.bin", &bytes);
+    // map test data
+    size_t test_bytes;
+    feature_type *test_data = map_feature_file("fashion/test_images.bin", &test_bytes);
     label_type *test_labels = (label_type *) read_file("fashion/test_labels.bin", &bytes);
+    assert(test_data);
     size_t num_test_rows = bytes;
 
     // evaluate
     eval_plurality(forest, cfg, test_data, train_labels, test_labels, num_test_rows, num_features);
+    // (the l2 eval needs the training points row-major, as mapped, not transposed for training)
     eval_deduped_l2(forest, cfg, 5, train_data, test_data, train_labels, test_labels, num_test_rows, cfg.num_features);
+
+    free_forest(forest);
+    unmap_feature_file(train_data, train_bytes);
+    unmap_feature_file(test_data, test_bytes);
+    free(train_labels);
+    free(test_labels);
 }
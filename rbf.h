@@ -17,6 +17,7 @@ typedef int32_t rownum_type;    // HAS TO BE A SIGNED TYPE! (see "Ugliness alert
 typedef int32_t colnum_type;
 typedef int32_t stats_type;
 typedef size_t treeindex_type;
+typedef uint32_t nodenum_type;  // index of a node in a tree's arrays
 
 
 typedef struct {
@@ -27,9 +28,8 @@ typedef struct {
     rownum_type num_rows;
 
 	// Ugliness alert:
-	// Each tree node is a pair. For speed and space efficiency we'll store the tree in 2 arrays
-	// using the standard trick for storing a binary tree in an array (with indexing starting at 0,
-	// left child of n goes in 2n+1, right child goes in 2n+2). The pairs are either:
+	// Each tree node is a pair. For speed and space efficiency we'll store the tree in parallel
+	// arrays indexed by node number. The pairs are either:
 	// - if it's an internal node: the feature number and the value at which to split the feature
 	// - if it's a leaf node: start and end indices in the rowIndex array; that view in the rowIndex
 	//   array tells us the indices of rows in the original training set that are in this leaf
@@ -37,11 +37,32 @@ typedef struct {
 	// 1. Yes, I know this is ugly, but the alternative is to have a whole 'nother pair of large arrays.
 	// 2. Yes, I considered using hashmaps instead [in Go], but they're much slower (expected) and also
 	//    take WAY more memory (which surprised me).
+	//
+	// The root is node 0. The two children of an internal node n are stored next to each other:
+	// the left child is node tree_child[n] and the right child is node tree_child[n] + 1 (tree_child
+	// is unused for leaves). Nodes are only allocated when they're created, so memory scales with
+	// the number of nodes actually in the tree (num_internal_nodes + num_leaves == tree_size)
+	// rather than with 2^tree_depth.
     rownum_type *tree_first;
     rownum_type *tree_second;
+    nodenum_type *tree_child;
     treeindex_type tree_size;
     treeindex_type num_internal_nodes;
     treeindex_type num_leaves;
+    treeindex_type tree_capacity;   // allocated length of the tree arrays (only used while training)
+
+    // If the tree was trained with config->pack_row_index then row_index is NULL and the row index
+    // is instead stored bit-packed in packed_row_index, using row_index_bits bits per entry
+    // (see pack_row_index in rbf_utils.c).
+    uint8_t *packed_row_index;
+    int row_index_bits;
+
+    // The rows under any node are a contiguous view of the row index: row_index[0..num_rows) for
+    // the root, and for an internal node n with view [start, end), [start, tree_split[n]) for its
+    // left child and [tree_split[n], end) for its right child. So queries can stop at a subtree
+    // with enough rows in it instead of going all the way down to a leaf (see find_subtree).
+    // tree_split is unused (0) for leaves.
+    rownum_type *tree_split;
 } RandomBinaryTree;
 
 typedef struct {
@@ -51,11 +72,35 @@ typedef struct {
     rownum_type num_rows;
     colnum_type num_features;
     colnum_type num_features_to_compare;
+    bool pack_row_index;    // store each tree's row index with ceil(log2(num_rows)) bits per entry
+    uint64_t seed;          // the same seed gives the same forest, however many threads train it
+    rownum_type task_min_rows;  // build subtrees with at least this many rows as separate tasks
+                                // (0: only train different trees in parallel). Each training thread
+                                // keeps 5 bytes per row of the biggest node it splits, for partitioning:
+                                // 5 * num_rows if it starts a tree, less if it only builds subtree tasks
+                                // (with fewer trees than threads, most threads only do that).
+    size_t share_features_levels;   // if > 1, nodes only sample new features at every this-many-th
+                                    // level and otherwise reuse their parent's, which lets us get one
+                                    // child's histograms by subtraction (0 or 1: every node samples)
+    size_t parallel_query_min_trees;    // single-point queries of forests with at least this many trees
+                                        // spread the trees (and dedup) over threads (0: never)
 } RbfConfig;
 
 typedef struct {
     RbfConfig *config;
     RandomBinaryTree *trees;
+    // If the forest was loaded from a file (see load_forest) the tree arrays point into this
+    // read-only mapping of the file; otherwise it's NULL.
+    void *mapping;
+    size_t mapping_size;
+    // Optional (see store_ordered_points): a copy of the (row-major) reference points in the order of
+    // trees[0]'s row index, so that the rows in any of its leaves are next to each other, and each
+    // training row's position in that order. If present, kNN re-ranking reads these instead of
+    // ref_points, and streams through trees[0]'s candidates instead of jumping around for each one.
+    // Each point's Euclidean norm (by position) is kept too, so RBF_COSINE doesn't recompute them.
+    feature_type *ordered_points;
+    rownum_type *ordered_positions;
+    double *ordered_norms;
 } RandomBinaryForest;
 
 typedef struct {
@@ -64,18 +109,115 @@ typedef struct {
     size_t total_count;
 } RbfResults;
 
+// The results of batch_query_forest_all_results, all in one allocation (free it with free_batch_results).
+// The rows point i got from tree t are ids[offsets[i * num_trees + t] .. offsets[i * num_trees + t + 1]),
+// so its rows from all the trees are ids[offsets[i * num_trees] .. offsets[(i + 1) * num_trees]).
+typedef struct {
+    size_t num_points;
+    size_t num_trees;
+    size_t *offsets;        // num_points * num_trees + 1 of them
+    rownum_type *ids;
+} RbfBatchResults;
+
+// Per-point results of a batch query in CSR (compressed sparse row) form, all in one allocation (free
+// it with free_csr_results): point i's results are indices[indptr[i] .. indptr[i + 1]), and, for
+// queries that rank them, distances[indptr[i] .. indptr[i + 1]) are their distances (else NULL).
+// The arrays can be wrapped as numpy arrays (or a scipy.sparse.csr_matrix) without copying.
+typedef struct {
+    size_t num_points;
+    size_t *indptr;         // num_points + 1 of them
+    rownum_type *indices;
+    double *distances;
+} RbfCsrResults;
+
+// How query_forest_knn ranks candidates (see rbf_distances).
+typedef enum {
+    RBF_L2,         // squared Euclidean
+    RBF_L1,         // Manhattan
+    RBF_COSINE,     // 1 - cosine similarity
+    RBF_DOT,        // minus the inner product
+    RBF_HAMMING     // differing bits, for binarized features packed 8 to a byte
+} RbfMetric;
+
+// The leaf (or subtree, see query_forest_subtrees) a query point falls in in one tree: its rows
+// are trees[tree_num].row_index[start..end), or (for trees with packed row indices) see leaf_view_rows.
+typedef struct {
+    treeindex_type tree_num;
+    rownum_type start;
+    rownum_type end;
+} RbfLeafView;
+
 
 RandomBinaryForest *train_forest(feature_type *feature_array, RbfConfig *config);
+void store_ordered_points(RandomBinaryForest *forest, const feature_type *ref_points);
+void free_forest(RandomBinaryForest *forest);
+
+bool save_forest(const RandomBinaryForest *forest, const char *filename);
+RandomBinaryForest *load_forest(const char *filename);
+
+feature_type *map_feature_file(const char *filename, size_t *ret_size);
+void unmap_feature_file(feature_type *features, size_t size);
+RandomBinaryForest *train_forest_rows(const feature_type *rows, RbfConfig *config, const char *scratch_filename);
+RandomBinaryForest *train_forest_from_file(const char *filename, RbfConfig *config, const char *scratch_filename);
 
 RbfResults *query_forest_all_results(const RandomBinaryForest *forest, const feature_type *point,
         const size_t point_dimension);
-RbfResults *batch_query_forest_all_results(const RandomBinaryForest *forest, const feature_type *points,
+RbfBatchResults *batch_query_forest_all_results(const RandomBinaryForest *forest, const feature_type *points,
         const size_t point_dimension, const size_t num_points);
+void free_results(RbfResults *results);
+void free_batch_results(RbfBatchResults *results);
+
+// Queries keep some buffers per thread from one query to the next, sized for the biggest forest the
+// thread has queried: 4 * num_rows bytes for deduping (on each thread that has run a deduping query,
+// including the OpenMP threads of batch queries), 8 * num_rows more on a thread that has run a
+// parallel single-point query (see RbfConfig.parallel_query_min_trees), and for the probing queries
+// (query_forest_knn_probe) 16 bytes per leaf and 12 per branch of their biggest search. This frees
+// the calling thread's and its OpenMP threads' (free_forest does too).
+void rbf_release_thread_buffers();
+
+void query_forest_leaves(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, RbfLeafView *ret_leaves);
+void batch_query_forest_leaves(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, RbfLeafView *ret_leaves);
+void query_forest_subtrees(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, const rownum_type min_rows, RbfLeafView *ret_views);
+void batch_query_forest_subtrees(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, const rownum_type min_rows, RbfLeafView *ret_views);
+void leaf_view_rows(const RandomBinaryForest *forest, RbfLeafView leaf, rownum_type *ret_rows);
 
 rownum_type *query_forest_dedup_results(const RandomBinaryForest *forest, const feature_type *point,
         const size_t point_dimension, size_t *count);
 rownum_type **batch_query_forest_dedup_results(const RandomBinaryForest *forest, const feature_type *points,
         const size_t point_dimension, const size_t num_points, size_t **counts);
+RbfCsrResults *batch_query_forest_dedup_csr(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points);
+void free_csr_results(RbfCsrResults *results);
+
+size_t query_forest_knn(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *point,
+        const size_t point_dimension, const RbfMetric metric, const size_t k, const rownum_type min_tree_rows,
+        rownum_type *ret_ids, double *ret_dists);
+void batch_query_forest_knn(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, const RbfMetric metric, const size_t k,
+        const rownum_type min_tree_rows, rownum_type *ret_ids, double *ret_dists, size_t *ret_counts);
+RbfCsrResults *batch_query_forest_knn_csr(const RandomBinaryForest *forest, const feature_type *ref_points,
+        const feature_type *points, const size_t point_dimension, const size_t num_points, const RbfMetric metric,
+        const size_t k, const rownum_type min_tree_rows);
+
+size_t query_forest_probe_leaves(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, const size_t candidate_budget, const size_t max_leaves, RbfLeafView *ret_leaves);
+size_t query_forest_knn_probe(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *point,
+        const size_t point_dimension, const RbfMetric metric, const size_t k, const size_t candidate_budget,
+        rownum_type *ret_ids, double *ret_dists);
+void batch_query_forest_knn_probe(const RandomBinaryForest *forest, const feature_type *ref_points,
+        const feature_type *points, const size_t point_dimension, const size_t num_points, const RbfMetric metric,
+        const size_t k, const size_t candidate_budget, rownum_type *ret_ids, double *ret_dists, size_t *ret_counts);
+
+// The distance kernels sum in ints, so distances are only computed for points with up to this many
+// features (the most for which 255^2 per feature can't overflow).
+#define RBF_MAX_DISTANCE_DIMENSION (INT32_MAX / (255 * 255))
+
+void rbf_distances(RbfMetric metric, const feature_type *query, const feature_type *ref_points, size_t point_dimension,
+        const rownum_type *rows, size_t num_rows, const double *ref_norms, double *ret_dists);
 
 rownum_type **batch_query_forest_dedup_results_sorted(const RandomBinaryForest *forest, feature_type *ref_points,
         feature_type *points, const size_t point_dimension, size_t num_points,
@@ -83,6 +225,7 @@ rownum_type **batch_query_forest_dedup_results_sorted(const RandomBinaryForest *
         size_t **ret_counts);
 
 feature_type *transpose(feature_type *input, size_t rows, size_t cols);
+void transpose_into(const feature_type *input, size_t rows, size_t cols, feature_type *output);
 
 int l2_compare(const void *pre_v1, const void *pre_v2);
 
@@ -0,0 +1,728 @@
+/*
+ * Microbenchmarks for the hot loops, on random data shaped like fashion-MNIST (60000 rows of 784
+ * features, comparing 28 features at each split), so that no data files are needed.
+ * Build and run with `make bench`.
+ */
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "rbf.h"
+#include "_rbf_train.h"
+#include "_rbf_query.h"
+#include "_rbf_distance.h"
+#include "_rbf_utils.h"
+
+#define BENCH_ROWS 60000
+#define BENCH_FEATURES 784
+#define BENCH_FEATURES_TO_COMPARE 28
+
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static feature_type *random_features(size_t count) {
+    feature_type *features = (feature_type *) malloc(count);
+    uint64_t x = 2719;
+    for (size_t i = 0; i < count; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        // roughly MNIST-like: mostly 0s, the rest spread over 1..255
+        features[i] = ((x >> 60) < 10) ? 0 : (feature_type) (x >> 56);
+    }
+    return features;
+}
+
+
+// A random permutation of 0..num_rows-1, like a row index some way down a tree.
+static rownum_type *shuffled_row_index(rownum_type num_rows) {
+    rownum_type *row_index = (rownum_type *) malloc(sizeof(rownum_type) * num_rows);
+    for (rownum_type i = 0; i < num_rows; i++) {
+        row_index[i] = i;
+    }
+    uint64_t x = 12345;
+    for (rownum_type i = num_rows - 1; i > 0; i--) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        rownum_type j = (rownum_type) ((x >> 33) % (uint64_t) (i + 1));
+        rownum_type tmp = row_index[i];
+        row_index[i] = row_index[j];
+        row_index[j] = tmp;
+    }
+    return row_index;
+}
+
+
+/*
+ * Histogram construction for one node: feature_column_to_bins once per sampled feature (what
+ * _split_node used to do) vs features_to_bins, for views the size of nodes at various depths.
+ */
+static void bench_bins() {
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    rownum_type *row_index = shuffled_row_index(BENCH_ROWS);
+    colnum_type feat_nums[BENCH_FEATURES_TO_COMPARE];
+    for (colnum_type i = 0; i < BENCH_FEATURES_TO_COMPARE; i++) {
+        feat_nums[i] = (i * 97) % BENCH_FEATURES;
+    }
+    stats_type *counts = (stats_type *) malloc(sizeof(stats_type) * BENCH_FEATURES_TO_COMPARE * NUM_CHARS);
+    stats_type weighted_totals[BENCH_FEATURES_TO_COMPARE];
+    stats_type *sub_hists = (stats_type *) malloc(sizeof(stats_type) * BENCH_FEATURES_TO_COMPARE * HIST_COPIES * NUM_CHARS);
+
+    printf("histograms (%d features per node), ns per row per feature:\n", BENCH_FEATURES_TO_COMPARE);
+    printf("%10s %12s %12s %8s\n", "view rows", "per-column", "tiled", "speedup");
+    for (rownum_type view_rows = BENCH_ROWS; view_rows >= 50; view_rows /= 8) {
+        int reps = 20 * BENCH_ROWS / view_rows;
+        double times[2];
+        for (int method = 0; method < 2; method++) {
+            double start = now();
+            for (int rep = 0; rep < reps; rep++) {
+                // a different view each time, as for different nodes at the same depth
+                rownum_type index_start = (rownum_type) (((int64_t) rep * view_rows) % (BENCH_ROWS - view_rows + 1));
+                memset(counts, 0, sizeof(stats_type) * BENCH_FEATURES_TO_COMPARE * NUM_CHARS);
+                memset(weighted_totals, 0, sizeof(weighted_totals));
+                if (method == 0) {
+                    for (colnum_type f = 0; f < BENCH_FEATURES_TO_COMPARE; f++) {
+                        feature_column_to_bins(row_index, feat_array, feat_nums[f], BENCH_ROWS,
+                                               index_start, index_start + view_rows,
+                                               &(counts[f * NUM_CHARS]), &(weighted_totals[f]));
+                    }
+                } else {
+                    features_to_bins(row_index, feat_array, BENCH_ROWS, feat_nums, BENCH_FEATURES_TO_COMPARE,
+                                     index_start, index_start + view_rows, sub_hists,
+                                     counts, weighted_totals);
+                }
+            }
+            times[method] = (now() - start) * 1e9 / ((double) reps * view_rows * BENCH_FEATURES_TO_COMPARE);
+        }
+        printf("%10d %12.3f %12.3f %7.2fx\n", view_rows, times[0], times[1], times[0] / times[1]);
+    }
+    free(feat_array);
+    free(row_index);
+    free(counts);
+    free(sub_hists);
+}
+
+
+/*
+ * Partitioning a node's rows: quick_partition vs branchless_partition, for views from the top of
+ * a tree on a few million rows down to small nodes, split around the median.
+ */
+static void bench_partition() {
+    rownum_type num_rows = 1 << 22;
+    feature_type *feat_column = random_features(num_rows);
+    rownum_type *shuffled = shuffled_row_index(num_rows);
+    rownum_type *row_index = (rownum_type *) malloc(sizeof(rownum_type) * num_rows);
+    uint8_t *goes_right = (uint8_t *) malloc(num_rows);
+    rownum_type *misplaced = (rownum_type *) malloc(sizeof(rownum_type) * num_rows);
+
+    printf("partitioning, ns per row:\n");
+    printf("%10s %12s %12s %8s\n", "view rows", "quick", "branchless", "speedup");
+    for (rownum_type view_rows = num_rows; view_rows >= 64; view_rows /= 16) {
+        int reps = 4 * num_rows / view_rows;
+        double times[2] = {0, 0};
+        for (int method = 0; method < 2; method++) {
+            for (int rep = 0; rep < reps; rep++) {
+                rownum_type index_start = (rownum_type) (((int64_t) rep * view_rows) % (num_rows - view_rows + 1));
+                memcpy(&(row_index[index_start]), &(shuffled[index_start]), sizeof(rownum_type) * view_rows);
+                double start = now();
+                if (method == 0) {
+                    quick_partition(row_index, feat_column, num_rows, index_start, index_start + view_rows, 0, 127);
+                } else {
+                    branchless_partition(row_index, feat_column, num_rows, index_start, index_start + view_rows, 0, 127,
+                                         goes_right, misplaced);
+                }
+                times[method] += now() - start;
+            }
+            times[method] *= 1e9 / ((double) reps * view_rows);
+        }
+        printf("%10d %12.3f %12.3f %7.2fx\n", view_rows, times[0], times[1], times[0] / times[1]);
+    }
+    free(feat_column);
+    free(shuffled);
+    free(row_index);
+    free(goes_right);
+    free(misplaced);
+}
+
+
+/*
+ * Tree traversal: one point at a time through all the trees (what the batch queries used to do)
+ * vs find_leaves' lockstep walks of a block of points through one tree at a time, then the same for
+ * the whole of batch_query_forest_all_results.
+ */
+static void bench_query() {
+    size_t num_points = 16384;
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    RbfConfig config = {8, 20, 4, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719};
+    RandomBinaryForest *forest = train_forest(feat_array, &config);
+    feature_type *points = random_features(num_points * BENCH_FEATURES);
+    nodenum_type *leaves = (nodenum_type *) malloc(sizeof(nodenum_type) * num_points * config.num_trees);
+
+    double start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        for (size_t t = 0; t < config.num_trees; t++) {
+            leaves[t * num_points + i] = find_leaf(&(forest->trees[t]), &(points[i * BENCH_FEATURES]));
+        }
+    }
+    double one_at_a_time = now() - start;
+    start = now();
+    for (size_t block_start = 0; block_start < num_points; block_start += QUERY_BLOCK_POINTS) {
+        for (size_t t = 0; t < config.num_trees; t++) {
+            find_leaves(&(forest->trees[t]), &(points[block_start * BENCH_FEATURES]), BENCH_FEATURES,
+                        QUERY_BLOCK_POINTS, &(leaves[t * num_points + block_start]));
+        }
+    }
+    double batched = now() - start;
+    printf("finding leaves (%zu trees), queries per second:\n", config.num_trees);
+    printf("%14s %14s %8s\n", "one at a time", "find_leaves", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_points / one_at_a_time, num_points / batched, one_at_a_time / batched);
+
+    start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        free_results(query_forest_all_results(forest, &(points[i * BENCH_FEATURES]), BENCH_FEATURES));
+    }
+    one_at_a_time = now() - start;
+    start = now();
+    free_batch_results(batch_query_forest_all_results(forest, points, BENCH_FEATURES, num_points));
+    batched = now() - start;
+    printf("all results, queries per second:\n");
+    printf("%14s %14s %8s\n", "one at a time", "batch", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_points / one_at_a_time, num_points / batched, one_at_a_time / batched);
+
+    // and the same without allocating results (see query_forest_leaves):
+    RbfLeafView *leaf_views = (RbfLeafView *) malloc(sizeof(RbfLeafView) * num_points * config.num_trees);
+    start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        query_forest_leaves(forest, &(points[i * BENCH_FEATURES]), BENCH_FEATURES, leaf_views);
+    }
+    one_at_a_time = now() - start;
+    start = now();
+    batch_query_forest_leaves(forest, points, BENCH_FEATURES, num_points, leaf_views);
+    batched = now() - start;
+    printf("leaf views, queries per second:\n");
+    printf("%14s %14s %8s\n", "one at a time", "batch", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_points / one_at_a_time, num_points / batched, one_at_a_time / batched);
+    free(leaf_views);
+    free_forest(forest);
+    free(feat_array);
+    free(points);
+    free(leaves);
+}
+
+
+/*
+ * A random full tree of the given depth, for benchmarking walks on trees much bigger than the
+ * caches without training them: laid out like train_forest lays trees out (each node's children
+ * next to each other, allocated depth-first), with random features and split values, and leaf i
+ * holding just row i (there's no row index, so it's only good for finding leaves).
+ */
+static void random_tree_nodes(RandomBinaryTree *tree, nodenum_type node, size_t depth, colnum_type num_features,
+        uint64_t *x) {
+    if (depth == 0) {
+        rownum_type leaf_num = (rownum_type) tree->num_leaves++;
+        tree->tree_first[node] = HIGH_BIT_1 ^ leaf_num;
+        tree->tree_second[node] = HIGH_BIT_1 ^ (leaf_num + 1);
+        tree->tree_child[node] = 0;
+        return;
+    }
+    *x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+    nodenum_type left_child = (nodenum_type) tree->tree_size;
+    tree->tree_size += 2;
+    tree->num_internal_nodes += 1;
+    tree->tree_first[node] = (rownum_type) ((*x >> 33) % (uint64_t) num_features);
+    tree->tree_second[node] = (rownum_type) (*x >> 56);
+    tree->tree_child[node] = left_child;
+    random_tree_nodes(tree, left_child, depth - 1, num_features, x);
+    random_tree_nodes(tree, left_child + 1, depth - 1, num_features, x);
+}
+
+static void random_tree(RandomBinaryTree *tree, size_t depth, colnum_type num_features, uint64_t seed) {
+    memset(tree, 0, sizeof(RandomBinaryTree));
+    size_t num_nodes = ((size_t) 2 << depth) - 1;
+    tree->tree_first = (rownum_type *) malloc(sizeof(rownum_type) * num_nodes);
+    tree->tree_second = (rownum_type *) malloc(sizeof(rownum_type) * num_nodes);
+    tree->tree_child = (nodenum_type *) malloc(sizeof(nodenum_type) * num_nodes);
+    tree->tree_size = 1;
+    random_tree_nodes(tree, 0, depth, num_features, &seed);
+    tree->num_rows = (rownum_type) tree->num_leaves;
+    tree->tree_capacity = tree->tree_size;
+}
+
+
+/*
+ * Finding one point's leaf in every tree, a tree at a time (find_leaf) vs interleaving the walks
+ * (find_trees_leaves), on a forest several times the size of the L3 cache, so nearly every level
+ * of every walk is a cache miss.
+ */
+static void bench_interleaved() {
+    size_t num_trees = 16, depth = 20, num_points = 20000;
+    colnum_type num_features = 64;
+    RbfConfig config = {num_trees, depth + 1, 1, 0, num_features, 1};
+    RandomBinaryTree *trees = (RandomBinaryTree *) malloc(sizeof(RandomBinaryTree) * num_trees);
+    for (size_t t = 0; t < num_trees; t++) {
+        random_tree(&(trees[t]), depth, num_features, 2719 + t);
+    }
+    RandomBinaryForest forest = {&config, trees};
+    config.num_rows = trees[0].num_rows;
+    feature_type *points = random_features(num_points * num_features);
+    nodenum_type *leaves = (nodenum_type *) malloc(sizeof(nodenum_type) * num_trees);
+    nodenum_type checksum[2] = {0, 0};
+    double start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        for (size_t t = 0; t < num_trees; t++) {
+            checksum[0] += find_leaf(&(trees[t]), &(points[i * num_features]));
+        }
+    }
+    double one_at_a_time = now() - start;
+    start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        find_trees_leaves(&forest, 0, num_trees, &(points[i * num_features]), leaves);
+        for (size_t t = 0; t < num_trees; t++) {
+            checksum[1] += leaves[t];
+        }
+    }
+    double interleaved = now() - start;
+    printf("one point's leaves in %zu trees of %zu MB each%s, queries per second:\n", num_trees,
+           (sizeof(rownum_type) * 2 + sizeof(nodenum_type)) * trees[0].tree_size >> 20,
+           (checksum[0] == checksum[1]) ? "" : " (MISMATCH)");
+    printf("%14s %14s %8s\n", "tree at a time", "interleaved", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_points / one_at_a_time, num_points / interleaved, one_at_a_time / interleaved);
+    for (size_t t = 0; t < num_trees; t++) {
+        free(trees[t].tree_first);
+        free(trees[t].tree_second);
+        free(trees[t].tree_child);
+    }
+    free(trees);
+    free(points);
+    free(leaves);
+}
+
+
+/*
+ * Re-ranking a query's candidates by L2 distance, as query_forest_dedup_results_sorted does: qsort
+ * with l2_compare (as it used to, recomputing both distances in every comparison) vs sort_rows_by_l2
+ * (each distance once, through the prefetching one-vs-many kernel), with candidates scattered over
+ * reference points twice the size of the L3 cache here.
+ */
+static void bench_rerank() {
+    size_t num_ref_rows = 200000, num_points = 2000, num_candidates = 400;
+    feature_type *ref_points = random_features(num_ref_rows * BENCH_FEATURES);
+    feature_type *points = random_features(num_points * BENCH_FEATURES);
+    rownum_type *candidates = (rownum_type *) malloc(sizeof(rownum_type) * num_points * num_candidates);
+    results_comparison_node *comp_nodes = (results_comparison_node *) malloc(sizeof(results_comparison_node) * num_candidates);
+    uint64_t x = 4242;
+    for (size_t i = 0; i < num_points * num_candidates; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        candidates[i] = (rownum_type) ((x >> 33) % num_ref_rows);
+    }
+    rownum_type checksum[2] = {0, 0};
+    double start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        rownum_type *rows = &(candidates[i * num_candidates]);
+        for (size_t j = 0; j < num_candidates; j++) {
+            comp_nodes[j].query_point = &(points[i * BENCH_FEATURES]);
+            comp_nodes[j].ref_point = &(ref_points[(size_t) rows[j] * BENCH_FEATURES]);
+            comp_nodes[j].ref_index = rows[j];
+            comp_nodes[j].point_dimension = BENCH_FEATURES;
+        }
+        qsort(comp_nodes, num_candidates, sizeof(results_comparison_node), l2_compare);
+        checksum[0] += comp_nodes[0].ref_index;
+    }
+    double comparator = now() - start;
+    start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        rownum_type *rows = &(candidates[i * num_candidates]);
+        sort_rows_by_l2(ref_points, &(points[i * BENCH_FEATURES]), BENCH_FEATURES, rows, num_candidates);
+        checksum[1] += rows[0];
+    }
+    double precomputed = now() - start;
+    printf("re-ranking %zu candidates among %zu MB of reference points%s, queries per second:\n", num_candidates,
+           (num_ref_rows * BENCH_FEATURES) >> 20, (checksum[0] == checksum[1]) ? "" : " (MISMATCH)");
+    printf("%14s %14s %8s\n", "l2_compare", "sort_by_l2", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_points / comparator, num_points / precomputed, comparator / precomputed);
+    free(ref_points);
+    free(points);
+    free(candidates);
+    free(comp_nodes);
+}
+
+
+/*
+ * Dedup cost per candidate: query_forest_dedup_results minus query_forest_all_results, on a forest
+ * with lots of trees and big leaves, so lots of repeated candidates.
+ */
+static void bench_dedup() {
+    size_t num_points = 2000;
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    RbfConfig config = {64, 10, 4, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719};
+    RandomBinaryForest *forest = train_forest(feat_array, &config);
+    size_t num_candidates = 0;
+    double start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        RbfResults *results = query_forest_all_results(forest, &(feat_array[i * BENCH_FEATURES]), BENCH_FEATURES);
+        num_candidates += results->total_count;
+        free_results(results);
+    }
+    double all_time = now() - start;
+    start = now();
+    for (size_t i = 0; i < num_points; i++) {
+        size_t count;
+        free(query_forest_dedup_results(forest, &(feat_array[i * BENCH_FEATURES]), BENCH_FEATURES, &count));
+    }
+    double dedup_time = now() - start;
+    printf("dedup (%zu trees, %.0f candidates per query): %.2f ns per candidate\n", config.num_trees,
+           (double) num_candidates / num_points, (dedup_time - all_time) * 1e9 / num_candidates);
+
+    // and the 5 nearest neighbors by sorting all the deduped results vs query_forest_knn
+    // (the random features double as row-major reference points):
+    size_t k = 5, num_knn_points = 200;
+    size_t *counts;
+    rownum_type ids[5];
+    double dists[5];
+    start = now();
+    rownum_type **sorted = batch_query_forest_dedup_results_sorted(forest, feat_array, feat_array, BENCH_FEATURES,
+                                                                   num_knn_points, l2_compare, &counts);
+    double sorted_time = now() - start;
+    for (size_t i = 0; i < num_knn_points; i++) {
+        free(sorted[i]);
+    }
+    free(sorted);
+    free(counts);
+    start = now();
+    for (size_t i = 0; i < num_knn_points; i++) {
+        query_forest_knn(forest, feat_array, &(feat_array[i * BENCH_FEATURES]), BENCH_FEATURES, RBF_L2, k, 0, ids, dists);
+    }
+    double knn_time = now() - start;
+    printf("%zu nearest neighbors, queries per second:\n", k);
+    printf("%14s %14s %8s\n", "sorted dedup", "knn", "speedup");
+    printf("%14.0f %14.0f %7.2fx\n", num_knn_points / sorted_time, num_knn_points / knn_time, sorted_time / knn_time);
+    free_forest(forest);
+    free(feat_array);
+}
+
+
+/*
+ * Single-point latency with the trees spread over OpenMP's threads (parallel_query_min_trees) vs on
+ * the calling thread, for a forest with lots of trees. Only pays off with a few idle cores.
+ */
+static void bench_parallel_query() {
+    size_t num_points = 1000;
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    RbfConfig config = {256, 12, 8, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719};
+    RandomBinaryForest *forest = train_forest(feat_array, &config);
+    RbfLeafView *leaves = malloc(sizeof(RbfLeafView) * config.num_trees);
+    double leaves_time[2], dedup_time[2];
+    for (int parallel = 0; parallel < 2; parallel++) {
+        config.parallel_query_min_trees = parallel ? 64 : 0;
+        double start = now();
+        for (size_t i = 0; i < num_points; i++) {
+            query_forest_leaves(forest, &(feat_array[i * BENCH_FEATURES]), BENCH_FEATURES, leaves);
+        }
+        leaves_time[parallel] = now() - start;
+        start = now();
+        for (size_t i = 0; i < num_points; i++) {
+            size_t count;
+            free(query_forest_dedup_results(forest, &(feat_array[i * BENCH_FEATURES]), BENCH_FEATURES, &count));
+        }
+        dedup_time[parallel] = now() - start;
+    }
+    printf("single-point latency, %zu trees, %d threads (us per query):\n", config.num_trees, omp_get_max_threads());
+    printf("%-8s %12s %12s %8s\n", "", "serial", "parallel", "speedup");
+    printf("%-8s %12.2f %12.2f %7.2fx\n", "leaves", leaves_time[0] * 1e6 / num_points, leaves_time[1] * 1e6 / num_points,
+           leaves_time[0] / leaves_time[1]);
+    printf("%-8s %12.2f %12.2f %7.2fx\n", "dedup", dedup_time[0] * 1e6 / num_points, dedup_time[1] * 1e6 / num_points,
+           dedup_time[0] / dedup_time[1]);
+    free(leaves);
+    free_forest(forest);
+    free(feat_array);
+}
+
+
+/*
+ * Random points near one of num_centers random centers: each feature is the center's, or with
+ * probability 1/4 random, so that points have near neighbors (unlike random_features).
+ */
+static feature_type *clustered_features(size_t num_points, size_t num_centers, uint64_t seed) {
+    feature_type *centers = random_features(num_centers * BENCH_FEATURES);
+    feature_type *features = (feature_type *) malloc(num_points * BENCH_FEATURES);
+    uint64_t x = seed;
+    for (size_t i = 0; i < num_points * BENCH_FEATURES; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t center = ((i / BENCH_FEATURES) * 7919) % num_centers;
+        features[i] = ((x >> 62) == 0) ? (feature_type) (x >> 40) : centers[center * BENCH_FEATURES + i % BENCH_FEATURES];
+    }
+    free(centers);
+    return features;
+}
+
+
+/*
+ * Recall of the 10 nearest neighbors with a forest's own leaves vs a forest with 4x fewer trees
+ * probed best-first (query_forest_knn_probe) with the same number of candidates, against the exact
+ * neighbors. (Trees only depend on the seed and their number, so the small forest is the big one's
+ * first few trees.)
+ */
+static void bench_probe() {
+    size_t num_points = 200, k = 10, num_centers = 600;
+    feature_type *feat_array = clustered_features(BENCH_ROWS, num_centers, 1);   // row-major
+    feature_type *columns = transpose(feat_array, BENCH_ROWS, BENCH_FEATURES);
+    RbfConfig config = {16, 12, 4, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719};
+    RandomBinaryForest *forest = train_forest(columns, &config);
+    RbfConfig small_config = config;
+    small_config.num_trees = config.num_trees / 4;
+    RandomBinaryForest small_forest = *forest;
+    small_forest.config = &small_config;
+    feature_type *points = clustered_features(num_points, num_centers, 2);
+    rownum_type *all_rows = shuffled_row_index(BENCH_ROWS);
+    double *all_dists = (double *) malloc(sizeof(double) * BENCH_ROWS);
+    rownum_type *exact_ids = (rownum_type *) malloc(sizeof(rownum_type) * num_points * k);
+    double *exact_dists = (double *) malloc(sizeof(double) * num_points * k);
+    for (size_t i = 0; i < num_points; i++) {
+        // exact: the k nearest of all the rows, by selection
+        rbf_distances(RBF_L2, &(points[i * BENCH_FEATURES]), feat_array, BENCH_FEATURES, all_rows, BENCH_ROWS, NULL, all_dists);
+        for (size_t j = 0; j < k; j++) {
+            size_t best = j;
+            for (size_t r = j + 1; r < BENCH_ROWS; r++) {
+                best = (all_dists[r] < all_dists[best]) ? r : best;
+            }
+            double dist = all_dists[j];
+            rownum_type row = all_rows[j];
+            all_dists[j] = all_dists[best];
+            all_rows[j] = all_rows[best];
+            all_dists[best] = dist;
+            all_rows[best] = row;
+            exact_ids[i * k + j] = all_rows[j];
+            exact_dists[i * k + j] = all_dists[j];
+        }
+    }
+    RbfLeafView *leaves = (RbfLeafView *) malloc(sizeof(RbfLeafView) * config.num_trees);
+    size_t num_candidates = 0;
+    for (size_t i = 0; i < num_points; i++) {
+        query_forest_leaves(forest, &(points[i * BENCH_FEATURES]), BENCH_FEATURES, leaves);
+        for (size_t t = 0; t < config.num_trees; t++) {
+            num_candidates += leaves[t].end - leaves[t].start;
+        }
+    }
+    size_t budget = num_candidates / num_points;
+    rownum_type *ids = (rownum_type *) malloc(sizeof(rownum_type) * num_points * k);
+    double *dists = (double *) malloc(sizeof(double) * num_points * k);
+    size_t *counts = (size_t *) malloc(sizeof(size_t) * num_points);
+    printf("%zu nearest neighbors (%zu candidates per query from the big forest):\n", k, budget);
+    printf("%34s %8s %12s %12s\n", "", "recall", "queries/s", "index MB");
+    for (int probe = 0; probe < 4; probe++) {
+        RandomBinaryForest *f = probe ? &small_forest : forest;
+        size_t probe_budget = probe ? budget << (probe - 1) : budget;
+        double start = now();
+        if (probe) {
+            batch_query_forest_knn_probe(f, feat_array, points, BENCH_FEATURES, num_points, RBF_L2, k, probe_budget,
+                                         ids, dists, counts);
+        } else {
+            batch_query_forest_knn(f, feat_array, points, BENCH_FEATURES, num_points, RBF_L2, k, 0, ids, dists, counts);
+        }
+        double elapsed = now() - start;
+        size_t found = 0;
+        for (size_t i = 0; i < num_points; i++) {
+            for (size_t j = 0; j < counts[i]; j++) {
+                found += (dists[i * k + j] <= exact_dists[i * k + k - 1]);
+            }
+        }
+        size_t index_bytes = 0;
+        for (size_t t = 0; t < f->config->num_trees; t++) {
+            index_bytes += sizeof(rownum_type) * (f->trees[t].num_rows + 2 * f->trees[t].tree_size)
+                           + sizeof(nodenum_type) * f->trees[t].tree_size + sizeof(rownum_type) * f->trees[t].tree_size;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), probe ? "%zu trees, probing %zu candidates" : "%zu trees", f->config->num_trees, probe_budget);
+        printf("%34s %8.3f %12.0f %12.1f\n", name, (double) found / (num_points * k), num_points / elapsed, index_bytes / 1e6);
+    }
+    free(feat_array);
+    free(columns);
+    free(points);
+    free(all_rows);
+    free(all_dists);
+    free(exact_ids);
+    free(exact_dists);
+    free(leaves);
+    free(ids);
+    free(dists);
+    free(counts);
+    free_forest(forest);    // (small_forest shares its trees)
+}
+
+
+/*
+ * kNN re-ranking reading the candidates from the reference points (one cache miss per candidate)
+ * vs from the forest's copy in its first tree's leaf order (see store_ordered_points), where that
+ * tree's candidates are next to each other, for subtrees of various sizes.
+ */
+static void bench_ordered() {
+    size_t num_points = 300, k = 10;
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    feature_type *ref_points = transpose(feat_array, BENCH_FEATURES, BENCH_ROWS);
+    feature_type *points = random_features(num_points * BENCH_FEATURES);
+    RbfConfig config = {4, 20, 4, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719};
+    RandomBinaryForest *forest = train_forest(feat_array, &config);
+    rownum_type min_tree_rows[] = {0, 256, 2048};
+    double times[2][3];
+    for (int ordered = 0; ordered < 2; ordered++) {
+        if (ordered) {
+            double start = now();
+            store_ordered_points(forest, ref_points);
+            printf("store_ordered_points: %.3f seconds\n", now() - start);
+        }
+        rownum_type *ids = (rownum_type *) malloc(sizeof(rownum_type) * num_points * k);
+        double *dists = (double *) malloc(sizeof(double) * num_points * k);
+        size_t *counts = (size_t *) malloc(sizeof(size_t) * num_points);
+        for (size_t m = 0; m < 3; m++) {
+            double start = now();
+            batch_query_forest_knn(forest, ordered ? NULL : ref_points, points, BENCH_FEATURES, num_points, RBF_L2, k,
+                                   min_tree_rows[m], ids, dists, counts);
+            times[ordered][m] = now() - start;
+        }
+        free(ids);
+        free(dists);
+        free(counts);
+    }
+    printf("%zu nearest neighbors (%zu trees), queries per second:\n", k, config.num_trees);
+    printf("%14s %14s %14s %8s\n", "min tree rows", "ref points", "ordered", "speedup");
+    for (size_t m = 0; m < 3; m++) {
+        printf("%14d %14.0f %14.0f %7.2fx\n", min_tree_rows[m], num_points / times[0][m], num_points / times[1][m],
+               times[0][m] / times[1][m]);
+    }
+    free_forest(forest);
+    free(feat_array);
+    free(ref_points);
+    free(points);
+}
+
+
+/*
+ * Re-ranking: one query against many candidate rows, with each set of distance kernels this CPU
+ * supports ("scalar" is the plain loop l2_square_dist used to be, however the compiler vectorizes it).
+ */
+static void bench_distances() {
+    size_t num_candidates = 1024, reps = 800;
+    feature_type *ref_points = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    feature_type *query = random_features(BENCH_FEATURES);
+    rownum_type *rows = shuffled_row_index(BENCH_ROWS);
+    int *dists = (int *) malloc(sizeof(int) * num_candidates);
+    printf("distances to %zu candidates (%d features), ns per candidate:\n", num_candidates, BENCH_FEATURES);
+    printf("%12s %35s %35s\n", "", "random candidates", "cached candidates");
+    printf("%12s %8s %8s %8s %8s %8s %8s %8s %8s\n", "kernels",
+           "l2^2", "l1", "dot", "hamming", "l2^2", "l1", "dot", "hamming");
+    for (size_t k = 0; k < num_distance_kernel_sets; k++) {
+        const distance_kernels *kernels = &(distance_kernel_sets[k]);
+        if (!kernels->cpu_supports()) {
+            continue;
+        }
+        u8_dists_fn many[4] = {kernels->l2_square_many, kernels->l1_many, kernels->dot_many, kernels->hamming_many};
+        double times[8];
+        for (int metric = 0; metric < 8; metric++) {
+            double start = now();
+            for (size_t rep = 0; rep < reps; rep++) {
+                // random candidates from all the rows, then the same few (so cached) ones over and over:
+                size_t first_candidate = (metric < 4) ? (rep * num_candidates) % (BENCH_ROWS - num_candidates) : 0;
+                many[metric % 4](query, ref_points, BENCH_FEATURES, &(rows[first_candidate]), num_candidates, dists);
+            }
+            times[metric] = (now() - start) * 1e9 / (reps * num_candidates);
+        }
+        printf("%12s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", kernels->name,
+               times[0], times[1], times[2], times[3], times[4], times[5], times[6], times[7]);
+    }
+    free(ref_points);
+    free(query);
+    free(rows);
+    free(dists);
+}
+
+
+/*
+ * Training time with every node sampling its own features vs nodes sharing their parent's features
+ * for a few levels, so that one child's histograms come from subtracting its sibling's.
+ */
+static void bench_train() {
+    feature_type *feat_array = random_features((size_t) BENCH_ROWS * BENCH_FEATURES);
+    size_t share_levels[] = {0, 2, 4, 8};
+    printf("training (4 trees, %d features per node), seconds:\n", BENCH_FEATURES_TO_COMPARE);
+    printf("%14s %10s\n", "share levels", "time");
+    for (size_t i = 0; i < sizeof(share_levels) / sizeof(share_levels[0]); i++) {
+        RbfConfig config = {4, 20, 4, BENCH_ROWS, BENCH_FEATURES, BENCH_FEATURES_TO_COMPARE, false, 2719, 0,
+                            share_levels[i]};
+        double start = now();
+        RandomBinaryForest *forest = train_forest(feat_array, &config);
+        printf("%14zu %10.3f\n", share_levels[i], now() - start);
+        free_forest(forest);
+    }
+    free(feat_array);
+}
+
+
+// transpose as it was: a byte at a time, with every write to a different output row.
+static void naive_transpose(const feature_type *input, size_t rows, size_t cols, feature_type *output) {
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t j = 0; j < cols; j++) {
+            output[j * rows + i] = input[i * cols + j];
+        }
+    }
+}
+
+/*
+ * Transposing row-major training data for train_forest: the byte-at-a-time loop vs the tiled SIMD
+ * transpose_into, single-threaded and with all threads, for fashion-MNIST's shape and a bigger one.
+ */
+static void bench_transpose() {
+    size_t shapes[][2] = {{BENCH_ROWS, BENCH_FEATURES}, {151511, 37 * 37}};
+    int max_threads = omp_get_max_threads();
+    printf("transpose, seconds:\n");
+    printf("%16s %10s %10s %10s\n", "rows x cols", "naive", "tiled x1", "tiled xN");
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        size_t rows = shapes[s][0], cols = shapes[s][1];
+        feature_type *input = random_features(rows * cols);
+        feature_type *naive_output = (feature_type *) malloc(rows * cols);
+        feature_type *output = (feature_type *) malloc(rows * cols);
+        memset(naive_output, 0, rows * cols);   // (so no run pays for first-touch page faults)
+        memset(output, 0, rows * cols);
+
+        double start = now();
+        naive_transpose(input, rows, cols, naive_output);
+        double naive_time = now() - start;
+        omp_set_num_threads(1);
+        start = now();
+        transpose_into(input, rows, cols, output);
+        double tiled_time = now() - start;
+        omp_set_num_threads(max_threads);
+        start = now();
+        transpose_into(input, rows, cols, output);
+        double parallel_time = now() - start;
+
+        char shape[32];
+        snprintf(shape, sizeof(shape), "%zu x %zu", rows, cols);
+        printf("%16s %10.3f %10.3f %10.3f%s\n", shape, naive_time, tiled_time, parallel_time,
+               (memcmp(naive_output, output, rows * cols) == 0) ? "" : "  MISMATCH");
+        free(input);
+        free(naive_output);
+        free(output);
+    }
+    printf("(N = %d threads)\n", max_threads);
+}
+
+
+int main() {
+    bench_bins();
+    bench_partition();
+    bench_query();
+    bench_interleaved();
+    bench_rerank();
+    bench_dedup();
+    bench_parallel_query();
+    bench_probe();
+    bench_ordered();
+    bench_distances();
+    bench_train();
+    bench_transpose();
+    return 0;
+}
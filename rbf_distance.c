@@ -0,0 +1,426 @@
+/*
+ * Distances between uint8 feature vectors: squared L2, L1 (Manhattan) and dot product.
+ *
+ * There's a set of kernels per instruction set (see distance_kernel_sets), and we pick the best
+ * one the CPU supports once, when the library is loaded, rather than whatever the compiler targets.
+ * That only goes for these kernels: the Makefile still builds with -march=native, and the tree walk
+ * (find_leaves_lanes) picks its gathers at compile time, so the library isn't portable as built.
+ * Each set also has a one-vs-many version of each kernel, for re-ranking a query's candidates: it
+ * runs the candidates through the kernel inlined, and prefetches the next ones' rows.
+ *
+ * - L1 uses vpsadbw, which sums 8 absolute byte differences per 64-bit lane in one instruction.
+ * - L2 gets |a - b| as bytes from two saturating subtractions, widens it to 16 bits, and squares
+ *   and adds pairs with vpmaddwd (or, with AVX-512 VNNI, squares and accumulates with vpdpwssd).
+ *   (vpmaddubsw would square the bytes directly, but treats one operand as signed, so it
+ *   only works for differences below 128.)
+ * - dot widens both vectors to 16 bits and uses vpmaddwd/vpdpwssd the same way. (VNNI's byte dot
+ *   product, vpdpbusd, is unsigned times signed, so it doesn't fit uint8 x uint8 either.)
+ * - Hamming (for binarized features, 8 to a byte) counts the bits set in a ^ b: with SIMD, a
+ *   nibble at a time by table lookup (vpshufb), then sums the counts with vpsadbw.
+ * Sums are ints: with 784 features, the biggest possible is 784 * 255^2, about 51 million.
+ *
+ * rbf_distances turns these into the distances for each RbfMetric.
+ */
+
+#include <assert.h>
+#include <immintrin.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rbf.h"
+#include "_rbf_distance.h"
+
+
+// Portable versions:
+
+static int l2_square_dist_scalar(const feature_type *v1, const feature_type *v2, size_t dim) {
+    int sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < dim; i++) {
+        int coord_diff = (int) v1[i] - (int) v2[i];
+        sum += coord_diff * coord_diff;
+    }
+    return sum;
+}
+
+static int l1_dist_scalar(const feature_type *v1, const feature_type *v2, size_t dim) {
+    int sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < dim; i++) {
+        int coord_diff = (int) v1[i] - (int) v2[i];
+        sum += (coord_diff < 0) ? -coord_diff : coord_diff;
+    }
+    return sum;
+}
+
+static int dot_scalar(const feature_type *v1, const feature_type *v2, size_t dim) {
+    int sum = 0;
+    #pragma omp simd reduction(+:sum)
+    for (size_t i = 0; i < dim; i++) {
+        sum += (int) v1[i] * (int) v2[i];
+    }
+    return sum;
+}
+
+static int hamming_dist_scalar(const feature_type *v1, const feature_type *v2, size_t dim) {
+    int sum = 0;
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        uint64_t word_1, word_2;
+        memcpy(&word_1, &(v1[i]), 8);
+        memcpy(&word_2, &(v2[i]), 8);
+        sum += __builtin_popcountll(word_1 ^ word_2);
+    }
+    for (; i < dim; i++) {
+        sum += __builtin_popcount(v1[i] ^ v2[i]);
+    }
+    return sum;
+}
+
+
+// AVX2: 32 bytes at a time, then the rest one at a time.
+
+__attribute__((target("avx2")))
+static inline int hsum_epi32_avx2(__m256i v) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+static inline int l2_square_dist_avx2(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &(v1[i]));
+        __m256i b = _mm256_loadu_si256((const __m256i *) &(v2[i]));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+        __m256i diff_lo = _mm256_unpacklo_epi8(diff, zero);
+        __m256i diff_hi = _mm256_unpackhi_epi8(diff, zero);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff_lo, diff_lo));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff_hi, diff_hi));
+    }
+    return hsum_epi32_avx2(acc) + l2_square_dist_scalar(&(v1[i]), &(v2[i]), dim - i);
+}
+
+__attribute__((target("avx2")))
+static inline int l1_dist_avx2(const feature_type *v1, const feature_type *v2, size_t dim) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &(v1[i]));
+        __m256i b = _mm256_loadu_si256((const __m256i *) &(v2[i]));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(a, b));
+    }
+    // the 64-bit sums are far too small to overflow 32 bits, so only their low halves matter:
+    return hsum_epi32_avx2(acc) + l1_dist_scalar(&(v1[i]), &(v2[i]), dim - i);
+}
+
+__attribute__((target("avx2")))
+static inline int dot_avx2(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) &(v1[i]));
+        __m256i b = _mm256_loadu_si256((const __m256i *) &(v2[i]));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero)));
+    }
+    return hsum_epi32_avx2(acc) + dot_scalar(&(v1[i]), &(v2[i]), dim - i);
+}
+
+__attribute__((target("avx2")))
+static inline int hamming_dist_avx2(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &(v1[i])),
+                                        _mm256_loadu_si256((const __m256i *) &(v2[i])));
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(diff, low_nibbles)),
+                                         _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(diff, 4), low_nibbles)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    return hsum_epi32_avx2(acc) + hamming_dist_scalar(&(v1[i]), &(v2[i]), dim - i);
+}
+
+
+// AVX-512BW: 64 bytes at a time, with a masked load for the rest.
+
+__attribute__((target("avx512bw")))
+static inline __mmask64 tail_mask_avx512(size_t remaining) {
+    return (remaining >= 64) ? ~(__mmask64) 0 : (((__mmask64) 1 << remaining) - 1);
+}
+
+__attribute__((target("avx512bw")))
+static inline int l2_square_dist_avx512(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero;
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i a = _mm512_maskz_loadu_epi8(mask, &(v1[i]));
+        __m512i b = _mm512_maskz_loadu_epi8(mask, &(v2[i]));
+        __m512i diff = _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+        __m512i diff_lo = _mm512_unpacklo_epi8(diff, zero);
+        __m512i diff_hi = _mm512_unpackhi_epi8(diff, zero);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff_lo, diff_lo));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff_hi, diff_hi));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+__attribute__((target("avx512bw")))
+static inline int l1_dist_avx512(const feature_type *v1, const feature_type *v2, size_t dim) {
+    __m512i acc = _mm512_setzero_si512();
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i a = _mm512_maskz_loadu_epi8(mask, &(v1[i]));
+        __m512i b = _mm512_maskz_loadu_epi8(mask, &(v2[i]));
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(a, b));
+    }
+    return (int) _mm512_reduce_add_epi64(acc);
+}
+
+__attribute__((target("avx512bw")))
+static inline int dot_avx512(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero;
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i a = _mm512_maskz_loadu_epi8(mask, &(v1[i]));
+        __m512i b = _mm512_maskz_loadu_epi8(mask, &(v2[i]));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_unpacklo_epi8(a, zero), _mm512_unpacklo_epi8(b, zero)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_unpackhi_epi8(a, zero), _mm512_unpackhi_epi8(b, zero)));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+__attribute__((target("avx512bw")))
+static inline int hamming_dist_avx512(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m512i nibble_counts = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low_nibbles = _mm512_set1_epi8(0x0f);
+    __m512i acc = _mm512_setzero_si512();
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i diff = _mm512_xor_si512(_mm512_maskz_loadu_epi8(mask, &(v1[i])), _mm512_maskz_loadu_epi8(mask, &(v2[i])));
+        __m512i counts = _mm512_add_epi8(_mm512_shuffle_epi8(nibble_counts, _mm512_and_si512(diff, low_nibbles)),
+                                         _mm512_shuffle_epi8(nibble_counts, _mm512_and_si512(_mm512_srli_epi16(diff, 4), low_nibbles)));
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(counts, _mm512_setzero_si512()));
+    }
+    return (int) _mm512_reduce_add_epi64(acc);
+}
+
+
+// AVX-512 VNNI: as AVX-512BW, but multiplying and accumulating in one instruction.
+// (With two accumulators, so each vpdpwssd doesn't wait for the last one.)
+
+__attribute__((target("avx512bw,avx512vnni")))
+static inline int l2_square_dist_vnni(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero, acc_2 = zero;
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i a = _mm512_maskz_loadu_epi8(mask, &(v1[i]));
+        __m512i b = _mm512_maskz_loadu_epi8(mask, &(v2[i]));
+        __m512i diff = _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+        __m512i diff_lo = _mm512_unpacklo_epi8(diff, zero);
+        __m512i diff_hi = _mm512_unpackhi_epi8(diff, zero);
+        acc = _mm512_dpwssd_epi32(acc, diff_lo, diff_lo);
+        acc_2 = _mm512_dpwssd_epi32(acc_2, diff_hi, diff_hi);
+    }
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(acc, acc_2));
+}
+
+__attribute__((target("avx512bw,avx512vnni")))
+static inline int dot_vnni(const feature_type *v1, const feature_type *v2, size_t dim) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = zero, acc_2 = zero;
+    for (size_t i = 0; i < dim; i += 64) {
+        __mmask64 mask = tail_mask_avx512(dim - i);
+        __m512i a = _mm512_maskz_loadu_epi8(mask, &(v1[i]));
+        __m512i b = _mm512_maskz_loadu_epi8(mask, &(v2[i]));
+        acc = _mm512_dpwssd_epi32(acc, _mm512_unpacklo_epi8(a, zero), _mm512_unpacklo_epi8(b, zero));
+        acc_2 = _mm512_dpwssd_epi32(acc_2, _mm512_unpackhi_epi8(a, zero), _mm512_unpackhi_epi8(b, zero));
+    }
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(acc, acc_2));
+}
+
+// (L1 and Hamming have no multiplies, so VNNI doesn't help.)
+__attribute__((target("avx512bw,avx512vnni")))
+static inline int l1_dist_vnni(const feature_type *v1, const feature_type *v2, size_t dim) {
+    return l1_dist_avx512(v1, v2, dim);
+}
+
+__attribute__((target("avx512bw,avx512vnni")))
+static inline int hamming_dist_vnni(const feature_type *v1, const feature_type *v2, size_t dim) {
+    return hamming_dist_avx512(v1, v2, dim);
+}
+
+
+// One query vs many candidate rows of ref_points (row-major, dim features per row).
+#define DEFINE_DISTS(name, kernel, attributes) \
+    attributes static void name(const feature_type *query, const feature_type *ref_points, size_t dim, \
+            const rownum_type *rows, size_t num_rows, int *ret_dists) { \
+        for (size_t i = 0; i < num_rows; i++) { \
+            if (i + DIST_PREFETCH_ROWS < num_rows) { \
+                const feature_type *next_row = &(ref_points[(size_t) rows[i + DIST_PREFETCH_ROWS] * dim]); \
+                for (size_t line = 0; line < dim; line += 64) { \
+                    __builtin_prefetch(&(next_row[line])); \
+                } \
+            } \
+            ret_dists[i] = kernel(query, &(ref_points[(size_t) rows[i] * dim]), dim); \
+        } \
+    }
+
+#define DIST_PREFETCH_ROWS 4
+#define DIST_CHUNK_ROWS 64
+
+DEFINE_DISTS(l2_square_dists_scalar, l2_square_dist_scalar, )
+DEFINE_DISTS(l1_dists_scalar, l1_dist_scalar, )
+DEFINE_DISTS(dots_scalar, dot_scalar, )
+DEFINE_DISTS(hamming_dists_scalar, hamming_dist_scalar, )
+DEFINE_DISTS(l2_square_dists_avx2, l2_square_dist_avx2, __attribute__((target("avx2"))))
+DEFINE_DISTS(l1_dists_avx2, l1_dist_avx2, __attribute__((target("avx2"))))
+DEFINE_DISTS(dots_avx2, dot_avx2, __attribute__((target("avx2"))))
+DEFINE_DISTS(hamming_dists_avx2, hamming_dist_avx2, __attribute__((target("avx2"))))
+DEFINE_DISTS(l2_square_dists_avx512, l2_square_dist_avx512, __attribute__((target("avx512bw"))))
+DEFINE_DISTS(l1_dists_avx512, l1_dist_avx512, __attribute__((target("avx512bw"))))
+DEFINE_DISTS(dots_avx512, dot_avx512, __attribute__((target("avx512bw"))))
+DEFINE_DISTS(hamming_dists_avx512, hamming_dist_avx512, __attribute__((target("avx512bw"))))
+DEFINE_DISTS(l2_square_dists_vnni, l2_square_dist_vnni, __attribute__((target("avx512bw,avx512vnni"))))
+DEFINE_DISTS(l1_dists_vnni, l1_dist_vnni, __attribute__((target("avx512bw,avx512vnni"))))
+DEFINE_DISTS(dots_vnni, dot_vnni, __attribute__((target("avx512bw,avx512vnni"))))
+DEFINE_DISTS(hamming_dists_vnni, hamming_dist_vnni, __attribute__((target("avx512bw,avx512vnni"))))
+
+
+static bool cpu_has_vnni() {
+    return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni");
+}
+
+static bool cpu_has_avx512() {
+    return __builtin_cpu_supports("avx512bw");
+}
+
+static bool cpu_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool cpu_has_anything() {
+    return true;
+}
+
+
+// Best first.
+const distance_kernels distance_kernel_sets[] = {
+    {"avx512vnni", cpu_has_vnni, l2_square_dist_vnni, l1_dist_vnni, dot_vnni, hamming_dist_vnni,
+                                 l2_square_dists_vnni, l1_dists_vnni, dots_vnni, hamming_dists_vnni},
+    {"avx512bw", cpu_has_avx512, l2_square_dist_avx512, l1_dist_avx512, dot_avx512, hamming_dist_avx512,
+                                 l2_square_dists_avx512, l1_dists_avx512, dots_avx512, hamming_dists_avx512},
+    {"avx2", cpu_has_avx2, l2_square_dist_avx2, l1_dist_avx2, dot_avx2, hamming_dist_avx2,
+                           l2_square_dists_avx2, l1_dists_avx2, dots_avx2, hamming_dists_avx2},
+    {"scalar", cpu_has_anything, l2_square_dist_scalar, l1_dist_scalar, dot_scalar, hamming_dist_scalar,
+                                 l2_square_dists_scalar, l1_dists_scalar, dots_scalar, hamming_dists_scalar},
+};
+const size_t num_distance_kernel_sets = sizeof(distance_kernel_sets) / sizeof(distance_kernel_sets[0]);
+
+static const distance_kernels *kernels = &(distance_kernel_sets[sizeof(distance_kernel_sets) / sizeof(distance_kernel_sets[0]) - 1]);
+
+__attribute__((constructor))
+static void select_distance_kernels() {
+    __builtin_cpu_init();
+    for (size_t i = 0; i < num_distance_kernel_sets; i++) {
+        if (distance_kernel_sets[i].cpu_supports()) {
+            kernels = &(distance_kernel_sets[i]);
+            return;
+        }
+    }
+}
+
+const distance_kernels *best_distance_kernels() {
+    return kernels;
+}
+
+
+int l2_square_dist_u8(const feature_type *v1, const feature_type *v2, size_t dim) {
+    return kernels->l2_square(v1, v2, dim);
+}
+
+int l1_dist_u8(const feature_type *v1, const feature_type *v2, size_t dim) {
+    return kernels->l1(v1, v2, dim);
+}
+
+int dot_u8(const feature_type *v1, const feature_type *v2, size_t dim) {
+    return kernels->dot(v1, v2, dim);
+}
+
+void l2_square_dists_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists) {
+    kernels->l2_square_many(query, ref_points, dim, rows, num_rows, ret_dists);
+}
+
+void l1_dists_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists) {
+    kernels->l1_many(query, ref_points, dim, rows, num_rows, ret_dists);
+}
+
+void dots_u8(const feature_type *query, const feature_type *ref_points, size_t dim,
+        const rownum_type *rows, size_t num_rows, int *ret_dists) {
+    kernels->dot_many(query, ref_points, dim, rows, num_rows, ret_dists);
+}
+
+
+/*
+ * Distances from a query point to many rows of ref_points (row-major), by the given metric, so
+ * that smaller is always nearer:
+ * - RBF_L2: squared Euclidean distance
+ * - RBF_L1: Manhattan distance
+ * - RBF_COSINE: 1 - cosine similarity (and 1 if either vector is all 0s)
+ * - RBF_DOT: minus the inner product
+ * - RBF_HAMMING: the number of differing bits, for binarized features packed 8 to a byte
+ * The integer metrics go through the one-vs-many kernels a chunk of rows at a time. For RBF_COSINE,
+ * ref_norms (if not NULL) has the norms of ref_points' rows (see store_ordered_points); otherwise
+ * each row's norm takes a second pass over it.
+ */
+void rbf_distances(RbfMetric metric, const feature_type *query, const feature_type *ref_points, size_t point_dimension,
+        const rownum_type *rows, size_t num_rows, const double *ref_norms, double *ret_dists) {
+    assert(point_dimension <= RBF_MAX_DISTANCE_DIMENSION);
+    int chunk_dists[DIST_CHUNK_ROWS];
+    double query_norm = (metric == RBF_COSINE) ? sqrt((double) kernels->dot(query, query, point_dimension)) : 0;
+    for (size_t chunk_start = 0; chunk_start < num_rows; chunk_start += DIST_CHUNK_ROWS) {
+        size_t chunk_rows = (num_rows - chunk_start < DIST_CHUNK_ROWS) ? num_rows - chunk_start : DIST_CHUNK_ROWS;
+        const rownum_type *chunk = &(rows[chunk_start]);
+        switch (metric) {
+            case RBF_L2:
+                kernels->l2_square_many(query, ref_points, point_dimension, chunk, chunk_rows, chunk_dists);
+                break;
+            case RBF_L1:
+                kernels->l1_many(query, ref_points, point_dimension, chunk, chunk_rows, chunk_dists);
+                break;
+            case RBF_HAMMING:
+                kernels->hamming_many(query, ref_points, point_dimension, chunk, chunk_rows, chunk_dists);
+                break;
+            case RBF_COSINE:
+            case RBF_DOT:
+                kernels->dot_many(query, ref_points, point_dimension, chunk, chunk_rows, chunk_dists);
+                break;
+        }
+        for (size_t i = 0; i < chunk_rows; i++) {
+            double dist = chunk_dists[i];
+            if (metric == RBF_DOT) {
+                dist = -dist;
+            } else if (metric == RBF_COSINE) {
+                const feature_type *row = &(ref_points[(size_t) chunk[i] * point_dimension]);
+                double norms = query_norm * (ref_norms ? ref_norms[chunk[i]]
+                                             : sqrt((double) kernels->dot(row, row, point_dimension)));
+                dist = (norms > 0) ? 1 - dist / norms : 1;
+            }
+            ret_dists[chunk_start + i] = dist;
+        }
+    }
+}
+
@@ -1 +1,489 @@
+/*
+ * Saving and loading forests, and training from feature files.
+ *
+ * File layout (all integers in native byte order, so files aren't portable across endianness):
+ * - an rbf_file_header with the magic string, the format version and the forest's config (what
+ *   queries use of it; the training-only settings task_min_rows and share_features_levels aren't kept)
+ * - one rbf_file_tree_header per tree, giving the tree's sizes and the file offsets of its arrays
+ * - the tree arrays themselves (row_index, tree_first, tree_second, tree_child, tree_split), each starting on an
+ *   RBF_FILE_ALIGNMENT boundary. row_index is stored bit-packed if the tree's row index is packed.
+ *
+ * `load_forest` mmaps the file read-only and points each tree's arrays straight into the mapping,
+ * so loading costs page faults instead of a retrain, and processes loading the same file share one
+ * copy of the index through the page cache. A loaded forest can be queried but not modified.
+ * Since a corrupt file could otherwise send queries out of bounds, loading reads through every tree
+ * once to check it (see tree_nodes_valid).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "rbf.h"
+#include "_rbf_io.h"
+#include "_rbf_utils.h"
+
+
+#define RBF_FILE_MAGIC "RBFOREST"
+#define RBF_FILE_VERSION 6
+#define RBF_FILE_ALIGNMENT 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t alignment;
+    uint64_t num_trees;
+    uint64_t tree_depth;
+    uint64_t leaf_size;
+    uint64_t seed;
+    int32_t num_rows;
+    int32_t num_features;
+    int32_t num_features_to_compare;
+    uint32_t pack_row_index;
+    uint64_t parallel_query_min_trees;
+} rbf_file_header;
+
+typedef struct {
+    uint64_t tree_size;
+    uint64_t num_internal_nodes;
+    uint64_t num_leaves;
+    uint64_t row_index_bits;        // 0 if the row index isn't packed
+    uint64_t row_index_offset;
+    uint64_t tree_first_offset;
+    uint64_t tree_second_offset;
+    uint64_t tree_child_offset;
+    uint64_t tree_split_offset;
+} rbf_file_tree_header;
+
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + RBF_FILE_ALIGNMENT - 1) & ~((uint64_t) RBF_FILE_ALIGNMENT - 1);
+}
+
+
+// Size in bytes of a tree's row index, packed or not.
+static uint64_t row_index_bytes(const RandomBinaryTree *tree) {
+    if (tree->packed_row_index) {
+        return packed_row_index_size(tree->num_rows, tree->row_index_bits);
+    }
+    return sizeof(rownum_type) * tree->num_rows;
+}
+
+
+// Write `size` bytes of `data` at file position `offset`, zero-padding from the current position.
+static bool write_at(FILE *f, uint64_t *pos, uint64_t offset, const void *data, size_t size) {
+    static const char zeros[RBF_FILE_ALIGNMENT] = {0};
+    if (fwrite(zeros, 1, offset - *pos, f) != offset - *pos) {
+        return false;
+    }
+    if (fwrite(data, 1, size, f) != size) {
+        return false;
+    }
+    *pos = offset + size;
+    return true;
+}
+
+
+/*
+ * Save a trained forest to `filename` (see the top of this file for the layout).
+ * Returns false (after printing the reason to stderr) if the file couldn't be written.
+ */
+bool save_forest(const RandomBinaryForest *forest, const char *filename) {
+    const RbfConfig *cfg = forest->config;
+    rbf_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RBF_FILE_MAGIC, sizeof(header.magic));
+    header.version = RBF_FILE_VERSION;
+    header.alignment = RBF_FILE_ALIGNMENT;
+    header.num_trees = cfg->num_trees;
+    header.tree_depth = cfg->tree_depth;
+    header.leaf_size = cfg->leaf_size;
+    header.seed = cfg->seed;
+    header.num_rows = cfg->num_rows;
+    header.num_features = cfg->num_features;
+    header.num_features_to_compare = cfg->num_features_to_compare;
+    header.pack_row_index = cfg->pack_row_index;
+    header.parallel_query_min_trees = cfg->parallel_query_min_trees;
+
+    rbf_file_tree_header *tree_headers = (rbf_file_tree_header *) calloc(sizeof(rbf_file_tree_header), cfg->num_trees);
+    if (!tree_headers) {
+        die_alloc_err("save_forest", "tree_headers");
+    }
+    uint64_t offset = sizeof(rbf_file_header) + sizeof(rbf_file_tree_header) * cfg->num_trees;
+    for (size_t i = 0; i < cfg->num_trees; i++) {
+        const RandomBinaryTree *tree = &(forest->trees[i]);
+        tree_headers[i].tree_size = tree->tree_size;
+        tree_headers[i].num_internal_nodes = tree->num_internal_nodes;
+        tree_headers[i].num_leaves = tree->num_leaves;
+        tree_headers[i].row_index_bits = tree->packed_row_index ? tree->row_index_bits : 0;
+        tree_headers[i].row_index_offset = align_offset(offset);
+        offset = tree_headers[i].row_index_offset + row_index_bytes(tree);
+        tree_headers[i].tree_first_offset = align_offset(offset);
+        offset = tree_headers[i].tree_first_offset + sizeof(rownum_type) * tree->tree_size;
+        tree_headers[i].tree_second_offset = align_offset(offset);
+        offset = tree_headers[i].tree_second_offset + sizeof(rownum_type) * tree->tree_size;
+        tree_headers[i].tree_child_offset = align_offset(offset);
+        offset = tree_headers[i].tree_child_offset + sizeof(nodenum_type) * tree->tree_size;
+        tree_headers[i].tree_split_offset = align_offset(offset);
+        offset = tree_headers[i].tree_split_offset + sizeof(rownum_type) * tree->tree_size;
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        free(tree_headers);
+        return false;
+    }
+    uint64_t pos = 0;
+    bool ok = write_at(f, &pos, 0, &header, sizeof(header))
+              && write_at(f, &pos, pos, tree_headers, sizeof(rbf_file_tree_header) * cfg->num_trees);
+    for (size_t i = 0; ok && (i < cfg->num_trees); i++) {
+        const RandomBinaryTree *tree = &(forest->trees[i]);
+        const void *row_index = tree->packed_row_index ? (const void *) tree->packed_row_index : (const void *) tree->row_index;
+        ok = write_at(f, &pos, tree_headers[i].row_index_offset, row_index, row_index_bytes(tree))
+             && write_at(f, &pos, tree_headers[i].tree_first_offset, tree->tree_first, sizeof(rownum_type) * tree->tree_size)
+             && write_at(f, &pos, tree_headers[i].tree_second_offset, tree->tree_second, sizeof(rownum_type) * tree->tree_size)
+             && write_at(f, &pos, tree_headers[i].tree_child_offset, tree->tree_child, sizeof(nodenum_type) * tree->tree_size)
+             && write_at(f, &pos, tree_headers[i].tree_split_offset, tree->tree_split, sizeof(rownum_type) * tree->tree_size);
+    }
+    free(tree_headers);
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "save_forest: error writing %s\n", filename);
+    }
+    return ok;
+}
+
+
+// Check that the array of `count` `elem_size`-sized elements at `offset` lies within the file.
+static bool array_in_file(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t file_size) {
+    return (offset % RBF_FILE_ALIGNMENT == 0) && (offset <= file_size)
+            && (count <= (file_size - offset) / elem_size);
+}
+
+
+// Check that every entry of a loaded tree's row index (packed or not) is a row number.
+static bool row_index_valid(const RandomBinaryTree *tree) {
+    rownum_type block[4096];
+    bool ok = true;
+    for (rownum_type start = 0; ok && (start < tree->num_rows); start += 4096) {
+        rownum_type end = (tree->num_rows - start < 4096) ? tree->num_rows : start + 4096;
+        const rownum_type *rows = tree->row_index ? &(tree->row_index[start]) : block;
+        if (!tree->row_index) {
+            unpack_row_index(tree->packed_row_index, tree->row_index_bits, start, end, block);
+        }
+        for (rownum_type i = 0; i < end - start; i++) {
+            ok = ok && (rows[i] >= 0) && (rows[i] < tree->num_rows);
+        }
+    }
+    return ok;
+}
+
+/*
+ * Check a loaded tree's nodes, so that a corrupt file can't send a query outside the tree arrays,
+ * the row index or the query point. Children are always stored after their parent (see add_nodes),
+ * so one pass in node order can hand each node its view of the row index from its parent and check:
+ * every node is reached exactly once, internal nodes' feature numbers are < num_features and their
+ * children and splits are in range, and leaves' row ranges are exactly their views. Then check its
+ * row index too.
+ */
+bool tree_nodes_valid(const RandomBinaryTree *tree, colnum_type num_features) {
+    treeindex_type tree_size = tree->tree_size;
+    if ((tree_size == 0) || (tree_size > UINT32_MAX)
+            || (tree->num_internal_nodes + tree->num_leaves != tree_size)) {
+        return false;
+    }
+    rownum_type *view_start = (rownum_type *) malloc(sizeof(rownum_type) * tree_size);
+    rownum_type *view_end = (rownum_type *) malloc(sizeof(rownum_type) * tree_size);
+    if (!view_start || !view_end) {
+        die_alloc_err("tree_nodes_valid", "view_start || view_end");
+    }
+    for (treeindex_type n = 0; n < tree_size; n++) {
+        view_start[n] = -1;     // not reached yet
+    }
+    view_start[0] = 0;
+    view_end[0] = tree->num_rows;
+    treeindex_type num_internal_nodes = 0;
+    bool ok = true;
+    for (treeindex_type n = 0; ok && (n < tree_size); n++) {
+        rownum_type start = view_start[n], end = view_end[n];
+        rownum_type first = tree->tree_first[n], second = tree->tree_second[n];
+        if (start < 0) {
+            ok = false;
+        } else if (first >> HIGH_BIT != 0) {
+            ok = (second >> HIGH_BIT != 0) && ((HIGH_BIT_1 ^ first) == start) && ((HIGH_BIT_1 ^ second) == end);
+        } else {
+            uint64_t child = tree->tree_child[n];
+            rownum_type split = tree->tree_split[n];
+            ok = (first < num_features) && (child > n) && (child + 1 < tree_size)
+                    && (view_start[child] < 0) && (view_start[child + 1] < 0) && (start <= split) && (split <= end);
+            if (ok) {
+                view_start[child] = start;
+                view_end[child] = split;
+                view_start[child + 1] = split;
+                view_end[child + 1] = end;
+                num_internal_nodes += 1;
+            }
+        }
+    }
+    free(view_start);
+    free(view_end);
+    return ok && (num_internal_nodes == tree->num_internal_nodes) && row_index_valid(tree);
+}
+
+
+/*
+ * Load a forest saved by `save_forest`. The file is mmap'ed read-only and the tree arrays point
+ * into the mapping, so the file must not be modified while the forest is in use.
+ * Returns NULL (after printing the reason to stderr) if the file can't be read or is malformed:
+ * a wrong header, arrays that don't fit in the file, or trees that fail tree_nodes_valid.
+ */
+RandomBinaryForest *load_forest(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(filename);
+        close(fd);
+        return NULL;
+    }
+    uint64_t file_size = (uint64_t) st.st_size;
+    if (file_size < sizeof(rbf_file_header)) {
+        fprintf(stderr, "load_forest: %s is too small to be a forest file\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps its own reference to the file
+    if (mapping == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+
+    const rbf_file_header *header = (const rbf_file_header *) mapping;
+    if (memcmp(header->magic, RBF_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "load_forest: %s is not a forest file\n", filename);
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    if ((header->version != RBF_FILE_VERSION) || (header->alignment != RBF_FILE_ALIGNMENT)) {
+        fprintf(stderr, "load_forest: %s has unsupported version %u\n", filename, header->version);
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    if ((header->num_trees > (file_size - sizeof(rbf_file_header)) / sizeof(rbf_file_tree_header))
+            || (header->num_rows < 0)) {
+        fprintf(stderr, "load_forest: %s is truncated or corrupt\n", filename);
+        munmap(mapping, file_size);
+        return NULL;
+    }
+    const rbf_file_tree_header *tree_headers = (const rbf_file_tree_header *) (header + 1);
+    for (size_t i = 0; i < header->num_trees; i++) {
+        const rbf_file_tree_header *th = &(tree_headers[i]);
+        uint64_t row_index_size = th->row_index_bits
+                                  ? packed_row_index_size(header->num_rows, (int) th->row_index_bits)
+                                  : sizeof(rownum_type) * (uint64_t) header->num_rows;
+        if (((th->row_index_bits != 0) && (th->row_index_bits != (uint64_t) row_index_bits(header->num_rows)))
+                || !array_in_file(th->row_index_offset, row_index_size, 1, file_size)
+                || !array_in_file(th->tree_first_offset, th->tree_size, sizeof(rownum_type), file_size)
+                || !array_in_file(th->tree_second_offset, th->tree_size, sizeof(rownum_type), file_size)
+                || !array_in_file(th->tree_child_offset, th->tree_size, sizeof(nodenum_type), file_size)
+                || !array_in_file(th->tree_split_offset, th->tree_size, sizeof(rownum_type), file_size)) {
+            fprintf(stderr, "load_forest: %s is truncated or corrupt\n", filename);
+            munmap(mapping, file_size);
+            return NULL;
+        }
+    }
+
+    RandomBinaryForest *forest = (RandomBinaryForest *) malloc(sizeof(RandomBinaryForest));
+    RbfConfig *config = (RbfConfig *) malloc(sizeof(RbfConfig));
+    RandomBinaryTree *trees = (RandomBinaryTree *) malloc(sizeof(RandomBinaryTree) * header->num_trees);
+    if (!forest || !config || !trees) {
+        die_alloc_err("load_forest", "forest || config || trees");
+    }
+    config->num_trees = header->num_trees;
+    config->tree_depth = header->tree_depth;
+    config->leaf_size = header->leaf_size;
+    config->seed = header->seed;
+    config->task_min_rows = 0;
+    config->share_features_levels = 0;
+    config->parallel_query_min_trees = header->parallel_query_min_trees;
+    config->num_rows = header->num_rows;
+    config->num_features = header->num_features;
+    config->num_features_to_compare = header->num_features_to_compare;
+    config->pack_row_index = (header->pack_row_index != 0);
+
+    char *base = (char *) mapping;
+    for (size_t i = 0; i < header->num_trees; i++) {
+        const rbf_file_tree_header *th = &(tree_headers[i]);
+        if (th->row_index_bits) {
+            trees[i].row_index = NULL;
+            trees[i].packed_row_index = (uint8_t *) (base + th->row_index_offset);
+        } else {
+            trees[i].row_index = (rownum_type *) (base + th->row_index_offset);
+            trees[i].packed_row_index = NULL;
+        }
+        trees[i].row_index_bits = (int) th->row_index_bits;
+        trees[i].num_rows = header->num_rows;
+        trees[i].tree_first = (rownum_type *) (base + th->tree_first_offset);
+        trees[i].tree_second = (rownum_type *) (base + th->tree_second_offset);
+        trees[i].tree_child = (nodenum_type *) (base + th->tree_child_offset);
+        trees[i].tree_split = (rownum_type *) (base + th->tree_split_offset);
+        trees[i].tree_size = th->tree_size;
+        trees[i].tree_capacity = th->tree_size;
+        trees[i].num_internal_nodes = th->num_internal_nodes;
+        trees[i].num_leaves = th->num_leaves;
+    }
+    for (size_t i = 0; i < header->num_trees; i++) {
+        if (!tree_nodes_valid(&(trees[i]), config->num_features)) {
+            fprintf(stderr, "load_forest: %s has a corrupt tree (%zu)\n", filename, i);
+            free(trees);
+            free(config);
+            free(forest);
+            munmap(mapping, file_size);
+            return NULL;
+        }
+    }
+    forest->config = config;
+    forest->trees = trees;
+    forest->mapping = mapping;
+    forest->mapping_size = file_size;
+    forest->ordered_points = NULL;     // not saved: see store_ordered_points
+    forest->ordered_positions = NULL;
+    forest->ordered_norms = NULL;
+    return forest;
+}
+
+
+/*
+ * Out-of-core training.
+ * Feature files are raw row-major uint8 matrices (one num_features-byte point after another), as
+ * mnist's fashion/train_images.bin is. Rather than reading one into memory and transposing it into a
+ * second copy, map it read-only and transpose it a chunk of rows at a time into a column-major
+ * scratch mapping, dropping each chunk of the input from our resident set once it's done, so peak
+ * memory is about one copy of the data (and the scratch can be a file, so even that can be paged out).
+ */
+#define TRANSPOSE_CHUNK_BYTES (16 << 20)
+
+/*
+ * Map a feature file read-only, returning its size in ret_size (the mapping must be unmapped with
+ * unmap_feature_file). Returns NULL (after printing the reason to stderr) if it can't be mapped.
+ */
+feature_type *map_feature_file(const char *filename, size_t *ret_size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        fprintf(stderr, "map_feature_file: %s is empty or can't be read\n", filename);
+        close(fd);
+        return NULL;
+    }
+    void *mapping = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+    *ret_size = (size_t) st.st_size;
+    return (feature_type *) mapping;
+}
+
+void unmap_feature_file(feature_type *features, size_t size) {
+    munmap(features, size);
+}
+
+
+// Tell the kernel we're done with bytes [*dropped, end) of a mapping (whole pages only), so that
+// they don't stay in our resident set; *dropped moves up to the last page boundary before end.
+static void drop_mapped(const feature_type *mapping, size_t *dropped, size_t end) {
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t page_end = end - end % page_size;
+    if (page_end > *dropped) {
+        madvise((void *) &(mapping[*dropped]), page_end - *dropped, MADV_DONTNEED);
+        *dropped = page_end;
+    }
+}
+
+static RandomBinaryForest *train_forest_transposed(const feature_type *rows, RbfConfig *config,
+        const char *scratch_filename, bool drop_input) {
+    size_t num_rows = (size_t) config->num_rows, num_features = (size_t) config->num_features;
+    size_t size = num_rows * num_features;
+    int fd = -1;
+    if (scratch_filename) {
+        fd = open(scratch_filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if ((fd < 0) || (ftruncate(fd, (off_t) size) != 0)) {
+            perror(scratch_filename);
+            if (fd >= 0) {
+                close(fd);
+                unlink(scratch_filename);
+            }
+            return NULL;
+        }
+        unlink(scratch_filename);   // the mapping keeps it until we're done
+    }
+    feature_type *columns = (feature_type *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                                  scratch_filename ? MAP_SHARED : (MAP_PRIVATE | MAP_ANONYMOUS), fd, 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (columns == MAP_FAILED) {
+        perror("train_forest_rows: scratch mapping");
+        return NULL;
+    }
+
+    size_t chunk_rows = (TRANSPOSE_CHUNK_BYTES / num_features > 0) ? TRANSPOSE_CHUNK_BYTES / num_features : 1;
+    size_t dropped = 0;
+    for (size_t row_start = 0; row_start < num_rows; row_start += chunk_rows) {
+        size_t row_end = (num_rows - row_start < chunk_rows) ? num_rows : row_start + chunk_rows;
+        transpose_rows(rows, num_rows, num_features, row_start, row_end, columns);
+        if (drop_input) {
+            drop_mapped(rows, &dropped, row_end * num_features);
+        }
+    }
+    RandomBinaryForest *forest = train_forest(columns, config);
+    munmap(columns, size);
+    return forest;
+}
+
+/*
+ * Train a forest on config->num_rows row-major points of config->num_features features each (e.g.
+ * a mapped feature file), transposing them into a scratch mapping for training: a file called
+ * scratch_filename (removed as soon as it's mapped) if given, otherwise anonymous memory.
+ * Returns NULL (after printing the reason to stderr) if the scratch can't be set up.
+ */
+RandomBinaryForest *train_forest_rows(const feature_type *rows, RbfConfig *config, const char *scratch_filename) {
+    return train_forest_transposed(rows, config, scratch_filename, false);
+}
+
+/*
+ * train_forest_rows on a feature file, which must hold exactly config->num_rows points. The file is
+ * only mapped for the transpose, so to use its points afterwards (e.g. as kNN reference points)
+ * map it with map_feature_file and use train_forest_rows instead.
+ */
+RandomBinaryForest *train_forest_from_file(const char *filename, RbfConfig *config, const char *scratch_filename) {
+    size_t size;
+    feature_type *rows = map_feature_file(filename, &size);
+    if (!rows) {
+        return NULL;
+    }
+    if (size != (size_t) config->num_rows * config->num_features) {
+        fprintf(stderr, "train_forest_from_file: %s has %zu bytes, not %d rows of %d features\n", filename, size,
+                config->num_rows, config->num_features);
+        unmap_feature_file(rows, size);
+        return NULL;
+    }
+    RandomBinaryForest *forest = train_forest_transposed(rows, config, scratch_filename, true);
+    unmap_feature_file(rows, size);
+    return forest;
+}
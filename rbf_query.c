@@ -1,47 +1,254 @@
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE     /* Expose declaration of tdestroy() */
-#endif
-
-#include <search.h>
 #include <assert.h>
+#include <omp.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "rbf.h"
+#include "_rbf_query.h"
+#include "_rbf_distance.h"
 #include "_rbf_utils.h"
 
 
-// A "point" is a feature-array. Search for one point in this tree.
-void query_tree(const RandomBinaryForest *forest, const size_t tree_num, const feature_type *point,
-                rownum_type **tree_results, size_t *tree_result_counts) {
-// TODO (BUG): for my original application I wanted the single nearest neighbor.
-// If we want k > 1 neighbors then for now we restrict leaf-size and get the k nearest neighbors
-// found by the whole forest. Need to fix this to return k neighbors as follows:
-// At each node, also store the start and end indices of points stored under it.
-// Then, when querying, if the child has fewer points than we want, then don't recurse.
-    size_t array_pos = 0;
-    rownum_type first = forest->trees[tree_num].tree_first[array_pos];
+// A "point" is a feature-array. Find the leaf this point falls in in this tree.
+// (To get at least some number of rows, however small the leaves, see find_subtree.)
+nodenum_type find_leaf(const RandomBinaryTree *tree, const feature_type *point) {
+    nodenum_type array_pos = 0;
+    rownum_type first = tree->tree_first[array_pos];
 	// the condition checks if it's an internal node (== 0) or a leaf (== -1):
     while (first >> HIGH_BIT == 0) {
 		// Internal node, so first (the entry in tree.tree_first) is a feature-number and
 		// the entry in tree.tree_second is the feature-value at which to split.
-        // Decide whether we want to recurse down the left subtree or the right subtree:
-        if (point[(size_t) first] <= forest->trees[tree_num].tree_second[array_pos]) {
-			array_pos = (2 * array_pos) + 1; // left subtree
-        } else {
-			array_pos = (2 * array_pos) + 2; // right subtree
-		}
-        first = forest->trees[tree_num].tree_first[array_pos];
-    }
-
-	// found a leaf; get values and return
-	rownum_type index_start = HIGH_BIT_1 ^ first;
-	rownum_type index_end = HIGH_BIT_1 ^ (forest->trees[tree_num].tree_second[array_pos]);
-    tree_result_counts[tree_num] = index_end - index_start;
-    tree_results[tree_num] = malloc(sizeof(rownum_type) * (index_end - index_start));
-    if (!tree_results[tree_num]) {
-        die_alloc_err("query_tree", "tree_results[tree_num]");
-    }
-    for (rownum_type rownum = 0; rownum < index_end - index_start; rownum++) {
-        tree_results[tree_num][rownum] = forest->trees[tree_num].row_index[index_start + rownum];
+        // Go to the left child if the point's feature is <= the split value, else to the right child
+        // (which is stored right after the left child):
+        array_pos = tree->tree_child[array_pos] + (point[(size_t) first] > tree->tree_second[array_pos]);
+        first = tree->tree_first[array_pos];
+    }
+    return array_pos;
+}
+
+
+/*
+ * Interleaved walks: find_leaf for up to WALK_INTERLEAVE independent walks (different trees, or
+ * different points) at once, advancing them round-robin a level at a time. Each walk prefetches
+ * its next node's entries as soon as it knows which node that is, so by the time we get back to
+ * it they're (hopefully) on their way in, and the walks' cache misses overlap instead of each walk
+ * waiting on one miss per level. This pays off once the trees are much bigger than the caches.
+ */
+#define WALK_INTERLEAVE 16
+
+static inline void prefetch_node(const RandomBinaryTree *tree, nodenum_type node) {
+    __builtin_prefetch(&(tree->tree_first[node]));
+    __builtin_prefetch(&(tree->tree_second[node]));
+    __builtin_prefetch(&(tree->tree_child[node]));
+}
+
+static void interleaved_walks(const RandomBinaryTree *const *trees, const feature_type *const *points, size_t num_walks,
+        nodenum_type *ret_leaves) {
+    nodenum_type pos[WALK_INTERLEAVE];
+    size_t walking[WALK_INTERLEAVE];    // the walks still going
+    size_t num_walking = num_walks;
+    for (size_t w = 0; w < num_walks; w++) {
+        pos[w] = 0;
+        walking[w] = w;
+        prefetch_node(trees[w], 0);
+    }
+    while (num_walking > 0) {
+        size_t still_walking = 0;
+        for (size_t i = 0; i < num_walking; i++) {
+            size_t w = walking[i];
+            const RandomBinaryTree *tree = trees[w];
+            rownum_type first = tree->tree_first[pos[w]];
+            if (first >> HIGH_BIT != 0) {
+                ret_leaves[w] = pos[w];
+                continue;
+            }
+            pos[w] = tree->tree_child[pos[w]] + (points[w][(size_t) first] > tree->tree_second[pos[w]]);
+            prefetch_node(tree, pos[w]);
+            walking[still_walking++] = w;
+        }
+        num_walking = still_walking;
+    }
+}
+
+
+// The leaf one point falls in in each of num_trees trees from first_tree on, walking the trees
+// WALK_INTERLEAVE at a time (see interleaved_walks).
+void find_trees_leaves(const RandomBinaryForest *forest, size_t first_tree, size_t num_trees, const feature_type *point,
+        nodenum_type *ret_leaves) {
+    const RandomBinaryTree *trees[WALK_INTERLEAVE];
+    const feature_type *points[WALK_INTERLEAVE];
+    for (size_t group = 0; group < num_trees; group += WALK_INTERLEAVE) {
+        size_t num_walks = (num_trees - group < WALK_INTERLEAVE) ? num_trees - group : WALK_INTERLEAVE;
+        for (size_t w = 0; w < num_walks; w++) {
+            trees[w] = &(forest->trees[first_tree + group + w]);
+            points[w] = point;
+        }
+        interleaved_walks(trees, points, num_walks, &(ret_leaves[group]));
+    }
+}
+
+
+/*
+ * Walk LEAF_GROUPS * LEAF_LANES consecutive points down the tree in lockstep, one gather per tree
+ * array per level for each group of LEAF_LANES points, so the walks' load chains overlap instead
+ * of running one after another. Lanes that reach a leaf stop moving (their gathers are masked off)
+ * until all lanes are done.
+ * There are no byte gathers, so a point's feature comes from the aligned 4 bytes around it, which
+ * can't cross a page boundary (but can go past either end of `points`), shifted down.
+ */
+#if defined(__AVX512F__)
+#define LEAF_LANES 16
+#define LEAF_GROUPS 2
+static void find_leaves_lanes(const RandomBinaryTree *tree, const feature_type *points, size_t point_dimension,
+        nodenum_type *ret_leaves) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i three = _mm512_set1_epi32(3);
+    const __m512i lane_offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                                                    _mm512_set1_epi32((int) point_dimension));
+    const feature_type *aligned_points = (const feature_type *) ((uintptr_t) points & ~(uintptr_t) 3);
+    __m512i pos[LEAF_GROUPS], first[LEAF_GROUPS], point_offsets[LEAF_GROUPS];
+    __mmask16 internal[LEAF_GROUPS];
+    for (int g = 0; g < LEAF_GROUPS; g++) {
+        pos[g] = zero;
+        first[g] = _mm512_set1_epi32(tree->tree_first[0]);
+        internal[g] = _mm512_cmpge_epi32_mask(first[g], zero);
+        point_offsets[g] = _mm512_add_epi32(lane_offsets, _mm512_set1_epi32((int) (g * LEAF_LANES * point_dimension
+                                                                                   + ((uintptr_t) points & 3))));
+    }
+    __mmask16 any_internal = 1;
+    while (any_internal) {
+        any_internal = 0;
+        for (int g = 0; g < LEAF_GROUPS; g++) {
+            __m512i second = _mm512_mask_i32gather_epi32(zero, internal[g], pos[g], tree->tree_second, 4);
+            __m512i child = _mm512_mask_i32gather_epi32(zero, internal[g], pos[g], tree->tree_child, 4);
+            __m512i feat_offsets = _mm512_add_epi32(point_offsets[g], first[g]);
+            __m512i feat = _mm512_mask_i32gather_epi32(zero, internal[g], _mm512_andnot_si512(three, feat_offsets),
+                                                       aligned_points, 1);
+            feat = _mm512_srlv_epi32(feat, _mm512_slli_epi32(_mm512_and_si512(feat_offsets, three), 3));
+            feat = _mm512_and_si512(feat, _mm512_set1_epi32(0xff));
+            __mmask16 go_right = _mm512_cmpgt_epi32_mask(feat, second);
+            pos[g] = _mm512_mask_mov_epi32(pos[g], internal[g], _mm512_mask_add_epi32(child, go_right, child, one));
+            first[g] = _mm512_mask_i32gather_epi32(first[g], internal[g], pos[g], tree->tree_first, 4);
+            internal[g] = _mm512_cmpge_epi32_mask(first[g], zero);
+            any_internal |= internal[g];
+        }
+    }
+    for (int g = 0; g < LEAF_GROUPS; g++) {
+        _mm512_storeu_si512(&(ret_leaves[g * LEAF_LANES]), pos[g]);
+    }
+}
+#elif defined(__AVX2__)
+#define LEAF_LANES 8
+#define LEAF_GROUPS 2
+static void find_leaves_lanes(const RandomBinaryTree *tree, const feature_type *points, size_t point_dimension,
+        nodenum_type *ret_leaves) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i lane_offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                                    _mm256_set1_epi32((int) point_dimension));
+    const int *aligned_points = (const int *) ((uintptr_t) points & ~(uintptr_t) 3);
+    __m256i pos[LEAF_GROUPS], first[LEAF_GROUPS], point_offsets[LEAF_GROUPS], internal[LEAF_GROUPS];
+    for (int g = 0; g < LEAF_GROUPS; g++) {
+        pos[g] = zero;
+        first[g] = _mm256_set1_epi32(tree->tree_first[0]);
+        internal[g] = _mm256_cmpgt_epi32(first[g], minus_one);
+        point_offsets[g] = _mm256_add_epi32(lane_offsets, _mm256_set1_epi32((int) (g * LEAF_LANES * point_dimension
+                                                                                   + ((uintptr_t) points & 3))));
+    }
+    bool any_internal = true;
+    while (any_internal) {
+        any_internal = false;
+        for (int g = 0; g < LEAF_GROUPS; g++) {
+            __m256i second = _mm256_mask_i32gather_epi32(zero, (const int *) tree->tree_second, pos[g], internal[g], 4);
+            __m256i child = _mm256_mask_i32gather_epi32(zero, (const int *) tree->tree_child, pos[g], internal[g], 4);
+            __m256i feat_offsets = _mm256_add_epi32(point_offsets[g], first[g]);
+            __m256i feat = _mm256_mask_i32gather_epi32(zero, aligned_points, _mm256_andnot_si256(three, feat_offsets),
+                                                       internal[g], 1);
+            feat = _mm256_srlv_epi32(feat, _mm256_slli_epi32(_mm256_and_si256(feat_offsets, three), 3));
+            feat = _mm256_and_si256(feat, _mm256_set1_epi32(0xff));
+            __m256i go_right = _mm256_cmpgt_epi32(feat, second);   // all 1s, i.e. -1, to go right
+            pos[g] = _mm256_blendv_epi8(pos[g], _mm256_sub_epi32(child, go_right), internal[g]);
+            first[g] = _mm256_mask_i32gather_epi32(first[g], (const int *) tree->tree_first, pos[g], internal[g], 4);
+            internal[g] = _mm256_cmpgt_epi32(first[g], minus_one);
+            any_internal |= !_mm256_testz_si256(internal[g], internal[g]);
+        }
+    }
+    for (int g = 0; g < LEAF_GROUPS; g++) {
+        _mm256_storeu_si256((__m256i *) &(ret_leaves[g * LEAF_LANES]), pos[g]);
+    }
+}
+#endif
+
+
+/*
+ * Find the leaves that a batch of points fall in in this tree (see find_leaf), with SIMD
+ * (see find_leaves_lanes) where the CPU we're built for has gathers.
+ * Walking a batch of points through one tree at a time also keeps that tree's top levels in cache.
+ */
+void find_leaves(const RandomBinaryTree *tree, const feature_type *points, size_t point_dimension, size_t num_points,
+        nodenum_type *ret_leaves) {
+    size_t i = 0;
+#ifdef LEAF_LANES
+    for (; i + LEAF_GROUPS * LEAF_LANES <= num_points; i += LEAF_GROUPS * LEAF_LANES) {
+        find_leaves_lanes(tree, &(points[i * point_dimension]), point_dimension, &(ret_leaves[i]));
+    }
+#endif
+    // and the rest (or all of them, without SIMD) WALK_INTERLEAVE points at a time:
+    const RandomBinaryTree *trees[WALK_INTERLEAVE];
+    const feature_type *walk_points[WALK_INTERLEAVE];
+    for (; i < num_points; i += WALK_INTERLEAVE) {
+        size_t num_walks = (num_points - i < WALK_INTERLEAVE) ? num_points - i : WALK_INTERLEAVE;
+        for (size_t w = 0; w < num_walks; w++) {
+            trees[w] = tree;
+            walk_points[w] = &(points[(i + w) * point_dimension]);
+        }
+        interleaved_walks(trees, walk_points, num_walks, &(ret_leaves[i]));
     }
+}
+
+
+/*
+ * Latency mode for single-point queries: once a forest has at least config->parallel_query_min_trees
+ * trees, the trees are walked (in WALK_INTERLEAVE-sized groups) by OpenMP's thread team, which the
+ * runtime keeps alive between parallel regions, and query_forest_dedup_results dedups in parallel
+ * too. Smaller forests, queries from inside a parallel region (e.g. the batch queries), and single
+ * threaded runs stay on the calling thread, where fork/join would cost more than it saves.
+ */
+static bool parallel_query(const RandomBinaryForest *forest) {
+    size_t min_trees = forest->config->parallel_query_min_trees;
+    return (min_trees > 0) && (forest->config->num_trees >= min_trees) && !omp_in_parallel()
+            && (omp_get_max_threads() > 1);
+}
+
+
+// Copy the rows in this leaf of this tree into a new array.
+static void leaf_results(const RandomBinaryTree *tree, nodenum_type leaf,
+        rownum_type **ret_results, size_t *ret_count) {
+	rownum_type index_start = HIGH_BIT_1 ^ tree->tree_first[leaf];
+	rownum_type index_end = HIGH_BIT_1 ^ tree->tree_second[leaf];
+    *ret_count = index_end - index_start;
+    *ret_results = malloc(sizeof(rownum_type) * (index_end - index_start));
+    if (!*ret_results) {
+        die_alloc_err("leaf_results", "ret_results");
+    }
+    if (tree->packed_row_index) {
+        unpack_row_index(tree->packed_row_index, tree->row_index_bits, index_start, index_end, *ret_results);
+    } else {
+        for (rownum_type rownum = 0; rownum < index_end - index_start; rownum++) {
+            (*ret_results)[rownum] = tree->row_index[index_start + rownum];
+        }
+    }
+}
+
+
+// A "point" is a feature-array. Search for one point in this tree.
+void query_tree(const RandomBinaryForest *forest, const size_t tree_num, const feature_type *point,
+                rownum_type **tree_results, size_t *tree_result_counts) {
+    const RandomBinaryTree *tree = &(forest->trees[tree_num]);
+    leaf_results(tree, find_leaf(tree, point), &(tree_results[tree_num]), &(tree_result_counts[tree_num]));
 	return;
 }
 
@@ -53,84 +260,482 @@ void query_tree(const RandomBinaryForest *forest, const size_t tree_num, const f
  * - tree_results: for each tree, indices into the training feature-array
  *                 (since the caller/wrapper might have different things they want to do with this).
  * - total_count: total count of results from all trees
+ * The results are one allocation (the struct, then its arrays, then the rows): free it with free_results.
  */
 RbfResults *query_forest_all_results(const RandomBinaryForest *forest, const feature_type *point, const size_t point_dimension) {
-    assert(point_dimension == forest->config->num_features);
-    rownum_type **tree_results = malloc(sizeof(rownum_type*) * forest->config->num_trees);
-    size_t *tree_result_counts = malloc(sizeof(size_t) * forest->config->num_trees);
+    size_t num_trees = forest->config->num_trees;
+    RbfLeafView *views = malloc(sizeof(RbfLeafView) * num_trees);
+    if (!views) {
+        die_alloc_err("query_forest_all_results", "views");
+    }
+    query_forest_leaves(forest, point, point_dimension, views);
     size_t total_count = 0;
-
-    for (size_t i = 0; i < forest->config->num_trees; i++) {
-        query_tree(forest, i, point, tree_results, tree_result_counts);
-        total_count += tree_result_counts[i];
+    for (size_t i = 0; i < num_trees; i++) {
+        total_count += views[i].end - views[i].start;
     }
 
-    RbfResults *results = malloc(sizeof(RbfResults));
-    results->tree_results = tree_results;
-    results->tree_result_counts = tree_result_counts;
+    RbfResults *results = malloc(sizeof(RbfResults) + (sizeof(rownum_type *) + sizeof(size_t)) * num_trees
+                                 + sizeof(rownum_type) * total_count);
+    if (!results) {
+        die_alloc_err("query_forest_all_results", "results");
+    }
+    results->tree_results = (rownum_type **) (results + 1);
+    results->tree_result_counts = (size_t *) &(results->tree_results[num_trees]);
     results->total_count = total_count;
+    rownum_type *rows = (rownum_type *) &(results->tree_result_counts[num_trees]);
+    for (size_t i = 0; i < num_trees; i++) {
+        results->tree_results[i] = rows;
+        results->tree_result_counts[i] = views[i].end - views[i].start;
+        rows += results->tree_result_counts[i];
+    }
+    #pragma omp parallel for schedule(dynamic) if(parallel_query(forest))
+    for (size_t i = 0; i < num_trees; i++) {
+        leaf_view_rows(forest, views[i], results->tree_results[i]);
+    }
+    free(views);
     return results;
 }
 
+void free_results(RbfResults *results) {
+    free(results);
+}
+
 
 /*
  * Identical to query_forest_all_results except queries for a batch of points at a time.
  * So: `points` is now a pointer to multiple points, not a single point.
- * And the return is an array of RbfResults instead of a pointer to a single RbfResults object.
+ * And the results for all the points are laid out CSR-style in one allocation (see RbfBatchResults),
+ * so there's one thing to free however many points and trees there are.
  */
-RbfResults *batch_query_forest_all_results(const RandomBinaryForest *forest, const feature_type *points,
+RbfBatchResults *batch_query_forest_all_results(const RandomBinaryForest *forest, const feature_type *points,
         const size_t point_dimension, const size_t num_points) {
-    assert(point_dimension == forest->config->num_features);
-    RbfResults *all_results = malloc(sizeof(RbfResults) * num_points);
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_points; i++) {
-        all_results[i] = *query_forest_all_results(forest, &(points[i * point_dimension]), point_dimension);
+    size_t num_trees = forest->config->num_trees;
+    size_t num_views = num_points * num_trees;
+    RbfLeafView *views = malloc(sizeof(RbfLeafView) * num_views);
+    if (!views) {
+        die_alloc_err("batch_query_forest_all_results", "views");
     }
-    return all_results;
+    batch_query_forest_leaves(forest, points, point_dimension, num_points, views);
+    size_t total_count = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        total_count += views[i].end - views[i].start;
+    }
+
+    RbfBatchResults *results = malloc(sizeof(RbfBatchResults) + sizeof(size_t) * (num_views + 1)
+                                      + sizeof(rownum_type) * total_count);
+    if (!results) {
+        die_alloc_err("batch_query_forest_all_results", "results");
+    }
+    results->num_points = num_points;
+    results->num_trees = num_trees;
+    results->offsets = (size_t *) (results + 1);
+    results->ids = (rownum_type *) &(results->offsets[num_views + 1]);
+    results->offsets[0] = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        results->offsets[i + 1] = results->offsets[i] + (views[i].end - views[i].start);
+    }
+    #pragma omp parallel for schedule(dynamic, QUERY_BLOCK_POINTS)
+    for (size_t i = 0; i < num_views; i++) {
+        leaf_view_rows(forest, views[i], &(results->ids[results->offsets[i]]));
+    }
+    free(views);
+    return results;
+}
+
+void free_batch_results(RbfBatchResults *results) {
+    free(results);
 }
 
 
 /*
- * A "point" is a feature-array. Search for one point in this forest.
- * Return: combine and dedup result indices from all trees. Results are indices into the training
- *         feature-array (since the caller/wrapper might have different things they want to do with this).
+ * Zero-allocation queries.
+ * Instead of copying each tree's results into new arrays, write views of the leaves that a point
+ * falls in (one per tree, so num_trees of them) into the caller's buffer, which can be reused from
+ * one query to the next. The rows in a leaf view can be read straight out of the tree's row_index,
+ * or copied into another caller buffer with leaf_view_rows.
  */
-static int compare(const void *pa, const void *pb) {
-   if (*(rownum_type *) pa < *(rownum_type *) pb)
-       return -1;
-   if (*(rownum_type *) pa > *(rownum_type *) pb)
-       return 1;
-   return 0;
+static RbfLeafView leaf_view(const RandomBinaryTree *tree, treeindex_type tree_num, nodenum_type leaf) {
+    RbfLeafView view = {tree_num, HIGH_BIT_1 ^ tree->tree_first[leaf], HIGH_BIT_1 ^ tree->tree_second[leaf]};
+    return view;
 }
 
-rownum_type *query_forest_dedup_results(const RandomBinaryForest *forest, const feature_type *point, const size_t point_dimension, size_t *count) {
-    // get all results, and accordingly allocate space for tracker and return
-    RbfResults *all_results = query_forest_all_results(forest, point, point_dimension);
-    // TODO: speed/memory tradeoff here: allocating too much space right now
-    rownum_type *deduped_results = malloc(sizeof(rownum_type) * all_results->total_count);
-
-    void *results_seen = NULL;
-    rownum_type *result_pos;
-    *count = 0;
+
+/*
+ * Like find_leaf, but stop going down once the next node would have fewer than min_rows rows, so
+ * we get the smallest subtree on the point's path with at least min_rows rows (its leaf if that's
+ * big enough, the whole tree if even that isn't). Each node's rows are worked out from its parent's
+ * on the way down (see RandomBinaryTree.tree_split).
+ */
+RbfLeafView find_subtree(const RandomBinaryTree *tree, treeindex_type tree_num, const feature_type *point,
+        rownum_type min_rows) {
+    nodenum_type array_pos = 0;
+    rownum_type start = 0, end = tree->num_rows;
+    rownum_type first = tree->tree_first[array_pos];
+    while (first >> HIGH_BIT == 0) {
+        bool go_right = (point[(size_t) first] > tree->tree_second[array_pos]);
+        rownum_type split = tree->tree_split[array_pos];
+        rownum_type child_start = go_right ? split : start;
+        rownum_type child_end = go_right ? end : split;
+        if (child_end - child_start < min_rows) {
+            break;
+        }
+        start = child_start;
+        end = child_end;
+        array_pos = tree->tree_child[array_pos] + go_right;
+        first = tree->tree_first[array_pos];
+    }
+    RbfLeafView view = {tree_num, start, end};
+    return view;
+}
+
+
+/*
+ * Views of the subtrees (see find_subtree) that each of a block of (at most QUERY_BLOCK_POINTS)
+ * points falls in: num_trees of them for each point in turn. With min_rows <= 0 these are just the
+ * leaves, which we find with find_leaves.
+ */
+static void query_block_views(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, rownum_type min_rows, RbfLeafView *ret_views) {
+    size_t num_trees = forest->config->num_trees;
+    nodenum_type leaves[QUERY_BLOCK_POINTS];
+    for (size_t tree_num = 0; tree_num < num_trees; tree_num++) {
+        const RandomBinaryTree *tree = &(forest->trees[tree_num]);
+        if (min_rows <= 0) {
+            find_leaves(tree, points, point_dimension, num_points, leaves);
+        }
+        for (size_t i = 0; i < num_points; i++) {
+            ret_views[i * num_trees + tree_num] = (min_rows <= 0)
+                    ? leaf_view(tree, tree_num, leaves[i])
+                    : find_subtree(tree, tree_num, &(points[i * point_dimension]), min_rows);
+        }
+    }
+}
+
+void query_forest_leaves(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, RbfLeafView *ret_leaves) {
+    assert(point_dimension == forest->config->num_features);
+    size_t num_groups = (forest->config->num_trees + WALK_INTERLEAVE - 1) / WALK_INTERLEAVE;
+    #pragma omp parallel for schedule(dynamic) if(parallel_query(forest))
+    for (size_t group = 0; group < num_groups; group++) {
+        size_t first_tree = group * WALK_INTERLEAVE;
+        size_t num_trees = forest->config->num_trees - first_tree;
+        num_trees = (num_trees < WALK_INTERLEAVE) ? num_trees : WALK_INTERLEAVE;
+        nodenum_type leaves[WALK_INTERLEAVE];
+        find_trees_leaves(forest, first_tree, num_trees, point, leaves);
+        for (size_t i = first_tree; i < first_tree + num_trees; i++) {
+            ret_leaves[i] = leaf_view(&(forest->trees[i]), i, leaves[i - first_tree]);
+        }
+    }
+}
+
+
+// Identical to query_forest_leaves except for a batch of points: ret_leaves has num_trees leaf views
+// for each point in turn, so num_points * num_trees of them.
+void batch_query_forest_leaves(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, RbfLeafView *ret_leaves) {
+    batch_query_forest_subtrees(forest, points, point_dimension, num_points, 0, ret_leaves);
+}
+
+
+/*
+ * Like query_forest_leaves, but each tree's view is of the smallest subtree the point falls in with
+ * at least min_rows rows, so that small leaves still give (at least) min_rows candidates per tree.
+ * This lets the caller trade query time for recall per query, whatever leaf_size the forest was
+ * trained with. min_rows <= 1 gives the leaves.
+ */
+void query_forest_subtrees(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, const rownum_type min_rows, RbfLeafView *ret_views) {
+    assert(point_dimension == forest->config->num_features);
     for (size_t i = 0; i < forest->config->num_trees; i++) {
-        for (size_t j = 0; j < all_results->tree_result_counts[i]; j++) {
-            result_pos = &(all_results->tree_results[i][j]);
-            if (!tfind(result_pos, &results_seen, compare)) {
-                deduped_results[*count] = *result_pos;
-                tsearch(result_pos, &results_seen, compare);    // insert
-                *count += 1;
+        ret_views[i] = find_subtree(&(forest->trees[i]), i, point, min_rows);
+    }
+}
+
+
+// Identical to query_forest_subtrees except for a batch of points: ret_views has num_trees views
+// for each point in turn, so num_points * num_trees of them.
+void batch_query_forest_subtrees(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, const rownum_type min_rows, RbfLeafView *ret_views) {
+    assert(point_dimension == forest->config->num_features);
+    size_t num_trees = forest->config->num_trees;
+    size_t num_blocks = (num_points + QUERY_BLOCK_POINTS - 1) / QUERY_BLOCK_POINTS;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t block_start = block * QUERY_BLOCK_POINTS;
+        size_t block_points = (num_points - block_start < QUERY_BLOCK_POINTS) ? num_points - block_start : QUERY_BLOCK_POINTS;
+        query_block_views(forest, &(points[block_start * point_dimension]), point_dimension, block_points, min_rows,
+                          &(ret_views[block_start * num_trees]));
+    }
+}
+
+
+// Copy the rows in a leaf view into ret_rows, which needs room for leaf.end - leaf.start of them.
+void leaf_view_rows(const RandomBinaryForest *forest, RbfLeafView leaf, rownum_type *ret_rows) {
+    const RandomBinaryTree *tree = &(forest->trees[leaf.tree_num]);
+    if (tree->packed_row_index) {
+        unpack_row_index(tree->packed_row_index, tree->row_index_bits, leaf.start, leaf.end, ret_rows);
+    } else {
+        memcpy(ret_rows, &(tree->row_index[leaf.start]), sizeof(rownum_type) * (leaf.end - leaf.start));
+    }
+}
+
+
+/*
+ * Dedup with an epoch-stamped "visited" array: one stamp per training row, per thread, kept from
+ * one query to the next. A row has been seen by this query iff its stamp is this query's epoch, so
+ * starting a new query just bumps the epoch, and the array only needs clearing when that wraps.
+ * A thread (re)allocates its array when it first needs one for a forest with more rows, and keeps it
+ * until rbf_release_thread_buffers (or free_forest).
+ */
+static __thread uint32_t *visited = NULL;
+static __thread rownum_type visited_size = 0;
+static __thread uint32_t visited_epoch = 0;
+
+uint32_t *start_visit(rownum_type num_rows, uint32_t *ret_epoch) {
+    if (visited_size < num_rows) {
+        free(visited);
+        visited = (uint32_t *) calloc(sizeof(uint32_t), num_rows);
+        if (!visited) {
+            die_alloc_err("start_visit", "visited");
+        }
+        visited_size = num_rows;
+        visited_epoch = 0;
+    }
+    visited_epoch += 1;
+    if (visited_epoch == 0) {
+        memset(visited, 0, sizeof(uint32_t) * visited_size);
+        visited_epoch = 1;
+    }
+    *ret_epoch = visited_epoch;
+    return visited;
+}
+
+
+/*
+ * Dedup the rows in these views into ret_rows (in the order they're first found), which needs room
+ * for all of their rows (see views_rows). Returns the number of deduped rows.
+ */
+static size_t dedup_views(const RandomBinaryForest *forest, const RbfLeafView *views, size_t num_views,
+        rownum_type *ret_rows) {
+    uint32_t epoch;
+    uint32_t *seen = start_visit(forest->trees[0].num_rows, &epoch);
+    size_t num_deduped = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        // copy the view's rows in after the ones kept so far, then keep the new ones in place:
+        rownum_type *rows = &(ret_rows[num_deduped]);
+        size_t num_rows = views[i].end - views[i].start;
+        leaf_view_rows(forest, views[i], rows);
+        for (size_t j = 0; j < num_rows; j++) {
+            rownum_type row = rows[j];
+            // write it either way, but only keep it if it's new:
+            ret_rows[num_deduped] = row;
+            num_deduped += (seen[row] != epoch);
+            seen[row] = epoch;
+        }
+    }
+    return num_deduped;
+}
+
+// How many rows these views have between them (so with dups): room enough for dedup_views.
+static size_t views_rows(const RbfLeafView *views, size_t num_views) {
+    size_t num_rows = 0;
+    for (size_t i = 0; i < num_views; i++) {
+        num_rows += views[i].end - views[i].start;
+    }
+    return num_rows;
+}
+
+// Dedup the rows in one point's views (one per tree) into a new array, on this thread.
+static rownum_type *serial_dedup_results(const RandomBinaryForest *forest, const RbfLeafView *views, size_t *count) {
+    // room for every view's rows, dups included (unlike dedup_block, which keeps a whole batch's and trims them)
+    size_t num_rows = views_rows(views, forest->config->num_trees);
+    rownum_type *deduped_results = malloc(sizeof(rownum_type) * num_rows);
+    if (!deduped_results && num_rows) {
+        die_alloc_err("serial_dedup_results", "deduped_results");
+    }
+    *count = dedup_views(forest, views, forest->config->num_trees, deduped_results);
+    return deduped_results;
+}
+
+
+/*
+ * The parallel dedup's "visited" array: per row, the stamp (epoch << 32) | (UINT32_MAX - position)
+ * of the earliest position the row was found at by this query, so that the threads can agree on it
+ * with an atomic max. Epoched like start_visit's array (but thread-local to the calling thread only:
+ * the team shares it for the one query).
+ */
+static __thread uint64_t *first_found = NULL;
+static __thread rownum_type first_found_size = 0;
+static __thread uint32_t first_found_epoch = 0;
+
+static uint64_t *start_first_found(rownum_type num_rows, uint32_t *ret_epoch) {
+    if (first_found_size < num_rows) {
+        free(first_found);
+        first_found = (uint64_t *) calloc(sizeof(uint64_t), num_rows);
+        if (!first_found) {
+            die_alloc_err("start_first_found", "first_found");
+        }
+        first_found_size = num_rows;
+        first_found_epoch = 0;
+    }
+    first_found_epoch += 1;
+    if (first_found_epoch == 0) {
+        memset(first_found, 0, sizeof(uint64_t) * first_found_size);
+        first_found_epoch = 1;
+    }
+    *ret_epoch = first_found_epoch;
+    return first_found;
+}
+
+static inline void atomic_max_u64(uint64_t *target, uint64_t value) {
+    uint64_t current = __atomic_load_n(target, __ATOMIC_RELAXED);
+    while ((current < value) &&
+           !__atomic_compare_exchange_n(target, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+ * query_forest_dedup_results in latency mode (see parallel_query). The team walks the trees, copies
+ * every leaf's rows to its place in one array, marks each row's first position in that array, and
+ * then compacts the first positions in order: the same results, in the same order, as dedup_views.
+ * If the leaves have UINT32_MAX or more rows between them it falls back to dedup_views.
+ */
+static rownum_type *parallel_dedup_results(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, size_t *count) {
+    size_t num_trees = forest->config->num_trees;
+    RbfLeafView *views = malloc(sizeof(RbfLeafView) * num_trees);
+    size_t *offsets = malloc(sizeof(size_t) * (num_trees + 1));
+    if (!views || !offsets) {
+        die_alloc_err("parallel_dedup_results", "views || offsets");
+    }
+    query_forest_leaves(forest, point, point_dimension, views);
+    offsets[0] = 0;
+    for (size_t i = 0; i < num_trees; i++) {
+        offsets[i + 1] = offsets[i] + (views[i].end - views[i].start);
+    }
+    size_t total_count = offsets[num_trees];
+    if (total_count >= UINT32_MAX) {
+        // too many positions for the low half of a stamp, so dedup them on this thread instead:
+        free(offsets);
+        rownum_type *deduped_results = serial_dedup_results(forest, views, count);
+        free(views);
+        return deduped_results;
+    }
+    rownum_type *all_rows = malloc(sizeof(rownum_type) * total_count);
+    rownum_type *deduped_results = malloc(sizeof(rownum_type) * total_count);
+    if (!all_rows || !deduped_results) {
+        die_alloc_err("parallel_dedup_results", "all_rows || deduped_results");
+    }
+    uint32_t epoch;
+    uint64_t *found = start_first_found(forest->trees[0].num_rows, &epoch);
+    uint64_t epoch_bits = (uint64_t) epoch << 32;
+    size_t *thread_counts = NULL;
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(dynamic)
+        for (size_t i = 0; i < num_trees; i++) {
+            leaf_view_rows(forest, views[i], &(all_rows[offsets[i]]));
+        }
+        #pragma omp for schedule(static)
+        for (size_t pos = 0; pos < total_count; pos++) {
+            atomic_max_u64(&(found[all_rows[pos]]), epoch_bits | (UINT32_MAX - pos));
+        }
+
+        // Compact: each thread counts the first positions in its chunk, then writes them after the
+        // ones in earlier chunks.
+        size_t num_threads = omp_get_num_threads();
+        size_t thread_num = omp_get_thread_num();
+        size_t chunk_start = total_count * thread_num / num_threads;
+        size_t chunk_end = total_count * (thread_num + 1) / num_threads;
+        #pragma omp single
+        {
+            thread_counts = malloc(sizeof(size_t) * (num_threads + 1));
+            if (!thread_counts) {
+                die_alloc_err("parallel_dedup_results", "thread_counts");
             }
         }
+        size_t num_first = 0;
+        for (size_t pos = chunk_start; pos < chunk_end; pos++) {
+            num_first += (found[all_rows[pos]] == (epoch_bits | (UINT32_MAX - pos)));
+        }
+        thread_counts[thread_num + 1] = num_first;
+        #pragma omp barrier
+        #pragma omp single
+        {
+            thread_counts[0] = 0;
+            for (size_t i = 0; i < num_threads; i++) {
+                thread_counts[i + 1] += thread_counts[i];
+            }
+        }
+        size_t num_deduped = thread_counts[thread_num];
+        for (size_t pos = chunk_start; pos < chunk_end; pos++) {
+            if (found[all_rows[pos]] == (epoch_bits | (UINT32_MAX - pos))) {
+                deduped_results[num_deduped++] = all_rows[pos];
+            }
+        }
+        #pragma omp single
+        *count = thread_counts[num_threads];
     }
+    free(thread_counts);
+    free(all_rows);
+    free(offsets);
+    free(views);
+    return deduped_results;
+}
+
 
-    // TODO: No idea why this fails!
-    //if (results_seen) {
-    //    tdestroy(results_seen, free);
-    //}
+/*
+ * A "point" is a feature-array. Search for one point in this forest.
+ * Return: combine and dedup result indices from all trees (in the order they're first found).
+ *         Results are indices into the training feature-array (since the caller/wrapper might have
+ *         different things they want to do with this).
+ */
+rownum_type *query_forest_dedup_results(const RandomBinaryForest *forest, const feature_type *point, const size_t point_dimension, size_t *count) {
+    if (parallel_query(forest)) {
+        return parallel_dedup_results(forest, point, point_dimension, count);
+    }
+    size_t num_trees = forest->config->num_trees;
+    RbfLeafView *views = malloc(sizeof(RbfLeafView) * num_trees);
+    if (!views) {
+        die_alloc_err("query_forest_dedup_results", "views");
+    }
+    query_forest_leaves(forest, point, point_dimension, views);
+    rownum_type *deduped_results = serial_dedup_results(forest, views, count);
+    free(views);
     return deduped_results;
 }
 
 
+/*
+ * query_forest_dedup_results for each of a block of (at most QUERY_BLOCK_POINTS) points, into one
+ * array (trimmed to fit): point i's results are rows[ret_starts[i] .. ret_starts[i + 1]).
+ */
+static rownum_type *dedup_block(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, size_t *ret_starts) {
+    size_t num_trees = forest->config->num_trees;
+    RbfLeafView *views = malloc(sizeof(RbfLeafView) * num_points * num_trees);
+    if (!views) {
+        die_alloc_err("dedup_block", "views");
+    }
+    query_block_views(forest, points, point_dimension, num_points, 0, views);
+    rownum_type *rows = malloc(sizeof(rownum_type) * (views_rows(views, num_points * num_trees) + 1));
+    if (!rows) {
+        die_alloc_err("dedup_block", "rows");
+    }
+    ret_starts[0] = 0;
+    for (size_t i = 0; i < num_points; i++) {
+        ret_starts[i + 1] = ret_starts[i]
+                            + dedup_views(forest, &(views[i * num_trees]), num_trees, &(rows[ret_starts[i]]));
+    }
+    free(views);
+    // (a batch keeps every block's rows until they're all done, so don't keep the dups' room too,
+    // unless giving it back fails)
+    rownum_type *trimmed = realloc(rows, sizeof(rownum_type) * (ret_starts[num_points] + 1));
+    return trimmed ? trimmed : rows;
+}
+
+
 /*
  * Identical to query_forest_dedup_results except queries for a batch of points at a time.
  * So: `points` is now a pointer to multiple points, not a single point.
@@ -143,14 +748,100 @@ rownum_type **batch_query_forest_dedup_results(const RandomBinaryForest *forest,
     assert(point_dimension == forest->config->num_features);
     rownum_type **all_results = malloc(sizeof(rownum_type*) * num_points);
     *ret_counts = malloc(sizeof(size_t) * num_points);
-    #pragma omp parallel for
-    for (size_t i = 0; i < num_points; i++) {
-        all_results[i] = query_forest_dedup_results(forest, &(points[i * point_dimension]), point_dimension, &((*ret_counts)[i]));
+    size_t num_blocks = (num_points + QUERY_BLOCK_POINTS - 1) / QUERY_BLOCK_POINTS;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t block_start = block * QUERY_BLOCK_POINTS;
+        size_t block_points = (num_points - block_start < QUERY_BLOCK_POINTS) ? num_points - block_start : QUERY_BLOCK_POINTS;
+        size_t starts[QUERY_BLOCK_POINTS + 1];
+        rownum_type *rows = dedup_block(forest, &(points[block_start * point_dimension]), point_dimension,
+                                        block_points, starts);
+        for (size_t i = 0; i < block_points; i++) {
+            size_t count = starts[i + 1] - starts[i];
+            all_results[block_start + i] = malloc(sizeof(rownum_type) * count);
+            if (!all_results[block_start + i] && count) {
+                die_alloc_err("batch_query_forest_dedup_results", "all_results");
+            }
+            memcpy(all_results[block_start + i], &(rows[starts[i]]), sizeof(rownum_type) * count);
+            (*ret_counts)[block_start + i] = count;
+        }
+        free(rows);
     }
     return all_results;
 }
 
 
+// One allocation for the struct and its arrays, so free_csr_results is just a free.
+static RbfCsrResults *alloc_csr_results(size_t num_points, size_t num_results, bool with_distances) {
+    RbfCsrResults *results = malloc(sizeof(RbfCsrResults) + sizeof(size_t) * (num_points + 1)
+                                    + (with_distances ? sizeof(double) * num_results : 0)
+                                    + sizeof(rownum_type) * num_results);
+    if (!results) {
+        die_alloc_err("alloc_csr_results", "results");
+    }
+    results->num_points = num_points;
+    results->indptr = (size_t *) (results + 1);
+    results->distances = with_distances ? (double *) &(results->indptr[num_points + 1]) : NULL;
+    results->indices = with_distances ? (rownum_type *) &(results->distances[num_results])
+                                      : (rownum_type *) &(results->indptr[num_points + 1]);
+    return results;
+}
+
+void free_csr_results(RbfCsrResults *results) {
+    free(results);
+}
+
+
+/*
+ * Identical to batch_query_forest_dedup_results except that the results are CSR-style (see
+ * RbfCsrResults), without distances: one allocation however many points there are, which can be
+ * handed to numpy (or scipy.sparse) as is.
+ */
+RbfCsrResults *batch_query_forest_dedup_csr(const RandomBinaryForest *forest, const feature_type *points,
+        const size_t point_dimension, const size_t num_points) {
+    assert(point_dimension == forest->config->num_features);
+    size_t num_blocks = (num_points + QUERY_BLOCK_POINTS - 1) / QUERY_BLOCK_POINTS;
+    rownum_type **block_rows = malloc(sizeof(rownum_type *) * num_blocks);
+    size_t *block_starts = malloc(sizeof(size_t) * (QUERY_BLOCK_POINTS + 1) * num_blocks);
+    if ((!block_rows || !block_starts) && num_blocks) {
+        die_alloc_err("batch_query_forest_dedup_csr", "block_rows || block_starts");
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t block_start = block * QUERY_BLOCK_POINTS;
+        size_t block_points = (num_points - block_start < QUERY_BLOCK_POINTS) ? num_points - block_start : QUERY_BLOCK_POINTS;
+        block_rows[block] = dedup_block(forest, &(points[block_start * point_dimension]), point_dimension,
+                                        block_points, &(block_starts[block * (QUERY_BLOCK_POINTS + 1)]));
+    }
+
+    size_t num_results = 0;
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t block_points = (num_points - block * QUERY_BLOCK_POINTS < QUERY_BLOCK_POINTS)
+                              ? num_points - block * QUERY_BLOCK_POINTS : QUERY_BLOCK_POINTS;
+        num_results += block_starts[block * (QUERY_BLOCK_POINTS + 1) + block_points];
+    }
+    RbfCsrResults *results = alloc_csr_results(num_points, num_results, false);
+    results->indptr[0] = 0;
+    for (size_t i = 0; i < num_points; i++) {
+        size_t *starts = &(block_starts[(i / QUERY_BLOCK_POINTS) * (QUERY_BLOCK_POINTS + 1)]);
+        size_t j = i % QUERY_BLOCK_POINTS;
+        results->indptr[i + 1] = results->indptr[i] + (starts[j + 1] - starts[j]);
+    }
+    // a block's points' results are already in order, so each block is one copy:
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t block = 0; block < num_blocks; block++) {
+        size_t block_start = block * QUERY_BLOCK_POINTS;
+        size_t block_points = (num_points - block_start < QUERY_BLOCK_POINTS) ? num_points - block_start : QUERY_BLOCK_POINTS;
+        memcpy(&(results->indices[results->indptr[block_start]]), block_rows[block],
+               sizeof(rownum_type) * (results->indptr[block_start + block_points] - results->indptr[block_start]));
+        free(block_rows[block]);
+    }
+    free(block_rows);
+    free(block_starts);
+    return results;
+}
+
+
 // Internal use only.
 // Problem: we want to qsort indices into the row-index array by distance of each indexed reference point
 // from the query point. To use qsort we'll have to carry some metadata along with each index.
@@ -159,6 +850,9 @@ rownum_type **batch_query_forest_dedup_results(const RandomBinaryForest *forest,
 results_comparison_node *make_comp_nodes(rownum_type *unsorted_results, size_t count,
         feature_type *ref_points, feature_type *point, size_t point_dimension) {
     results_comparison_node *comp_nodes = malloc(sizeof(results_comparison_node) * count);
+    if (!comp_nodes) {
+        die_alloc_err("make_comp_nodes", "comp_nodes");
+    }
     for (size_t i = 0; i < count; i++) {
         comp_nodes[i].query_point = point;
         comp_nodes[i].ref_point = &(ref_points[unsorted_results[i] * point_dimension]);
@@ -169,6 +863,43 @@ results_comparison_node *make_comp_nodes(rownum_type *unsorted_results, size_t c
 }
 
 
+typedef struct {
+    double dist;
+    rownum_type row;
+} ranked_row;
+
+static int ranked_row_compare(const void *pre_r1, const void *pre_r2) {
+    const ranked_row *r1 = (const ranked_row *) pre_r1, *r2 = (const ranked_row *) pre_r2;
+    return (r1->dist < r2->dist) ? -1 : (r1->dist > r2->dist) ? 1 : (r1->row > r2->row) - (r1->row < r2->row);
+}
+
+/*
+ * Sort rows by the squared L2 distance of their reference points from point (ties by row number).
+ * Sorting with l2_compare recomputes both distances in every comparison, each a serial pass over
+ * two rows; here each row's distance is computed once, by the one-vs-many kernel, which prefetches
+ * the rows a few ahead of the one it's on (see DEFINE_DISTS), and then only the distances are sorted.
+ */
+void sort_rows_by_l2(const feature_type *ref_points, const feature_type *point, size_t point_dimension,
+        rownum_type *rows, size_t count) {
+    double *dists = (double *) malloc(sizeof(double) * count);
+    ranked_row *ranked = (ranked_row *) malloc(sizeof(ranked_row) * count);
+    if ((count > 0) && (!dists || !ranked)) {
+        die_alloc_err("sort_rows_by_l2", "dists || ranked");
+    }
+    rbf_distances(RBF_L2, point, ref_points, point_dimension, rows, count, NULL, dists);
+    for (size_t i = 0; i < count; i++) {
+        ranked[i].dist = dists[i];
+        ranked[i].row = rows[i];
+    }
+    qsort(ranked, count, sizeof(ranked_row), ranked_row_compare);
+    for (size_t i = 0; i < count; i++) {
+        rows[i] = ranked[i].row;
+    }
+    free(dists);
+    free(ranked);
+}
+
+
 /*
  * A "point" is a feature-array. Search for one point in this forest.
  * Return: combine and dedup result indices from all trees, sorted by the given comparison function.
@@ -179,6 +910,10 @@ rownum_type *query_forest_dedup_results_sorted(const RandomBinaryForest *forest,
         feature_type *ref_points, const size_t point_dimension, size_t *count,
         int (*compare)(const void *, const void *)) {
     rownum_type *results = query_forest_dedup_results(forest, point, point_dimension, count);
+    if (compare == l2_compare) {
+        sort_rows_by_l2(ref_points, point, point_dimension, results, *count);
+        return results;
+    }
     results_comparison_node *results_for_sort = make_comp_nodes(results, *count, ref_points, point, point_dimension);
     qsort(results_for_sort, *count, sizeof(results_comparison_node), compare);
     for (size_t i = 0; i < *count; i++) {
@@ -214,3 +949,378 @@ rownum_type **batch_query_forest_dedup_results_sorted(const RandomBinaryForest *
     }
     return all_results;
 }
+
+
+/*
+ * k nearest neighbors by some RbfMetric among the rows found by all trees.
+ * Each (deduped) candidate's distance is computed once (a leaf's worth at a time, see
+ * rbf_distances) and goes through a max-heap of the k
+ * closest so far, which lives in the caller's ret_ids/ret_dists, so there's no allocation.
+ * Ties are broken by row number, so the results don't depend on the order rows are found in.
+ */
+
+// Is (dist1, id1) further from the query point than (dist2, id2)?
+static inline bool knn_further(double dist1, rownum_type id1, double dist2, rownum_type id2) {
+    return (dist1 > dist2) || ((dist1 == dist2) && (id1 > id2));
+}
+
+static void knn_sift_down(rownum_type *ids, double *dists, size_t size, size_t pos) {
+    rownum_type id = ids[pos];
+    double dist = dists[pos];
+    while (2 * pos + 1 < size) {
+        size_t child = 2 * pos + 1;
+        if ((child + 1 < size) && knn_further(dists[child + 1], ids[child + 1], dists[child], ids[child])) {
+            child += 1;
+        }
+        if (!knn_further(dists[child], ids[child], dist, id)) {
+            break;
+        }
+        ids[pos] = ids[child];
+        dists[pos] = dists[child];
+        pos = child;
+    }
+    ids[pos] = id;
+    dists[pos] = dist;
+}
+
+static void knn_push(rownum_type *ids, double *dists, size_t k, size_t *size, rownum_type id, double dist) {
+    if (*size < k) {
+        size_t pos = *size;
+        *size += 1;
+        while ((pos > 0) && knn_further(dist, id, dists[(pos - 1) / 2], ids[(pos - 1) / 2])) {
+            ids[pos] = ids[(pos - 1) / 2];
+            dists[pos] = dists[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
+        }
+        ids[pos] = id;
+        dists[pos] = dist;
+    } else if (knn_further(dists[0], ids[0], dist, id)) {
+        ids[0] = id;
+        dists[0] = dist;
+        knn_sift_down(ids, dists, k, 0);
+    }
+}
+
+// views: num_views views of the rows to look at (from any trees, see query_block_views and
+// query_forest_probe_leaves), or NULL to use the subtree this point falls in with min_tree_rows rows
+// in each tree.
+static size_t knn_from_views(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *point,
+        const size_t point_dimension, const RbfLeafView *views, size_t num_views, const rownum_type min_tree_rows,
+        const RbfMetric metric, const size_t k, rownum_type *ret_ids, double *ret_dists) {
+    if ((k == 0) || (forest->config->num_trees == 0)) {
+        return 0;
+    }
+    uint32_t epoch;
+    uint32_t *seen = start_visit(forest->trees[0].num_rows, &epoch);
+    size_t size = 0;
+    rownum_type unpacked[QUERY_BLOCK_POINTS], fresh[QUERY_BLOCK_POINTS], fresh_positions[QUERY_BLOCK_POINTS];
+    double fresh_dists[QUERY_BLOCK_POINTS];
+    // With ordered points, rows are looked up by their position in trees[0]'s order, which for
+    // trees[0]'s own rows is just where they are in its row index:
+    const feature_type *points_by_pos = forest->ordered_points ? forest->ordered_points : ref_points;
+    nodenum_type leaves[WALK_INTERLEAVE];
+    if (!views) {
+        num_views = forest->config->num_trees;
+    }
+    for (size_t v = 0; v < num_views; v++) {
+        if (!views && (min_tree_rows <= 0) && (v % WALK_INTERLEAVE == 0)) {
+            find_trees_leaves(forest, v, (num_views - v < WALK_INTERLEAVE) ? num_views - v : WALK_INTERLEAVE, point, leaves);
+        }
+        RbfLeafView leaf = views ? views[v]
+                         : (min_tree_rows <= 0) ? leaf_view(&(forest->trees[v]), v, leaves[v % WALK_INTERLEAVE])
+                         : find_subtree(&(forest->trees[v]), v, point, min_tree_rows);
+        const RandomBinaryTree *tree = &(forest->trees[leaf.tree_num]);
+        for (rownum_type chunk_start = leaf.start; chunk_start < leaf.end; chunk_start += QUERY_BLOCK_POINTS) {
+            rownum_type chunk_end = (leaf.end - chunk_start < QUERY_BLOCK_POINTS) ? leaf.end : chunk_start + QUERY_BLOCK_POINTS;
+            const rownum_type *rows = unpacked;
+            if (tree->packed_row_index) {
+                unpack_row_index(tree->packed_row_index, tree->row_index_bits, chunk_start, chunk_end, unpacked);
+            } else {
+                rows = &(tree->row_index[chunk_start]);
+            }
+            size_t num_fresh = 0;
+            for (rownum_type i = 0; i < chunk_end - chunk_start; i++) {
+                rownum_type row = rows[i];
+                fresh[num_fresh] = row;
+                fresh_positions[num_fresh] = !forest->ordered_points ? row
+                                             : (leaf.tree_num == 0) ? chunk_start + i
+                                             : forest->ordered_positions[row];
+                num_fresh += (seen[row] != epoch);
+                seen[row] = epoch;
+            }
+            rbf_distances(metric, point, points_by_pos, point_dimension, fresh_positions, num_fresh,
+                          forest->ordered_points ? forest->ordered_norms : NULL, fresh_dists);
+            for (size_t i = 0; i < num_fresh; i++) {
+                knn_push(ret_ids, ret_dists, k, &size, fresh[i], fresh_dists[i]);
+            }
+        }
+    }
+    // heapsort the heap into nearest-first order:
+    for (size_t end = size; end > 1; end--) {
+        rownum_type id = ret_ids[end - 1];
+        double dist = ret_dists[end - 1];
+        ret_ids[end - 1] = ret_ids[0];
+        ret_dists[end - 1] = ret_dists[0];
+        ret_ids[0] = id;
+        ret_dists[0] = dist;
+        knn_sift_down(ret_ids, ret_dists, end - 1, 0);
+    }
+    return size;
+}
+
+
+/*
+ * A "point" is a feature-array. Find its k nearest neighbors by the given metric among the rows found
+ * by all trees, given the (row-major) reference points that the forest was trained on (which can be
+ * NULL if the forest has its own copy, see store_ordered_points).
+ * Each tree contributes the rows of the smallest subtree the point falls in with at least
+ * min_tree_rows rows (see query_forest_subtrees), so with min_tree_rows >= k we always get k
+ * neighbors (given that many training rows), and raising it trades query time for recall.
+ * Return: the number of neighbors found (at most k), and in ret_ids and ret_dists (which need room
+ *         for k of each) their row numbers and distances (see rbf_distances), nearest first.
+ */
+size_t query_forest_knn(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *point,
+        const size_t point_dimension, const RbfMetric metric, const size_t k, const rownum_type min_tree_rows,
+        rownum_type *ret_ids, double *ret_dists) {
+    assert(point_dimension == forest->config->num_features);
+    return knn_from_views(forest, ref_points, point, point_dimension, NULL, 0, min_tree_rows, metric, k, ret_ids, ret_dists);
+}
+
+
+/*
+ * Identical to query_forest_knn except for a batch of points: ret_ids and ret_dists have room for
+ * k results for each point in turn (so num_points * k), and ret_counts gets each point's count.
+ */
+void batch_query_forest_knn(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *points,
+        const size_t point_dimension, const size_t num_points, const RbfMetric metric, const size_t k,
+        const rownum_type min_tree_rows, rownum_type *ret_ids, double *ret_dists, size_t *ret_counts) {
+    assert(point_dimension == forest->config->num_features);
+    size_t num_trees = forest->config->num_trees;
+    size_t num_blocks = (num_points + QUERY_BLOCK_POINTS - 1) / QUERY_BLOCK_POINTS;
+    #pragma omp parallel
+    {
+        RbfLeafView *views = (RbfLeafView *) malloc(sizeof(RbfLeafView) * num_trees * QUERY_BLOCK_POINTS);
+        if (!views) {
+            die_alloc_err("batch_query_forest_knn", "views");
+        }
+        #pragma omp for schedule(dynamic)
+        for (size_t block = 0; block < num_blocks; block++) {
+            size_t block_start = block * QUERY_BLOCK_POINTS;
+            size_t block_points = (num_points - block_start < QUERY_BLOCK_POINTS) ? num_points - block_start : QUERY_BLOCK_POINTS;
+            query_block_views(forest, &(points[block_start * point_dimension]), point_dimension, block_points,
+                              min_tree_rows, views);
+            for (size_t i = 0; i < block_points; i++) {
+                size_t point_num = block_start + i;
+                ret_counts[point_num] = knn_from_views(forest, ref_points, &(points[point_num * point_dimension]),
+                        point_dimension, &(views[i * num_trees]), num_trees, min_tree_rows, metric, k,
+                        &(ret_ids[point_num * k]), &(ret_dists[point_num * k]));
+            }
+        }
+        free(views);
+    }
+}
+
+
+// Identical to batch_query_forest_knn except that the results, with their distances, are CSR-style
+// (see RbfCsrResults), so points with fewer than k candidates don't leave gaps.
+RbfCsrResults *batch_query_forest_knn_csr(const RandomBinaryForest *forest, const feature_type *ref_points,
+        const feature_type *points, const size_t point_dimension, const size_t num_points, const RbfMetric metric,
+        const size_t k, const rownum_type min_tree_rows) {
+    rownum_type *ids = (rownum_type *) malloc(sizeof(rownum_type) * num_points * k);
+    double *dists = (double *) malloc(sizeof(double) * num_points * k);
+    size_t *counts = (size_t *) malloc(sizeof(size_t) * num_points);
+    if ((!ids || !dists || !counts) && (num_points * k > 0)) {
+        die_alloc_err("batch_query_forest_knn_csr", "ids || dists || counts");
+    }
+    batch_query_forest_knn(forest, ref_points, points, point_dimension, num_points, metric, k, min_tree_rows,
+                           ids, dists, counts);
+    size_t num_results = 0;
+    for (size_t i = 0; i < num_points; i++) {
+        num_results += counts[i];
+    }
+    RbfCsrResults *results = alloc_csr_results(num_points, num_results, true);
+    results->indptr[0] = 0;
+    for (size_t i = 0; i < num_points; i++) {
+        results->indptr[i + 1] = results->indptr[i] + counts[i];
+        memcpy(&(results->indices[results->indptr[i]]), &(ids[i * k]), sizeof(rownum_type) * counts[i]);
+        memcpy(&(results->distances[results->indptr[i]]), &(dists[i * k]), sizeof(double) * counts[i]);
+    }
+    free(ids);
+    free(dists);
+    free(counts);
+    return results;
+}
+
+
+/*
+ * Multi-probe queries: instead of following one root-to-leaf path per tree, search all the trees
+ * best-first. One priority queue over all the trees holds the branches the point didn't go down,
+ * each keyed by its margin: how much point[feature] would have to change to go down it instead
+ * (|point[feature] - split value|, +1 on the left where the split value itself goes), or the key of
+ * the branch it hangs off if that's bigger, since the point would have to get there first.
+ * We pop the branch with the smallest key, follow the point down from there to a leaf (pushing the
+ * branches not taken on the way), and repeat until the leaves found hold candidate_budget rows.
+ * Each tree's own leaf has key 0, so they all come first: more probes only ever add candidates.
+ * Ties go to the lower tree then node number, so the results don't depend on the heap's history.
+ */
+typedef struct {
+    int32_t margin;
+    uint32_t tree_num;
+    nodenum_type node;
+} probe_branch;
+
+// Per-thread priority queue (it grows as needed and is kept from one query to the next, like visited).
+static __thread probe_branch *probe_heap = NULL;
+static __thread size_t probe_heap_capacity = 0;
+
+static inline bool probe_before(probe_branch b1, probe_branch b2) {
+    return (b1.margin < b2.margin)
+           || ((b1.margin == b2.margin) && ((b1.tree_num < b2.tree_num)
+                                            || ((b1.tree_num == b2.tree_num) && (b1.node < b2.node))));
+}
+
+static void probe_push(size_t *size, probe_branch branch) {
+    if (*size == probe_heap_capacity) {
+        probe_heap_capacity = 2 * probe_heap_capacity + 64;
+        probe_heap = (probe_branch *) realloc(probe_heap, sizeof(probe_branch) * probe_heap_capacity);
+        if (!probe_heap) {
+            die_alloc_err("probe_push", "probe_heap");
+        }
+    }
+    size_t pos = *size;
+    *size += 1;
+    while ((pos > 0) && probe_before(branch, probe_heap[(pos - 1) / 2])) {
+        probe_heap[pos] = probe_heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    probe_heap[pos] = branch;
+}
+
+static probe_branch probe_pop(size_t *size) {
+    probe_branch top = probe_heap[0];
+    *size -= 1;
+    probe_branch last = probe_heap[*size];
+    size_t pos = 0;
+    while (2 * pos + 1 < *size) {
+        size_t child = 2 * pos + 1;
+        if ((child + 1 < *size) && probe_before(probe_heap[child + 1], probe_heap[child])) {
+            child += 1;
+        }
+        if (!probe_before(probe_heap[child], last)) {
+            break;
+        }
+        probe_heap[pos] = probe_heap[child];
+        pos = child;
+    }
+    probe_heap[pos] = last;
+    return top;
+}
+
+
+/*
+ * The leaves (from any of the trees) that a best-first search for this point finds before they hold
+ * candidate_budget rows between them (counting rows found in more than one leaf each time), but at
+ * least each tree's own leaf, and at most max_leaves of them, nearest first.
+ * Return: the number of leaves, whose views are in ret_leaves (see leaf_view_rows).
+ */
+size_t query_forest_probe_leaves(const RandomBinaryForest *forest, const feature_type *point,
+        const size_t point_dimension, const size_t candidate_budget, const size_t max_leaves, RbfLeafView *ret_leaves) {
+    assert(point_dimension == forest->config->num_features);
+    size_t heap_size = 0, num_leaves = 0, num_candidates = 0;
+    for (size_t tree_num = 0; tree_num < forest->config->num_trees; tree_num++) {
+        probe_branch root = {0, (uint32_t) tree_num, 0};
+        probe_push(&heap_size, root);
+    }
+    while ((heap_size > 0) && (num_leaves < max_leaves)
+            && ((probe_heap[0].margin == 0) || (num_candidates < candidate_budget))) {
+        probe_branch branch = probe_pop(&heap_size);
+        const RandomBinaryTree *tree = &(forest->trees[branch.tree_num]);
+        nodenum_type array_pos = branch.node;
+        rownum_type first = tree->tree_first[array_pos];
+        while (first >> HIGH_BIT == 0) {
+            int32_t diff = (int32_t) point[(size_t) first] - tree->tree_second[array_pos];
+            bool go_right = (diff > 0);
+            int32_t margin = go_right ? diff : 1 - diff;
+            probe_branch other = {(margin > branch.margin) ? margin : branch.margin, branch.tree_num,
+                                  tree->tree_child[array_pos] + !go_right};
+            probe_push(&heap_size, other);
+            array_pos = tree->tree_child[array_pos] + go_right;
+            first = tree->tree_first[array_pos];
+        }
+        ret_leaves[num_leaves] = leaf_view(tree, branch.tree_num, array_pos);
+        num_candidates += ret_leaves[num_leaves].end - ret_leaves[num_leaves].start;
+        num_leaves += 1;
+    }
+    return num_leaves;
+}
+
+
+// Per-thread buffer for the leaves the kNN probes find.
+static __thread RbfLeafView *probe_leaves = NULL;
+static __thread size_t probe_leaves_capacity = 0;
+
+/*
+ * Like query_forest_knn, but the candidates are the rows of the leaves a best-first search across
+ * all the trees finds (see query_forest_probe_leaves) before they hold candidate_budget rows.
+ * So a few trees with a bigger budget can get the recall of many more trees, in less memory.
+ */
+size_t query_forest_knn_probe(const RandomBinaryForest *forest, const feature_type *ref_points, const feature_type *point,
+        const size_t point_dimension, const RbfMetric metric, const size_t k, const size_t candidate_budget,
+        rownum_type *ret_ids, double *ret_dists) {
+    // Each leaf after the trees' own ones adds to the budget, unless it's empty, so this is plenty:
+    size_t max_leaves = forest->config->num_trees + candidate_budget;
+    if (probe_leaves_capacity < max_leaves) {
+        free(probe_leaves);
+        probe_leaves = (RbfLeafView *) malloc(sizeof(RbfLeafView) * max_leaves);
+        if (!probe_leaves) {
+            die_alloc_err("query_forest_knn_probe", "probe_leaves");
+        }
+        probe_leaves_capacity = max_leaves;
+    }
+    size_t num_leaves = query_forest_probe_leaves(forest, point, point_dimension, candidate_budget, max_leaves,
+                                                  probe_leaves);
+    return knn_from_views(forest, ref_points, point, point_dimension, probe_leaves, num_leaves, 0, metric, k,
+                          ret_ids, ret_dists);
+}
+
+
+// Identical to query_forest_knn_probe except for a batch of points (see batch_query_forest_knn).
+void batch_query_forest_knn_probe(const RandomBinaryForest *forest, const feature_type *ref_points,
+        const feature_type *points, const size_t point_dimension, const size_t num_points, const RbfMetric metric,
+        const size_t k, const size_t candidate_budget, rownum_type *ret_ids, double *ret_dists, size_t *ret_counts) {
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (size_t i = 0; i < num_points; i++) {
+        ret_counts[i] = query_forest_knn_probe(forest, ref_points, &(points[i * point_dimension]), point_dimension,
+                                               metric, k, candidate_budget, &(ret_ids[i * k]), &(ret_dists[i * k]));
+    }
+}
+
+
+// Free the calling thread's query buffers (see rbf_release_thread_buffers).
+static void release_this_thread_buffers() {
+    free(visited);
+    visited = NULL;
+    visited_size = 0;
+    visited_epoch = 0;
+    free(first_found);
+    first_found = NULL;
+    first_found_size = 0;
+    first_found_epoch = 0;
+    free(probe_heap);
+    probe_heap = NULL;
+    probe_heap_capacity = 0;
+    free(probe_leaves);
+    probe_leaves = NULL;
+    probe_leaves_capacity = 0;
+}
+
+/*
+ * Free the per-thread buffers queries keep from one query to the next (the dedup arrays and the
+ * probe buffers; see rbf.h for what they cost), for the calling thread and the OpenMP threads its
+ * batch queries run on. They're allocated again by the next query that needs them.
+ * Must not be called while the calling thread's queries are running.
+ */
+void rbf_release_thread_buffers() {
+    #pragma omp parallel
+    release_this_thread_buffers();
+}
@@ -1,7 +1,15 @@
+#include <fcntl.h>
+#include <math.h>
+#include <omp.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "rbf.h"
 #include "_rbf_train.h"
 #include "_rbf_query.h"
+#include "_rbf_io.h"
+#include "_rbf_distance.h"
+#include "_rbf_utils.h"
 
 
 bool _test_array_seg_eq_val(uint arr1[], size_t start, size_t end, uint val) {
@@ -45,9 +53,102 @@ bool test_feature_column_to_bins() {
 }
 
 
+bool test_features_to_bins() {
+    // given a shuffled row index over some random-ish features:
+    rownum_type num_rows = 5000;
+    colnum_type num_features = 5;
+    feature_type *feature_array = malloc((size_t) num_rows * num_features);
+    for (size_t i = 0; i < (size_t) num_rows * num_features; i++) {
+        feature_array[i] = (feature_type) ((i * 2654435761u) >> 13) % (i % 3 ? 256 : 4);   // some features with lots of repeats
+    }
+    rownum_type *row_index = malloc(sizeof(rownum_type) * num_rows);
+    for (rownum_type i = 0; i < num_rows; i++) {
+        row_index[i] = (rownum_type) (((int64_t) i * 7919) % num_rows);
+    }
+    colnum_type feat_nums[3] = {4, 0, 2};
+    stats_type *sub_hists = malloc(sizeof(stats_type) * 3 * HIST_COPIES * NUM_CHARS);
+    // when we bin views both smaller and bigger than SUB_HIST_MIN_ROWS, then we get the same
+    // results as from feature_column_to_bins:
+    rownum_type views[3][2] = {{0, 0}, {10, 1000}, {7, num_rows}};
+    bool ok = true;
+    for (size_t v = 0; v < 3; v++) {
+        stats_type *counts = calloc(sizeof(stats_type), 3 * NUM_CHARS);
+        stats_type *exp_counts = calloc(sizeof(stats_type), 3 * NUM_CHARS);
+        stats_type weighted_totals[3] = {0, 0, 0}, exp_weighted_totals[3] = {0, 0, 0};
+        features_to_bins(row_index, feature_array, num_rows, feat_nums, 3, views[v][0], views[v][1], sub_hists,
+                         counts, weighted_totals);
+        for (size_t f = 0; f < 3; f++) {
+            feature_column_to_bins(row_index, feature_array, feat_nums[f], num_rows, views[v][0], views[v][1],
+                                   &(exp_counts[f * NUM_CHARS]), &(exp_weighted_totals[f]));
+        }
+        ok = ok && (memcmp(counts, exp_counts, sizeof(stats_type) * 3 * NUM_CHARS) == 0)
+                && (memcmp(weighted_totals, exp_weighted_totals, sizeof(weighted_totals)) == 0);
+        free(counts);
+        free(exp_counts);
+    }
+    return ok;
+}
+
+
+bool test_sibling_hists() {
+    // given a node's histograms over some features, and a split of its view:
+    rownum_type num_rows = 3000;
+    colnum_type num_features = 6, num_feats = 3;
+    feature_type *feature_array = malloc((size_t) num_rows * num_features);
+    for (size_t i = 0; i < (size_t) num_rows * num_features; i++) {
+        feature_array[i] = (feature_type) ((i * 2654435761u) >> 13) % (i % 3 ? 256 : 4);
+    }
+    rownum_type *row_index = malloc(sizeof(rownum_type) * num_rows);
+    for (rownum_type i = 0; i < num_rows; i++) {
+        row_index[i] = (rownum_type) (((int64_t) i * 7919) % num_rows);
+    }
+    colnum_type feat_nums[3] = {5, 1, 2};
+    stats_type *sub_hists = malloc(sizeof(stats_type) * num_feats * HIST_COPIES * NUM_CHARS);
+    node_hists parent, left, right, exp_left, exp_right;
+    alloc_node_hists(&parent, num_feats);
+    memcpy(parent.feat_subset, feat_nums, sizeof(feat_nums));
+    memset(parent.feat_freqs, 0, sizeof(stats_type) * num_feats * NUM_CHARS);
+    memset(parent.weighted_totals, 0, sizeof(stats_type) * num_feats);
+    features_to_bins(row_index, feature_array, num_rows, feat_nums, num_feats, 20, 2900, sub_hists,
+                     parent.feat_freqs, parent.weighted_totals);
+    bool ok = true;
+    // when we get the children's histograms by subtraction, with either child the smaller:
+    rownum_type splits[3] = {20, 700, 2500};
+    for (size_t s = 0; s < 3; s++) {
+        alloc_node_hists(&left, num_feats);
+        alloc_node_hists(&right, num_feats);
+        sibling_hists(row_index, feature_array, num_rows, &parent, num_feats, 20, splits[s], 2900, sub_hists,
+                      &left, &right);
+        // then they're the same as binning each child directly:
+        alloc_node_hists(&exp_left, num_feats);
+        alloc_node_hists(&exp_right, num_feats);
+        memset(exp_left.feat_freqs, 0, sizeof(stats_type) * num_feats * NUM_CHARS);
+        memset(exp_left.weighted_totals, 0, sizeof(stats_type) * num_feats);
+        memset(exp_right.feat_freqs, 0, sizeof(stats_type) * num_feats * NUM_CHARS);
+        memset(exp_right.weighted_totals, 0, sizeof(stats_type) * num_feats);
+        features_to_bins(row_index, feature_array, num_rows, feat_nums, num_feats, 20, splits[s], sub_hists,
+                         exp_left.feat_freqs, exp_left.weighted_totals);
+        features_to_bins(row_index, feature_array, num_rows, feat_nums, num_feats, splits[s], 2900, sub_hists,
+                         exp_right.feat_freqs, exp_right.weighted_totals);
+        ok = ok && (memcmp(left.feat_subset, feat_nums, sizeof(feat_nums)) == 0)
+                && (memcmp(right.feat_subset, feat_nums, sizeof(feat_nums)) == 0)
+                && (memcmp(left.feat_freqs, exp_left.feat_freqs, sizeof(stats_type) * num_feats * NUM_CHARS) == 0)
+                && (memcmp(right.feat_freqs, exp_right.feat_freqs, sizeof(stats_type) * num_feats * NUM_CHARS) == 0)
+                && (memcmp(left.weighted_totals, exp_left.weighted_totals, sizeof(stats_type) * num_feats) == 0)
+                && (memcmp(right.weighted_totals, exp_right.weighted_totals, sizeof(stats_type) * num_feats) == 0);
+        free_node_hists(&left);
+        free_node_hists(&right);
+        free_node_hists(&exp_left);
+        free_node_hists(&exp_right);
+    }
+    free_node_hists(&parent);
+    return ok;
+}
+
+
 bool test_select_random_features_and_get_frequencies() {
     // given:
-    srand(2); // ensures we select feature 0
+    rbf_rng rng = rng_init(0, 0); // ensures we select feature 0
     bool selected[2] = {false, false};
     rownum_type row_index[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
     feature_type feature_array[20] = {0, 0, 5, 5, 5, 5, 7, 7, 7, 7,
@@ -58,7 +159,8 @@ bool test_select_random_features_and_get_frequencies() {
     colnum_type feature_subset;
     stats_type *counts = (stats_type *) calloc(sizeof(stats_type), 1 * NUM_CHARS);
     stats_type weighted_total = 0;
-    select_random_features_and_get_frequencies(row_index, feature_array, selected, &config, 0, 10, &feature_subset, counts, &weighted_total);
+    stats_type sub_hists[HIST_COPIES * NUM_CHARS];
+    select_random_features_and_get_frequencies(row_index, feature_array, selected, &config, &rng, 0, 10, sub_hists, &feature_subset, counts, &weighted_total);
     // then:
     stats_type expected_counts[8] = {2, 0, 0, 0, 0, 4, 0, 4};
     bool test1_passed = (feature_subset == 0)
@@ -66,10 +168,10 @@ bool test_select_random_features_and_get_frequencies() {
                          &&  _test_array_equals(counts, 8, expected_counts, 8)
                          &&  _test_array_seg_eq_val(counts, 8, NUM_CHARS, 0);
 
-    srand(1); // ensures we select feature 1
+    rng = rng_init(2, 0); // ensures we select feature 1
     bool selected_2[2] = {false, false};
     weighted_total = 0;
-    select_random_features_and_get_frequencies(row_index, feature_array, selected_2, &config, 0, 10, &feature_subset, counts, &weighted_total);
+    select_random_features_and_get_frequencies(row_index, feature_array, selected_2, &config, &rng, 0, 10, sub_hists, &feature_subset, counts, &weighted_total);
     bool test2_passed = (feature_subset == 1) && (weighted_total == 10) && (counts[1] == 10);
     return test1_passed && test2_passed;
 }
@@ -185,6 +287,33 @@ bool test_quick_partition() {
 }
 
 
+bool test_branchless_partition() {
+    // given random views of a shuffled row index over a feature with lots of repeats:
+    rownum_type num_rows = 1000;
+    feature_type feature_array[2 * 1000];
+    for (size_t i = 0; i < 2 * 1000; i++) {
+        feature_array[i] = (feature_type) (((i * 2654435761u) >> 11) % 16);
+    }
+    rownum_type row_index_1[1000], row_index_2[1000], misplaced[1000];
+    uint8_t goes_right[1000];
+    bool ok = true;
+    for (int trial = 0; trial < 200; trial++) {
+        for (rownum_type i = 0; i < num_rows; i++) {
+            row_index_1[i] = row_index_2[i] = (rownum_type) (((int64_t) i * 7919 + trial) % num_rows);
+        }
+        rownum_type index_start = (trial * 37) % 300, index_end = index_start + (trial * 53) % 700;
+        feature_type split_val = (feature_type) ((trial % 19) - 1);     // including ones with no rows on the right
+        // when we partition with both quick_partition and branchless_partition:
+        rownum_type split_1 = quick_partition(row_index_1, feature_array, num_rows, index_start, index_end, 1, split_val);
+        rownum_type split_2 = branchless_partition(row_index_2, feature_array, num_rows, index_start, index_end, 1, split_val,
+                                                   goes_right, misplaced);
+        // then we get the same split position and row order:
+        ok = ok && (split_1 == split_2) && (memcmp(row_index_1, row_index_2, sizeof(row_index_1)) == 0);
+    }
+    return ok;
+}
+
+
 bool test_transpose() {
     feature_type input[] = {1, 2, 3,  // matrix with 2 rows, 3 cols
                             4, 5, 6};
@@ -196,9 +325,247 @@ bool test_transpose() {
     for (size_t i = 0; i < 6; i++) {
         compare = compare && (output[i] == exp_transpose[i]);
     }
+    free(output);
+
+    // and transposing bigger matrices (with whole tiles and blocks, and partial ones) into a buffer all at once,
+    // or a few rows at a time, gives the same:
+    size_t shapes[][2] = {{37, 11}, {64, 64}, {150, 100}, {17, 130}, {300, 784}};
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        size_t rows = shapes[s][0], cols = shapes[s][1];
+        feature_type *big_input = malloc(rows * cols), *all_at_once = malloc(rows * cols), *in_chunks = malloc(rows * cols);
+        for (size_t i = 0; i < rows * cols; i++) {
+            big_input[i] = (feature_type) ((i * 2654435761u) >> 11);
+        }
+        transpose_into(big_input, rows, cols, all_at_once);
+        for (size_t row_start = 0; row_start < rows; row_start += 23) {
+            transpose_rows(big_input, rows, cols, row_start, (row_start + 23 < rows) ? row_start + 23 : rows, in_chunks);
+        }
+        for (size_t i = 0; i < rows; i++) {
+            for (size_t j = 0; j < cols; j++) {
+                compare = compare && (all_at_once[j * rows + i] == big_input[i * cols + j]);
+            }
+        }
+        compare = compare && (memcmp(all_at_once, in_chunks, rows * cols) == 0);
+        free(big_input);
+        free(all_at_once);
+        free(in_chunks);
+    }
     return compare;
 }
 
+// Fill a num_rows x num_features column-major feature array with arbitrary-looking values.
+void _test_fill_features(feature_type *feature_array, rownum_type num_rows, colnum_type num_features) {
+    for (size_t i = 0; i < (size_t) num_rows * num_features; i++) {
+        feature_array[i] = (feature_type) ((i * 2654435761u) >> 13);
+    }
+}
+
+// Fill num_points row-major query points with arbitrary-looking values, unlike the training data's.
+void _test_fill_points(feature_type *points, size_t num_points, colnum_type num_features) {
+    for (size_t i = 0; i < num_points * num_features; i++) {
+        points[i] = (feature_type) ((i * 2654435761u) >> 9);
+    }
+}
+
+// Train a forest on _test_fill_features data for config, and pack tree packed_tree's row index (if it's
+// not negative). Set *feature_array to the (column-major) data, and *points (if not NULL) to num_points
+// from _test_fill_points. The caller frees the forest and the arrays.
+RandomBinaryForest *_test_train_forest(RbfConfig *config, int packed_tree, feature_type **feature_array,
+                                       size_t num_points, feature_type **points) {
+    *feature_array = malloc((size_t) config->num_rows * config->num_features);
+    _test_fill_features(*feature_array, config->num_rows, config->num_features);
+    RandomBinaryForest *forest = train_forest(*feature_array, config);
+    if (packed_tree >= 0) {
+        pack_tree_row_index(&(forest->trees[packed_tree]));
+    }
+    if (points) {
+        *points = malloc(num_points * config->num_features);
+        _test_fill_points(*points, num_points, config->num_features);
+    }
+    return forest;
+}
+
+// Is the subtree at node exactly the view row_index[start..end), split as tree_split says?
+bool _test_subtree_spans(RandomBinaryTree *tree, nodenum_type node, rownum_type start, rownum_type end) {
+    if (tree->tree_first[node] >> HIGH_BIT != 0) {
+        return ((HIGH_BIT_1 ^ tree->tree_first[node]) == start) && ((HIGH_BIT_1 ^ tree->tree_second[node]) == end);
+    }
+    rownum_type split = tree->tree_split[node];
+    return (start <= split) && (split <= end)
+            && _test_subtree_spans(tree, tree->tree_child[node], start, split)
+            && _test_subtree_spans(tree, tree->tree_child[node] + 1, split, end);
+}
+
+bool test_train_tree_layout() {
+    // given:
+    rownum_type num_rows = 500;
+    colnum_type num_features = 8;
+    feature_type *feature_array = malloc((size_t) num_rows * num_features);
+    _test_fill_features(feature_array, num_rows, num_features);
+    RbfConfig config = {2, 12, 4, num_rows, num_features, 2};
+    // when:
+    RandomBinaryForest *forest = train_forest(feature_array, &config);
+    // then, for each tree:
+    bool ok = true;
+    for (size_t t = 0; ok && (t < config.num_trees); t++) {
+        RandomBinaryTree *tree = &(forest->trees[t]);
+        // only the nodes that exist are stored (far fewer than 2^tree_depth),
+        ok = (tree->tree_size == tree->num_internal_nodes + tree->num_leaves)
+              && (tree->num_leaves == tree->num_internal_nodes + 1)
+              && (tree->tree_size < ((size_t) 1 << config.tree_depth) / 4);
+        // the leaves partition row_index,
+        rownum_type covered = 0;
+        for (size_t node = 0; ok && (node < tree->tree_size); node++) {
+            if (tree->tree_first[node] >> HIGH_BIT != 0) {
+                covered += (HIGH_BIT_1 ^ tree->tree_second[node]) - (HIGH_BIT_1 ^ tree->tree_first[node]);
+            } else {
+                ok = (tree->tree_child[node] > node) && (tree->tree_child[node] + 1 < tree->tree_size);
+            }
+        }
+        ok = ok && (covered == num_rows) && _test_subtree_spans(tree, 0, 0, num_rows);
+        // and every training row is found in the leaf that its own features lead to:
+        feature_type point[8];
+        for (rownum_type row = 0; ok && (row < num_rows); row++) {
+            for (colnum_type f = 0; f < num_features; f++) {
+                point[f] = feature_array[(size_t) num_rows * f + row];
+            }
+            RbfResults *results = query_forest_all_results(forest, point, num_features);
+            bool found = false;
+            for (size_t i = 0; i < results->tree_result_counts[t]; i++) {
+                found = found || (results->tree_results[t][i] == row);
+            }
+            ok = found;
+            free_results(results);
+        }
+    }
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+bool test_pack_row_index() {
+    // given a permutation of 0..num_rows-1 for a few different sizes:
+    rownum_type sizes[] = {1, 2, 5, 1000, 70000};
+    int exp_bits[] = {1, 1, 3, 10, 17};
+    bool roundtrip_ok = true;
+    for (size_t s = 0; s < 5; s++) {
+        rownum_type num_rows = sizes[s];
+        rownum_type *row_index = malloc(sizeof(rownum_type) * num_rows);
+        rownum_type *unpacked = malloc(sizeof(rownum_type) * num_rows);
+        for (rownum_type i = 0; i < num_rows; i++) {
+            row_index[i] = (rownum_type) (((int64_t) i * 7919) % num_rows);
+        }
+        // when we pack and unpack it (in one piece and in two):
+        int bits = row_index_bits(num_rows);
+        uint8_t *packed = pack_row_index(row_index, num_rows, bits);
+        unpack_row_index(packed, bits, 0, num_rows, unpacked);
+        bool whole_ok = (memcmp(row_index, unpacked, sizeof(rownum_type) * num_rows) == 0);
+        unpack_row_index(packed, bits, num_rows / 3, num_rows, unpacked);
+        bool part_ok = (memcmp(&(row_index[num_rows / 3]), unpacked, sizeof(rownum_type) * (num_rows - num_rows / 3)) == 0);
+        // then we get it back, using ceil(log2(num_rows)) bits per entry:
+        roundtrip_ok = roundtrip_ok && (bits == exp_bits[s]) && whole_ok && part_ok;
+        free(row_index);
+        free(unpacked);
+        free(packed);
+    }
+
+    // and the widest entries, 31 bits for forests of more than 2^30 rows (too many to train here), round-trip too:
+    rownum_type wide_rows[100], wide_unpacked[100];
+    for (rownum_type i = 0; i < 100; i++) {
+        wide_rows[i] = (rownum_type) (INT32_MAX - (rownum_type) (((int64_t) i * 2654435761u) % INT32_MAX));
+    }
+    uint8_t *wide_packed = pack_row_index(wide_rows, 100, HIGH_BIT);
+    unpack_row_index(wide_packed, HIGH_BIT, 0, 100, wide_unpacked);
+    roundtrip_ok = roundtrip_ok && (row_index_bits(((rownum_type) 1 << 30) + 1) == HIGH_BIT)
+                   && (memcmp(wide_rows, wide_unpacked, sizeof(wide_rows)) == 0);
+    free(wide_packed);
+
+    // given a trained forest and its query results:
+    rownum_type num_rows = 300;
+    colnum_type num_features = 6;
+    RbfConfig config = {3, 10, 3, num_rows, num_features, 2};
+    feature_type *feature_array;
+    RandomBinaryForest *forest = _test_train_forest(&config, -1, &feature_array, 0, NULL);
+    feature_type point[] = {10, 200, 30, 140, 50, 160};
+    RbfResults *before = query_forest_all_results(forest, point, num_features);
+    // when we pack the trees' row indices:
+    for (size_t t = 0; t < config.num_trees; t++) {
+        pack_tree_row_index(&(forest->trees[t]));
+    }
+    RbfResults *after = query_forest_all_results(forest, point, num_features);
+    // then queries return the same results:
+    bool query_ok = (before->total_count == after->total_count) && (forest->trees[0].row_index == NULL);
+    for (size_t t = 0; query_ok && (t < config.num_trees); t++) {
+        query_ok = (before->tree_result_counts[t] == after->tree_result_counts[t])
+                    && (memcmp(before->tree_results[t], after->tree_results[t],
+                               sizeof(rownum_type) * before->tree_result_counts[t]) == 0);
+    }
+    free_results(before);
+    free_results(after);
+    free_forest(forest);
+    free(feature_array);
+    return roundtrip_ok && query_ok;
+}
+
+
+bool _test_same_forest(RandomBinaryForest *f1, RandomBinaryForest *f2) {
+    for (size_t i = 0; i < f1->config->num_trees; i++) {
+        RandomBinaryTree *t1 = &(f1->trees[i]), *t2 = &(f2->trees[i]);
+        if ((t1->tree_size != t2->tree_size)
+                || (memcmp(t1->row_index, t2->row_index, sizeof(rownum_type) * t1->num_rows) != 0)
+                || (memcmp(t1->tree_first, t2->tree_first, sizeof(rownum_type) * t1->tree_size) != 0)
+                || (memcmp(t1->tree_second, t2->tree_second, sizeof(rownum_type) * t1->tree_size) != 0)
+                || (memcmp(t1->tree_child, t2->tree_child, sizeof(nodenum_type) * t1->tree_size) != 0)
+                || (memcmp(t1->tree_split, t2->tree_split, sizeof(rownum_type) * t1->tree_size) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_train_reproducible() {
+    // given:
+    rownum_type num_rows = 400;
+    colnum_type num_features = 10;
+    feature_type *feature_array = malloc((size_t) num_rows * num_features);
+    _test_fill_features(feature_array, num_rows, num_features);
+    RbfConfig config = {6, 10, 3, num_rows, num_features, 3, false, 12345};
+    RbfConfig other_seed_config = config;
+    other_seed_config.seed = 54321;
+    // when we train with the same seed on different numbers of threads:
+    int max_threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+    RandomBinaryForest *forest_1 = train_forest(feature_array, &config);
+    omp_set_num_threads(4);
+    RandomBinaryForest *forest_4 = train_forest(feature_array, &config);
+    RandomBinaryForest *forest_other_seed = train_forest(feature_array, &other_seed_config);
+    // or also build big subtrees as separate tasks:
+    RbfConfig tasks_config = config;
+    tasks_config.task_min_rows = 50;
+    RandomBinaryForest *forest_tasks = train_forest(feature_array, &tasks_config);
+    // and the same goes when nodes share their parent's features:
+    RbfConfig shared_config = config;
+    shared_config.share_features_levels = 3;
+    RbfConfig shared_tasks_config = tasks_config;
+    shared_tasks_config.share_features_levels = 3;
+    RandomBinaryForest *forest_shared = train_forest(feature_array, &shared_config);
+    RandomBinaryForest *forest_shared_tasks = train_forest(feature_array, &shared_tasks_config);
+    omp_set_num_threads(max_threads);
+    // then we get identical forests, but a different seed gives a different forest:
+    bool ok = _test_same_forest(forest_1, forest_4) && _test_same_forest(forest_1, forest_tasks)
+              && !_test_same_forest(forest_1, forest_other_seed)
+              && _test_same_forest(forest_shared, forest_shared_tasks) && !_test_same_forest(forest_1, forest_shared);
+    free_forest(forest_1);
+    free_forest(forest_4);
+    free_forest(forest_other_seed);
+    free_forest(forest_tasks);
+    free_forest(forest_shared);
+    free_forest(forest_shared_tasks);
+    free(feature_array);
+    return ok;
+}
+
+
 bool test_query() {
     // given:
 
@@ -209,6 +576,7 @@ bool test_query() {
     //   root node:
     //     tree_first[0]: i.e. split on the 0 feature (i.e. "aa")
     //     tree_second[0]: split-value 1
+    //     tree_child[0]: left child is node 1 (so the right child is node 2)
     //   left child:
     //     tree_first[1]: (leaf) 1 ("abc")  (actually HIGH_BIT_1 ^ 1)
     //     tree_second[1]: (leaf) 2         (actualy HIGH_BIT_1 ^ 2)
@@ -220,8 +588,9 @@ bool test_query() {
     int num_rows = 2;
     rownum_type tree_first[] = {0, HIGH_BIT_1 ^ 1, HIGH_BIT_1 ^ 0};
     rownum_type tree_second[] = {1, HIGH_BIT_1 ^ 2, HIGH_BIT_1 ^ 1};
+    nodenum_type tree_child[] = {1, 0, 0};
     int tree_size = 3;
-    RandomBinaryTree tree = {row_index, num_rows, tree_first, tree_second, tree_size,
+    RandomBinaryTree tree = {row_index, num_rows, tree_first, tree_second, tree_child, tree_size,
                              0, 0}; // don't care about these last two
     RandomBinaryTree trees[] = {tree, tree};
     int num_trees = 2;
@@ -235,10 +604,10 @@ bool test_query() {
 
     // when
     RbfResults *results = query_forest_all_results(&forest, point, num_features);
-    RbfResults *batch_results = batch_query_forest_all_results(&forest, two_points, num_features, num_points);
-    size_t count, **batch_counts;
+    RbfBatchResults *batch_results = batch_query_forest_all_results(&forest, two_points, num_features, num_points);
+    size_t count, *batch_counts;
     rownum_type *deduped_results = query_forest_dedup_results(&forest, point, num_features, &count);
-    rownum_type **batch_deduped_results = batch_query_forest_dedup_results(&forest, two_points, num_features, num_points, batch_counts);
+    rownum_type **batch_deduped_results = batch_query_forest_dedup_results(&forest, two_points, num_features, num_points, &batch_counts);
 
     // then
     bool all_result = (results->tree_result_counts[0] == 1)        // Each tree returns exactly 1 result
@@ -246,16 +615,24 @@ bool test_query() {
                        && (results->tree_results[0][0] == 0)       // and the result is "aaaa"
                        && (results->tree_results[1][0] == 0);
     bool dedup_result = (count == 1) && (deduped_results[0] == 0);
-    bool batch_all_result = (batch_results[0].tree_result_counts[0] == 1)        // Each tree returns exactly 1 result
-                             && (batch_results[0].tree_result_counts[1] == 1)
-                             && (batch_results[0].tree_results[0][0] == 0)       // and the result is "aaaa"
-                             && (batch_results[0].tree_results[1][0] == 0)
-                             && (batch_results[1].tree_result_counts[0] == 1)    // Each tree returns exactly 1 result
-                             && (batch_results[1].tree_result_counts[1] == 1)
-                             && (batch_results[1].tree_results[0][0] == 1)       // and the result is "abc"
-                             && (batch_results[1].tree_results[1][0] == 1);
-    bool batch_dedup_result = ((*batch_counts)[0] == 1) && (batch_deduped_results[0][0] == 0)       // only one result, "aaaa"
-                              && ((*batch_counts)[1] == 1) && (batch_deduped_results[1][0] == 1);   // only one result, "abcd"
+    size_t *offsets = batch_results->offsets;
+    bool batch_all_result = (batch_results->num_points == 2) && (batch_results->num_trees == 2)
+                             && (offsets[0] == 0) && (offsets[1] == 1)  // Each tree returns exactly 1 result
+                             && (offsets[2] == 2) && (offsets[3] == 3) && (offsets[4] == 4)
+                             && (batch_results->ids[0] == 0)            // and the result is "aaaa"
+                             && (batch_results->ids[1] == 0)
+                             && (batch_results->ids[2] == 1)            // and the result is "abc"
+                             && (batch_results->ids[3] == 1);
+    bool batch_dedup_result = (batch_counts[0] == 1) && (batch_deduped_results[0][0] == 0)       // only one result, "aaaa"
+                              && (batch_counts[1] == 1) && (batch_deduped_results[1][0] == 1);   // only one result, "abcd"
+    free_results(results);
+    free_batch_results(batch_results);
+    free(deduped_results);
+    for (size_t i = 0; i < num_points; i++) {
+        free(batch_deduped_results[i]);
+    }
+    free(batch_deduped_results);
+    free(batch_counts);
     return all_result && dedup_result && batch_all_result && batch_dedup_result;
 }
 
@@ -268,6 +645,7 @@ bool test_query_sorted() {
     //   root node:
     //     tree_first[0]: i.e. split on the 0 feature
     //     tree_second[0]: split-value 1
+    //     tree_child[0]: left child is node 1 (so the right child is node 2)
     //   left child:
     //     tree_first[1]: (leaf) 0          (act0ally HIGH_BIT_1 ^ 0)
     //     tree_second[1]: (leaf) 2         (actualy HIGH_BIT_1 ^ 2)
@@ -284,8 +662,9 @@ bool test_query_sorted() {
     int num_rows = 7;
     rownum_type tree_first[] = {0, HIGH_BIT_1 ^ 0, HIGH_BIT_1 ^ 3};
     rownum_type tree_second[] = {1, HIGH_BIT_1 ^ 2, HIGH_BIT_1 ^ 7};
+    nodenum_type tree_child[] = {1, 0, 0};
     int tree_size = 3;
-    RandomBinaryTree tree = {row_index, num_rows, tree_first, tree_second, tree_size,
+    RandomBinaryTree tree = {row_index, num_rows, tree_first, tree_second, tree_child, tree_size,
                              0, 0}; // don't care about these last two
     RandomBinaryTree trees[] = {tree, tree};
     int num_trees = 2;
@@ -298,17 +677,821 @@ bool test_query_sorted() {
     size_t num_points = 2;
 
     // when
-    RbfResults *batch_results = batch_query_forest_all_results(&forest, two_points, num_features, num_points);
-    size_t **counts;
-    rownum_type **results = batch_query_forest_dedup_results_sorted(&forest, ref_points, two_points, num_features, num_points, l2_compare, counts);
+    size_t *counts;
+    rownum_type **results = batch_query_forest_dedup_results_sorted(&forest, ref_points, two_points, num_features, num_points, l2_compare, &counts);
 
     // then
-    return ((*counts)[0] == 4)
+    return (counts[0] == 4)
             && (results[0][0] == 5)     // see comments in defintion
             && (results[0][1] == 6)     // of `ref_points` above
             && (results[0][2] == 4)
             && (results[0][3] == 3)
-            && ((*counts)[1] == 2)
+            && (counts[1] == 2)
             && (results[1][0] == 0)
             && (results[1][1] == 1);
 }
+
+bool test_dedup_results() {
+    // given a forest with lots of overlapping leaves:
+    rownum_type num_rows = 500;
+    colnum_type num_features = 9;
+    RbfConfig config = {40, 8, 10, num_rows, num_features, 3};
+    feature_type *feature_array;
+    RandomBinaryForest *forest = _test_train_forest(&config, -1, &feature_array, 0, NULL);
+    bool ok = true;
+    // when we run several queries one after another (releasing the thread buffers between some of them):
+    for (size_t q = 0; q < 20; q++) {
+        feature_type *point = &(feature_array[q * num_features]);
+        size_t count;
+        if (q % 7 == 6) {
+            rbf_release_thread_buffers();
+        }
+        rownum_type *deduped = query_forest_dedup_results(forest, point, num_features, &count);
+        // then each one gets every row found by any tree exactly once, in the order first found:
+        RbfResults *results = query_forest_all_results(forest, point, num_features);
+        size_t exp_count = 0;
+        for (size_t t = 0; t < config.num_trees; t++) {
+            for (size_t j = 0; j < results->tree_result_counts[t]; j++) {
+                rownum_type row = results->tree_results[t][j];
+                bool seen = false;
+                for (size_t k = 0; k < exp_count; k++) {
+                    seen = seen || (deduped[k] == row);
+                }
+                if (!seen) {
+                    ok = ok && (exp_count < count) && (deduped[exp_count] == row);
+                    exp_count += 1;
+                }
+            }
+        }
+        ok = ok && (exp_count == count);
+        free(deduped);
+        free_results(results);
+    }
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_find_leaves() {
+    // given a trained forest, and more query points than fit in a block, and not a whole number of SIMD lanes
+    // (with an odd number of features, so points aren't 4-byte aligned):
+    rownum_type num_rows = 2000;
+    colnum_type num_features = 13;
+    RbfConfig config = {3, 12, 4, num_rows, num_features, 3};
+    size_t num_points = 2 * QUERY_BLOCK_POINTS + 5;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, -1, &feature_array, num_points, &points);
+    // when we find the points' leaves in a batch:
+    nodenum_type *leaves = malloc(sizeof(nodenum_type) * num_points);
+    find_leaves(&(forest->trees[0]), points, num_features, num_points, leaves);
+    RbfBatchResults *batch_results = batch_query_forest_all_results(forest, points, num_features, num_points);
+    size_t *batch_counts;
+    rownum_type **batch_deduped = batch_query_forest_dedup_results(forest, points, num_features, num_points, &batch_counts);
+    // then we get the same leaves, and the same results, as querying one point at a time:
+    bool ok = true;
+    for (size_t i = 0; i < num_points; i++) {
+        feature_type *point = &(points[i * num_features]);
+        RbfResults *results = query_forest_all_results(forest, point, num_features);
+        size_t count;
+        rownum_type *deduped = query_forest_dedup_results(forest, point, num_features, &count);
+        size_t *offsets = &(batch_results->offsets[i * config.num_trees]);
+        ok = ok && (leaves[i] == find_leaf(&(forest->trees[0]), point))
+                && (offsets[config.num_trees] - offsets[0] == results->total_count)
+                && (batch_counts[i] == count)
+                && (memcmp(batch_deduped[i], deduped, sizeof(rownum_type) * count) == 0);
+        for (size_t t = 0; ok && (t < config.num_trees); t++) {
+            ok = (offsets[t + 1] - offsets[t] == results->tree_result_counts[t])
+                  && (memcmp(&(batch_results->ids[offsets[t]]), results->tree_results[t],
+                             sizeof(rownum_type) * results->tree_result_counts[t]) == 0);
+        }
+        free_results(results);
+        free(deduped);
+    }
+    free_batch_results(batch_results);
+    // and walking lots of trees at once (not a whole number of WALK_INTERLEAVEs) for a point gives
+    // each tree's own leaf:
+    RbfConfig many_config = {11, 12, 4, num_rows, num_features, 3};
+    RandomBinaryForest *many_trees = train_forest(feature_array, &many_config);
+    nodenum_type tree_leaves[11];
+    for (size_t i = 0; ok && (i < num_points); i++) {
+        feature_type *point = &(points[i * num_features]);
+        find_trees_leaves(many_trees, 0, many_config.num_trees, point, tree_leaves);
+        for (size_t t = 0; t < many_config.num_trees; t++) {
+            ok = ok && (tree_leaves[t] == find_leaf(&(many_trees->trees[t]), point));
+        }
+        find_trees_leaves(many_trees, 4, 3, point, tree_leaves);
+        for (size_t t = 0; t < 3; t++) {
+            ok = ok && (tree_leaves[t] == find_leaf(&(many_trees->trees[4 + t]), point));
+        }
+    }
+    free_forest(many_trees);
+    free_forest(forest);
+    free(leaves);
+    free(points);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_query_leaves() {
+    // given a trained forest, with one tree's row index packed:
+    rownum_type num_rows = 1000;
+    colnum_type num_features = 9;
+    RbfConfig config = {4, 10, 3, num_rows, num_features, 3};
+    size_t num_points = 100;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 1, &feature_array, num_points, &points);
+    // when we query into reused buffers:
+    RbfLeafView leaves[4];
+    RbfLeafView *batch_leaves = malloc(sizeof(RbfLeafView) * num_points * config.num_trees);
+    rownum_type rows[1000];
+    batch_query_forest_leaves(forest, points, num_features, num_points, batch_leaves);
+    bool ok = true;
+    for (size_t i = 0; i < num_points; i++) {
+        query_forest_leaves(forest, &(points[i * num_features]), num_features, leaves);
+        RbfResults *results = query_forest_all_results(forest, &(points[i * num_features]), num_features);
+        // then each tree's leaf has the same rows as the allocating query gives, and the batch gives the same leaves:
+        for (size_t t = 0; t < config.num_trees; t++) {
+            RbfLeafView *batch_leaf = &(batch_leaves[i * config.num_trees + t]);
+            leaf_view_rows(forest, leaves[t], rows);
+            ok = ok && (leaves[t].tree_num == t)
+                    && ((size_t) (leaves[t].end - leaves[t].start) == results->tree_result_counts[t])
+                    && (memcmp(rows, results->tree_results[t], sizeof(rownum_type) * results->tree_result_counts[t]) == 0)
+                    && (batch_leaf->tree_num == t) && (batch_leaf->start == leaves[t].start) && (batch_leaf->end == leaves[t].end);
+        }
+        free_results(results);
+    }
+    free(batch_leaves);
+    free(points);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_parallel_query() {
+    // given a forest with more trees than a walk group, and not a whole number of groups, and one tree packed:
+    rownum_type num_rows = 1500;
+    colnum_type num_features = 9;
+    RbfConfig config = {37, 8, 12, num_rows, num_features, 3};
+    size_t num_points = 30;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 20, &feature_array, num_points, &points);
+    RbfLeafView serial_leaves[37], parallel_leaves[37];
+    int max_threads = omp_get_max_threads();
+    omp_set_num_threads(4);
+    bool ok = true;
+    for (size_t i = 0; i < num_points; i++) {
+        feature_type *point = &(points[i * num_features]);
+        // when we query one point at a time below the tree threshold, and then at or above it:
+        config.parallel_query_min_trees = 38;
+        query_forest_leaves(forest, point, num_features, serial_leaves);
+        RbfResults *serial_results = query_forest_all_results(forest, point, num_features);
+        size_t serial_count;
+        rownum_type *serial_deduped = query_forest_dedup_results(forest, point, num_features, &serial_count);
+        config.parallel_query_min_trees = 37;
+        query_forest_leaves(forest, point, num_features, parallel_leaves);
+        RbfResults *parallel_results = query_forest_all_results(forest, point, num_features);
+        size_t parallel_count;
+        rownum_type *parallel_deduped = query_forest_dedup_results(forest, point, num_features, &parallel_count);
+        // then the results are the same, in the same order:
+        ok = ok && (memcmp(serial_leaves, parallel_leaves, sizeof(serial_leaves)) == 0)
+                && (serial_results->total_count == parallel_results->total_count)
+                && (serial_count == parallel_count)
+                && (memcmp(serial_deduped, parallel_deduped, sizeof(rownum_type) * serial_count) == 0);
+        for (size_t t = 0; t < config.num_trees; t++) {
+            ok = ok && (serial_results->tree_result_counts[t] == parallel_results->tree_result_counts[t])
+                    && (memcmp(serial_results->tree_results[t], parallel_results->tree_results[t],
+                               sizeof(rownum_type) * serial_results->tree_result_counts[t]) == 0);
+        }
+        free_results(serial_results);
+        free_results(parallel_results);
+        free(serial_deduped);
+        free(parallel_deduped);
+    }
+    omp_set_num_threads(max_threads);
+    free(points);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+// The distance rbf_distances should give, the straightforward way.
+static double _test_metric_dist(RbfMetric metric, const feature_type *v1, const feature_type *v2, size_t dim) {
+    long sum = 0, norm_1 = 0, norm_2 = 0;
+    for (size_t i = 0; i < dim; i++) {
+        int diff = (int) v1[i] - (int) v2[i];
+        sum += (metric == RBF_L2) ? diff * diff
+             : (metric == RBF_L1) ? abs(diff)
+             : (metric == RBF_HAMMING) ? __builtin_popcount(v1[i] ^ v2[i])
+             : (int) v1[i] * (int) v2[i];
+        norm_1 += (int) v1[i] * (int) v1[i];
+        norm_2 += (int) v2[i] * (int) v2[i];
+    }
+    if (metric == RBF_DOT) {
+        return -(double) sum;
+    }
+    if (metric == RBF_COSINE) {
+        double norms = sqrt((double) norm_1) * sqrt((double) norm_2);
+        return (norms > 0) ? 1 - sum / norms : 1;
+    }
+    return sum;
+}
+
+bool test_store_ordered_points() {
+    // given a trained forest with its first tree's row index packed, and its kNN results:
+    rownum_type num_rows = 700;
+    colnum_type num_features = 11;
+    RbfConfig config = {3, 10, 4, num_rows, num_features, 3};
+    size_t num_points = 40, k = 7, num_results = 3;   // per point
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 0, &feature_array, num_points, &points);
+    rownum_type *tree_0_order = malloc(sizeof(rownum_type) * num_rows);
+    unpack_row_index(forest->trees[0].packed_row_index, forest->trees[0].row_index_bits, 0, num_rows, tree_0_order);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    rownum_type *ids[2];
+    double *dists[2];
+    size_t *counts[2];
+    for (int ordered = 0; ordered < 2; ordered++) {
+        ids[ordered] = malloc(sizeof(rownum_type) * num_points * k * num_results);
+        dists[ordered] = malloc(sizeof(double) * num_points * k * num_results);
+        counts[ordered] = malloc(sizeof(size_t) * num_points * num_results);
+        if (ordered) {
+            // when we store the ordered points and query without the reference points:
+            store_ordered_points(forest, ref_points);
+        }
+        const feature_type *refs = ordered ? NULL : ref_points;
+        for (size_t i = 0; i < num_points; i++) {
+            feature_type *point = &(points[i * num_features]);
+            size_t r = i * num_results;
+            counts[ordered][r] = query_forest_knn(forest, refs, point, num_features, RBF_L2, k, 0,
+                                                  &(ids[ordered][r * k]), &(dists[ordered][r * k]));
+            counts[ordered][r + 1] = query_forest_knn(forest, refs, point, num_features, RBF_COSINE, k, 50,
+                                                      &(ids[ordered][(r + 1) * k]), &(dists[ordered][(r + 1) * k]));
+            counts[ordered][r + 2] = query_forest_knn_probe(forest, refs, point, num_features, RBF_L1, k, 100,
+                                                            &(ids[ordered][(r + 2) * k]), &(dists[ordered][(r + 2) * k]));
+        }
+    }
+    // then the points are in the first tree's order, with positions the inverse of that:
+    bool ok = (forest->ordered_points != NULL) && (forest->ordered_positions != NULL);
+    for (rownum_type pos = 0; ok && (pos < num_rows); pos++) {
+        rownum_type row = tree_0_order[pos];
+        const feature_type *point = &(ref_points[(size_t) row * num_features]);
+        ok = (forest->ordered_positions[row] == pos)
+              && (forest->ordered_norms[pos] == sqrt((double) dot_u8(point, point, num_features)))
+              && (memcmp(&(forest->ordered_points[(size_t) pos * num_features]), &(ref_points[(size_t) row * num_features]),
+                         num_features) == 0);
+    }
+    // and kNN gives the same results:
+    for (size_t r = 0; ok && (r < num_points * num_results); r += num_results) {
+        for (size_t q = r; q < r + num_results; q++) {
+            ok = ok && (counts[0][q] == counts[1][q])
+                    && (memcmp(&(ids[0][q * k]), &(ids[1][q * k]), sizeof(rownum_type) * counts[0][q]) == 0)
+                    && (memcmp(&(dists[0][q * k]), &(dists[1][q * k]), sizeof(double) * counts[0][q]) == 0);
+        }
+    }
+    for (int ordered = 0; ordered < 2; ordered++) {
+        free(ids[ordered]);
+        free(dists[ordered]);
+        free(counts[ordered]);
+    }
+    free(points);
+    free(ref_points);
+    free(tree_0_order);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+// Is this file mapped into our address space?
+bool _test_file_mapped(const char *filename) {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    char line[4096];
+    bool mapped = false;
+    while (maps && fgets(line, sizeof(line), maps)) {
+        mapped = mapped || (strstr(line, filename) != NULL);
+    }
+    if (maps) {
+        fclose(maps);
+    }
+    return mapped;
+}
+
+bool test_free_forest() {
+    // given a trained forest with its ordered points stored, and the caller's config it was trained with:
+    rownum_type num_rows = 300;
+    colnum_type num_features = 7;
+    feature_type *feature_array = malloc((size_t) num_rows * num_features);
+    _test_fill_features(feature_array, num_rows, num_features);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    RbfConfig config = {4, 9, 4, num_rows, num_features, 3};
+    RbfConfig config_copy = config;
+    RbfConfig expected_config = config;
+    RandomBinaryForest *expected = train_forest(feature_array, &expected_config);
+    RandomBinaryForest *forest = train_forest(feature_array, &config);
+    store_ordered_points(forest, ref_points);
+    rownum_type ids[5];
+    double dists[5];
+    query_forest_knn(forest, NULL, ref_points, num_features, RBF_COSINE, 5, 5, ids, dists);
+
+    // when we free it:
+    free_forest(forest);
+
+    // then the config is left alone, and can train the same forest again:
+    bool ok = (memcmp(&config, &config_copy, sizeof(config)) == 0);
+    forest = train_forest(feature_array, &config);
+    store_ordered_points(forest, ref_points);
+    ok = ok && _test_same_forest(expected, forest)
+            && (query_forest_knn(forest, NULL, ref_points, num_features, RBF_COSINE, 5, 5, ids, dists) == 5);
+
+    // and a loaded forest's file is mapped until it's freed, and then it isn't:
+    char filename[] = "/tmp/rbf_test_XXXXXX";
+    close(mkstemp(filename));
+    save_forest(forest, filename);
+    RandomBinaryForest *loaded = load_forest(filename);
+    ok = ok && loaded && _test_file_mapped(filename);
+    if (loaded) {
+        store_ordered_points(loaded, ref_points);
+        free_forest(loaded);
+    }
+    ok = ok && !_test_file_mapped(filename);
+    unlink(filename);
+
+    free_forest(forest);
+    free_forest(expected);
+    free(ref_points);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_query_subtrees() {
+    // given a trained forest with small leaves, with one tree's row index packed:
+    rownum_type num_rows = 1000;
+    colnum_type num_features = 9;
+    RbfConfig config = {4, 12, 3, num_rows, num_features, 3};
+    size_t num_points = 100;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 1, &feature_array, num_points, &points);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    RbfLeafView leaves[4], views[4], smaller_views[4];
+    RbfLeafView *batch_views = malloc(sizeof(RbfLeafView) * num_points * config.num_trees);
+    rownum_type min_rows[] = {0, 1, 2, 10, 37, 500, 1000, 5000};
+    bool ok = true;
+    for (size_t m = 0; m < sizeof(min_rows) / sizeof(min_rows[0]); m++) {
+        // when we ask for subtrees with at least min_rows rows, one point at a time and in a batch:
+        batch_query_forest_subtrees(forest, points, num_features, num_points, min_rows[m], batch_views);
+        for (size_t i = 0; i < num_points; i++) {
+            feature_type *point = &(points[i * num_features]);
+            query_forest_leaves(forest, point, num_features, leaves);
+            query_forest_subtrees(forest, point, num_features, min_rows[m], views);
+            if (m > 0) {
+                query_forest_subtrees(forest, point, num_features, min_rows[m - 1], smaller_views);
+            }
+            for (size_t t = 0; t < config.num_trees; t++) {
+                RbfLeafView *batch_view = &(batch_views[i * config.num_trees + t]);
+                // then each view has enough rows (unless it's the whole tree), and contains the
+                // point's leaf and the view for fewer rows, and is its leaf if the leaf is big enough:
+                ok = ok && (views[t].tree_num == t)
+                        && ((views[t].end - views[t].start >= min_rows[m]) || ((views[t].start == 0) && (views[t].end == num_rows)))
+                        && (views[t].start <= leaves[t].start) && (leaves[t].end <= views[t].end)
+                        && ((leaves[t].end - leaves[t].start < min_rows[m])
+                            || ((views[t].start == leaves[t].start) && (views[t].end == leaves[t].end)))
+                        && ((m == 0) || ((views[t].start <= smaller_views[t].start) && (smaller_views[t].end <= views[t].end)))
+                        && (batch_view->tree_num == t) && (batch_view->start == views[t].start) && (batch_view->end == views[t].end);
+            }
+        }
+    }
+    // and kNN gets all k neighbors, even with k bigger than the leaves, when the trees give at least k rows:
+    size_t k = 20;
+    rownum_type ids[20], *batch_ids = malloc(sizeof(rownum_type) * num_points * k);
+    double dists[20], *batch_dists = malloc(sizeof(double) * num_points * k);
+    size_t *batch_counts = malloc(sizeof(size_t) * num_points);
+    batch_query_forest_knn(forest, ref_points, points, num_features, num_points, RBF_L2, k, (rownum_type) k,
+                           batch_ids, batch_dists, batch_counts);
+    for (size_t i = 0; i < num_points; i++) {
+        size_t count = query_forest_knn(forest, ref_points, &(points[i * num_features]), num_features, RBF_L2, k,
+                                        (rownum_type) k, ids, dists);
+        ok = ok && (count == k) && (batch_counts[i] == k)
+                && (memcmp(ids, &(batch_ids[i * k]), sizeof(rownum_type) * k) == 0);
+    }
+    free(batch_ids);
+    free(batch_dists);
+    free(batch_counts);
+    free(batch_views);
+    free(points);
+    free(ref_points);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_query_probe() {
+    // given a trained forest with small leaves, with one tree's row index packed:
+    rownum_type num_rows = 1000;
+    colnum_type num_features = 9;
+    RbfConfig config = {4, 12, 3, num_rows, num_features, 3};
+    size_t num_points = 50, k = 8, max_leaves = 4000;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 1, &feature_array, num_points, &points);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    size_t total_leaves = 0;
+    for (size_t t = 0; t < config.num_trees; t++) {
+        total_leaves += forest->trees[t].num_leaves;
+    }
+    RbfLeafView leaves[4], *probed = malloc(sizeof(RbfLeafView) * max_leaves);
+    rownum_type ids[8], probe_ids[8], *batch_ids = malloc(sizeof(rownum_type) * num_points * k);
+    double dists[8], probe_dists[8], *batch_dists = malloc(sizeof(double) * num_points * k);
+    size_t *batch_counts = malloc(sizeof(size_t) * num_points);
+    size_t budgets[] = {0, 1, 50, 200, 4000};
+    bool ok = true;
+    for (size_t b = 0; b < sizeof(budgets) / sizeof(budgets[0]); b++) {
+        batch_query_forest_knn_probe(forest, ref_points, points, num_features, num_points, RBF_L2, k, budgets[b],
+                                     batch_ids, batch_dists, batch_counts);
+        for (size_t i = 0; i < num_points; i++) {
+            feature_type *point = &(points[i * num_features]);
+            // when we probe the trees best-first until we've got the budget's worth of candidates:
+            query_forest_leaves(forest, point, num_features, leaves);
+            size_t num_probed = query_forest_probe_leaves(forest, point, num_features, budgets[b], max_leaves, probed);
+            // then we get each tree's own leaf first, then just enough other leaves (or all of them):
+            size_t num_candidates = 0;
+            for (size_t l = 0; l < num_probed; l++) {
+                ok = ok && ((l >= config.num_trees) || (memcmp(&(probed[l]), &(leaves[l]), sizeof(RbfLeafView)) == 0));
+                for (size_t l2 = 0; l2 < l; l2++) {
+                    ok = ok && ((probed[l].tree_num != probed[l2].tree_num) || (probed[l].start != probed[l2].start)
+                                || (probed[l].start == probed[l].end) || (probed[l2].start == probed[l2].end));
+                }
+                num_candidates += probed[l].end - probed[l].start;
+            }
+            size_t last_leaf_rows = probed[num_probed - 1].end - probed[num_probed - 1].start;
+            ok = ok && (num_probed >= config.num_trees)
+                    && ((num_probed == config.num_trees) || (num_candidates - last_leaf_rows < budgets[b]))
+                    && ((num_candidates >= budgets[b]) || (num_probed == total_leaves));
+            // and kNN over more candidates only gets nearer neighbors (and the same as plain kNN with none):
+            size_t count = query_forest_knn(forest, ref_points, point, num_features, RBF_L2, k, 0, ids, dists);
+            size_t probe_count = query_forest_knn_probe(forest, ref_points, point, num_features, RBF_L2, k, budgets[b],
+                                                        probe_ids, probe_dists);
+            ok = ok && (probe_count >= count) && (batch_counts[i] == probe_count)
+                    && (memcmp(&(batch_ids[i * k]), probe_ids, sizeof(rownum_type) * probe_count) == 0);
+            for (size_t j = 0; j < count; j++) {
+                ok = ok && (probe_dists[j] <= dists[j]) && ((budgets[b] > 0) || (probe_ids[j] == ids[j]));
+            }
+        }
+    }
+    // and with the biggest budget we've found every row in every tree:
+    size_t num_probed = query_forest_probe_leaves(forest, points, num_features, 4000, max_leaves, probed);
+    size_t num_candidates = 0;
+    for (size_t l = 0; l < num_probed; l++) {
+        num_candidates += probed[l].end - probed[l].start;
+    }
+    ok = ok && (num_probed == total_leaves) && (num_candidates == (size_t) num_rows * config.num_trees);
+    free(batch_ids);
+    free(batch_dists);
+    free(batch_counts);
+    free(probed);
+    free(points);
+    free(ref_points);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_query_knn() {
+    // given a trained forest, with one tree's row index packed, and the training data row-major:
+    rownum_type num_rows = 800;
+    colnum_type num_features = 10;
+    RbfConfig config = {8, 8, 5, num_rows, num_features, 3};
+    size_t num_points = 70, k = 6;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 2, &feature_array, num_points, &points);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    rownum_type ids[6], *batch_ids = malloc(sizeof(rownum_type) * num_points * k);
+    double dists[6], *batch_dists = malloc(sizeof(double) * num_points * k);
+    size_t *batch_counts = malloc(sizeof(size_t) * num_points);
+    bool ok = true;
+    RbfMetric metrics[] = {RBF_L2, RBF_L1, RBF_COSINE, RBF_DOT, RBF_HAMMING};
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        // when we get the k nearest neighbors by each metric, one at a time and in a batch:
+        RbfMetric metric = metrics[m];
+        batch_query_forest_knn(forest, ref_points, points, num_features, num_points, metric, k, 0,
+                               batch_ids, batch_dists, batch_counts);
+        for (size_t i = 0; i < num_points; i++) {
+            feature_type *point = &(points[i * num_features]);
+            size_t count = query_forest_knn(forest, ref_points, point, num_features, metric, k, 0, ids, dists);
+            // then we get the nearest (then lowest-numbered) k of all the deduped results, nearest first:
+            size_t num_deduped;
+            rownum_type *deduped = query_forest_dedup_results(forest, point, num_features, &num_deduped);
+            rownum_type prev_id = -1;
+            double prev_dist = -1e30;
+            for (size_t j = 0; j < ((k < num_deduped) ? k : num_deduped); j++) {
+                rownum_type best_id = -1;
+                double best_dist = 1e30;
+                for (size_t r = 0; r < num_deduped; r++) {
+                    double dist = _test_metric_dist(metric, point, &(ref_points[deduped[r] * num_features]), num_features);
+                    bool after_prev = (dist > prev_dist) || ((dist == prev_dist) && (deduped[r] > prev_id));
+                    if (after_prev && ((dist < best_dist) || ((dist == best_dist) && (deduped[r] < best_id)))) {
+                        best_id = deduped[r];
+                        best_dist = dist;
+                    }
+                }
+                ok = ok && (ids[j] == best_id) && (dists[j] == best_dist)
+                        && (batch_ids[i * k + j] == best_id) && (batch_dists[i * k + j] == best_dist);
+                prev_id = best_id;
+                prev_dist = best_dist;
+            }
+            ok = ok && (count == ((k < num_deduped) ? k : num_deduped)) && (batch_counts[i] == count);
+            free(deduped);
+        }
+    }
+    // and an all-0 point is as far as can be from everything by cosine:
+    feature_type zeros[10] = {0};
+    rownum_type some_rows[3] = {0, 5, 799};
+    rbf_distances(RBF_COSINE, zeros, ref_points, num_features, some_rows, 3, NULL, dists);
+    ok = ok && (dists[0] == 1) && (dists[1] == 1) && (dists[2] == 1);
+    free(batch_ids);
+    free(batch_dists);
+    free(batch_counts);
+    free(points);
+    free(ref_points);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_query_csr() {
+    // given a trained forest with small leaves (so kNN often finds fewer than k), one tree packed:
+    rownum_type num_rows = 900;
+    colnum_type num_features = 7;
+    RbfConfig config = {5, 10, 2, num_rows, num_features, 3};
+    size_t num_points = 2 * QUERY_BLOCK_POINTS + 9, k = 12;
+    feature_type *feature_array, *points;
+    RandomBinaryForest *forest = _test_train_forest(&config, 3, &feature_array, num_points, &points);
+    feature_type *ref_points = transpose(feature_array, num_features, num_rows);
+    // when we get the deduped results and the k nearest neighbors CSR-style, and the old way:
+    RbfCsrResults *dedup_csr = batch_query_forest_dedup_csr(forest, points, num_features, num_points);
+    RbfCsrResults *knn_csr = batch_query_forest_knn_csr(forest, ref_points, points, num_features, num_points,
+                                                        RBF_L1, k, 0);
+    size_t *dedup_counts;
+    rownum_type **deduped = batch_query_forest_dedup_results(forest, points, num_features, num_points, &dedup_counts);
+    rownum_type *ids = malloc(sizeof(rownum_type) * num_points * k);
+    double *dists = malloc(sizeof(double) * num_points * k);
+    size_t *knn_counts = malloc(sizeof(size_t) * num_points);
+    batch_query_forest_knn(forest, ref_points, points, num_features, num_points, RBF_L1, k, 0, ids, dists, knn_counts);
+
+    // then each point's results are the same, packed one point after another:
+    bool ok = (dedup_csr->num_points == num_points) && (dedup_csr->indptr[0] == 0) && (dedup_csr->distances == NULL)
+               && (knn_csr->num_points == num_points) && (knn_csr->indptr[0] == 0) && (knn_csr->distances != NULL);
+    bool some_short = false;
+    for (size_t i = 0; ok && (i < num_points); i++) {
+        size_t dedup_start = dedup_csr->indptr[i], knn_start = knn_csr->indptr[i];
+        ok = (dedup_csr->indptr[i + 1] - dedup_start == dedup_counts[i])
+              && (memcmp(&(dedup_csr->indices[dedup_start]), deduped[i], sizeof(rownum_type) * dedup_counts[i]) == 0)
+              && (knn_csr->indptr[i + 1] - knn_start == knn_counts[i])
+              && (memcmp(&(knn_csr->indices[knn_start]), &(ids[i * k]), sizeof(rownum_type) * knn_counts[i]) == 0)
+              && (memcmp(&(knn_csr->distances[knn_start]), &(dists[i * k]), sizeof(double) * knn_counts[i]) == 0);
+        some_short = some_short || (knn_counts[i] < k);
+        free(deduped[i]);
+    }
+    // and an empty batch gives empty results:
+    RbfCsrResults *empty = batch_query_forest_dedup_csr(forest, points, num_features, 0);
+    ok = ok && some_short && (empty->num_points == 0) && (empty->indptr[0] == 0);
+    free_csr_results(empty);
+    free_csr_results(dedup_csr);
+    free_csr_results(knn_csr);
+    free(deduped);
+    free(dedup_counts);
+    free(ids);
+    free(dists);
+    free(knn_counts);
+    free_forest(forest);
+    free(ref_points);
+    free(points);
+    free(feature_array);
+    return ok;
+}
+
+
+bool test_save_load_forest() {
+    // given a small trained forest:
+    rownum_type num_rows = 64;
+    colnum_type num_features = 4;
+    feature_type feature_array[64 * 4];
+    for (size_t i = 0; i < 64 * 4; i++) {
+        feature_array[i] = (feature_type) ((i * 37) % 251);
+    }
+    RbfConfig config = {3, 5, 2, num_rows, num_features, 1};
+    config.parallel_query_min_trees = 2;
+    RandomBinaryForest *forest = train_forest(feature_array, &config);
+    rownum_type *tree_0_row_index = malloc(sizeof(rownum_type) * num_rows);
+    memcpy(tree_0_row_index, forest->trees[0].row_index, sizeof(rownum_type) * num_rows);
+    pack_tree_row_index(&(forest->trees[0]));     // so we save both packed and unpacked row indices
+    char filename[] = "/tmp/rbf_test_XXXXXX";
+    close(mkstemp(filename));
+
+    // when we save it and load it back:
+    bool saved = save_forest(forest, filename);
+    RandomBinaryForest *loaded = load_forest(filename);
+    unlink(filename);   // the mapping stays valid after the file is removed
+
+    // then the loaded forest has the same config and trees:
+    if (!saved || !loaded || !loaded->mapping) {
+        return false;
+    }
+    bool same = (loaded->config->num_trees == config.num_trees)
+                 && (loaded->config->tree_depth == config.tree_depth)
+                 && (loaded->config->leaf_size == config.leaf_size)
+                 && (loaded->config->num_rows == config.num_rows)
+                 && (loaded->config->num_features == config.num_features)
+                 && (loaded->config->num_features_to_compare == config.num_features_to_compare)
+                 && (loaded->config->parallel_query_min_trees == config.parallel_query_min_trees);
+    for (size_t i = 0; same && (i < config.num_trees); i++) {
+        RandomBinaryTree *t1 = &(forest->trees[i]), *t2 = &(loaded->trees[i]);
+        rownum_type *row_index_1 = t1->row_index, *row_index_2 = t2->row_index;
+        if (i == 0) {
+            row_index_1 = tree_0_row_index;
+            row_index_2 = malloc(sizeof(rownum_type) * num_rows);
+            unpack_row_index(t2->packed_row_index, t2->row_index_bits, 0, num_rows, row_index_2);
+        }
+        same = (t1->tree_size == t2->tree_size)
+                && (t1->num_internal_nodes == t2->num_internal_nodes)
+                && (t1->num_leaves == t2->num_leaves)
+                && ((t1->row_index == NULL) == (t2->row_index == NULL))
+                && (memcmp(row_index_1, row_index_2, sizeof(rownum_type) * num_rows) == 0)
+                && (memcmp(t1->tree_first, t2->tree_first, sizeof(rownum_type) * t1->tree_size) == 0)
+                && (memcmp(t1->tree_second, t2->tree_second, sizeof(rownum_type) * t1->tree_size) == 0)
+                && (memcmp(t1->tree_child, t2->tree_child, sizeof(nodenum_type) * t1->tree_size) == 0)
+                && (memcmp(t1->tree_split, t2->tree_split, sizeof(rownum_type) * t1->tree_size) == 0);
+    }
+
+    // and loading something that isn't a forest file fails cleanly:
+    bool bad_file_rejected = (load_forest("rbf_test.c") == NULL) && (load_forest("/nonexistent/forest") == NULL);
+
+    // and both forests can be freed, whether their trees are their own or in a mapping:
+    store_ordered_points(loaded, feature_array);
+    free_forest(loaded);
+    free_forest(forest);
+    free(tree_0_row_index);
+    return same && bad_file_rejected;
+}
+
+
+
+bool test_load_corrupt_forest() {
+    // given a trained tree, which passes the checks load_forest makes:
+    rownum_type num_rows = 200;
+    colnum_type num_features = 5;
+    RbfConfig config = {2, 8, 4, num_rows, num_features, 2};
+    feature_type *feature_array;
+    RandomBinaryForest *forest = _test_train_forest(&config, -1, &feature_array, 0, NULL);
+    RandomBinaryTree *tree = &(forest->trees[0]);
+    bool ok = tree_nodes_valid(tree, num_features) && (tree->tree_first[0] >> HIGH_BIT == 0);
+    nodenum_type leaf = find_leaf(tree, feature_array);
+
+    // when we break it in each of the ways a corrupt file could, then it fails them:
+    treeindex_type tree_size = tree->tree_size;
+    tree->tree_size = 0;
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_size = tree_size;
+    nodenum_type child = tree->tree_child[0];
+    tree->tree_child[0] = (nodenum_type) tree_size - 1;    // right child past the end
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_child[0] = 0;                                // its own child
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_child[0] = child;
+    rownum_type split = tree->tree_split[0];
+    tree->tree_split[0] = num_rows + 1;
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_split[0] = split;
+    ok = ok && !tree_nodes_valid(tree, tree->tree_first[0]);    // a feature number >= num_features
+    rownum_type leaf_first = tree->tree_first[leaf], leaf_second = tree->tree_second[leaf];
+    tree->tree_first[leaf] = HIGH_BIT_1 ^ (num_rows + 1);
+    tree->tree_second[leaf] = HIGH_BIT_1 ^ (num_rows + 2);
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_first[leaf] = leaf_second;                   // start > end
+    tree->tree_second[leaf] = leaf_first;
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->tree_first[leaf] = leaf_first;
+    tree->tree_second[leaf] = leaf_second;
+    rownum_type row = tree->row_index[7];
+    tree->row_index[7] = num_rows;
+    ok = ok && !tree_nodes_valid(tree, num_features);
+    tree->row_index[7] = row;
+    ok = ok && tree_nodes_valid(tree, num_features);
+
+    // and a saved file with a corrupt node doesn't load:
+    char filename[] = "/tmp/rbf_test_XXXXXX";
+    close(mkstemp(filename));
+    save_forest(forest, filename);
+    RandomBinaryForest *loaded = load_forest(filename);
+    ok = ok && loaded;
+    if (loaded) {
+        off_t child_offset = (char *) loaded->trees[1].tree_child - (char *) loaded->mapping;
+        free_forest(loaded);
+        int fd = open(filename, O_WRONLY);
+        nodenum_type bad_child = UINT32_MAX - 1;
+        ok = ok && (pwrite(fd, &bad_child, sizeof(bad_child), child_offset) == sizeof(bad_child));
+        close(fd);
+        ok = ok && (load_forest(filename) == NULL);
+    }
+    unlink(filename);
+    free_forest(forest);
+    free(feature_array);
+    return ok;
+}
+
+bool test_train_forest_rows() {
+    // given row-major points in a feature file:
+    rownum_type num_rows = 500;
+    colnum_type num_features = 12;
+    feature_type *rows = malloc(num_rows * num_features);
+    for (size_t i = 0; i < (size_t) num_rows * num_features; i++) {
+        rows[i] = (feature_type) ((i * 2654435761u) >> 13);
+    }
+    char filename[] = "/tmp/rbf_test_XXXXXX", scratch_filename[] = "/tmp/rbf_test_scratch_XXXXXX";
+    int fd = mkstemp(filename);
+    bool written = (write(fd, rows, num_rows * num_features) == num_rows * num_features);
+    close(fd);
+    close(mkstemp(scratch_filename));
+
+    // when we train on it from the file (with a scratch file or without), or from the rows in memory:
+    RbfConfig config = {4, 8, 4, num_rows, num_features, 3};
+    feature_type *columns = transpose(rows, num_rows, num_features);
+    RandomBinaryForest *expected = train_forest(columns, &config);
+    RandomBinaryForest *from_file = train_forest_from_file(filename, &config, NULL);
+    RandomBinaryForest *from_file_scratch = train_forest_from_file(filename, &config, scratch_filename);
+    RandomBinaryForest *from_rows = train_forest_rows(rows, &config, NULL);
+
+    // then we get the same trees as training on the transposed points, and the scratch file is gone:
+    bool ok = written && from_file && from_file_scratch && from_rows
+              && _test_same_forest(expected, from_file) && _test_same_forest(expected, from_file_scratch)
+              && _test_same_forest(expected, from_rows) && (access(scratch_filename, F_OK) != 0);
+
+    // and a file of the wrong size is rejected:
+    RbfConfig wrong_config = config;
+    wrong_config.num_rows = num_rows + 1;
+    ok = ok && (train_forest_from_file(filename, &wrong_config, NULL) == NULL)
+            && (train_forest_from_file("/nonexistent/features", &config, NULL) == NULL);
+
+    unlink(filename);
+    free_forest(expected);
+    free_forest(from_file);
+    free_forest(from_file_scratch);
+    free_forest(from_rows);
+    free(columns);
+    free(rows);
+    return ok;
+}
+
+
+bool test_distance_kernels() {
+    // given vectors with lengths around the SIMD widths, with the biggest possible differences too:
+    size_t dims[] = {0, 1, 7, 31, 32, 33, 63, 64, 65, 100, 784};
+    rownum_type num_rows = 9;
+    feature_type *ref_points = malloc(num_rows * 784);
+    for (size_t i = 0; i < num_rows * 784; i++) {
+        ref_points[i] = (i % 5 == 0) ? 255 : (feature_type) ((i * 2654435761u) >> 7);
+    }
+    feature_type query[784];
+    for (size_t i = 0; i < 784; i++) {
+        query[i] = (i % 5 == 0) ? 0 : (feature_type) ((i * 40503u) >> 3);
+    }
+    rownum_type rows[5] = {8, 0, 3, 3, 6};
+    int dists[5];
+    bool ok = true;
+    // when we use each set of kernels this CPU supports:
+    for (size_t k = 0; k < num_distance_kernel_sets; k++) {
+        const distance_kernels *kernels = &(distance_kernel_sets[k]);
+        if (!kernels->cpu_supports()) {
+            continue;
+        }
+        for (size_t d = 0; d < sizeof(dims) / sizeof(dims[0]); d++) {
+            size_t dim = dims[d];
+            // then we get the same as the straightforward loops, one vector at a time or many:
+            u8_dists_fn many[4] = {kernels->l2_square_many, kernels->l1_many, kernels->dot_many, kernels->hamming_many};
+            u8_dist_fn one[4] = {kernels->l2_square, kernels->l1, kernels->dot, kernels->hamming};
+            for (int metric = 0; metric < 4; metric++) {
+                many[metric](query, ref_points, dim, rows, 5, dists);
+                for (size_t r = 0; r < 5; r++) {
+                    feature_type *ref_point = &(ref_points[rows[r] * dim]);
+                    int exp_dist = 0;
+                    for (size_t i = 0; i < dim; i++) {
+                        int diff = (int) query[i] - (int) ref_point[i];
+                        exp_dist += (metric == 0) ? diff * diff
+                                  : (metric == 1) ? abs(diff)
+                                  : (metric == 2) ? (int) query[i] * (int) ref_point[i]
+                                  : __builtin_popcount(query[i] ^ ref_point[i]);
+                    }
+                    ok = ok && (one[metric](query, ref_point, dim) == exp_dist) && (dists[r] == exp_dist);
+                }
+            }
+        }
+    }
+    return ok && best_distance_kernels()->cpu_supports();
+}
+
@@ -22,12 +22,17 @@
  */
 
 
+#include <math.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "rbf.h"
 #include "_rbf_train.h"
 #include "_rbf_utils.h"
+#include "_rbf_distance.h"
 
 
 /*
@@ -65,30 +70,186 @@ void feature_column_to_bins(rownum_type *row_index, feature_type feat_array[],
 }
 
 
-colnum_type get_random_feature(colnum_type num_features) {
-    return (colnum_type) (rand() % num_features);
+/*
+ * Random numbers.
+ * We don't use rand(): it's one shared, locked generator, so trees trained in parallel contend for
+ * it and the forest we get depends on how the threads happen to interleave. Instead each node gets
+ * its own splitmix64 generator, split off from its parent's (and the root's is derived from
+ * config->seed and the tree number). So a forest depends only on the seed and not on the number of
+ * threads or the order in which nodes get built.
+ */
+static uint64_t splitmix64_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+rbf_rng rng_init(uint64_t seed, uint64_t stream) {
+    rbf_rng rng = {splitmix64_mix(seed + splitmix64_mix(stream + 0x9e3779b97f4a7c15ULL))};
+    return rng;
+}
+
+uint64_t rng_next(rbf_rng *rng) {
+    rng->state += 0x9e3779b97f4a7c15ULL;
+    return splitmix64_mix(rng->state);
+}
+
+// A new generator whose sequence is independent of the rest of this one's.
+rbf_rng rng_split(rbf_rng *rng) {
+    rbf_rng child = {splitmix64_mix(rng_next(rng))};
+    return child;
+}
+
+
+/*
+ * Same as calling feature_column_to_bins for each of the `num_feats` features in `feat_nums`, but
+ * faster: we make one pass over the view of row_index, a tile of rows at a time, and for each
+ * feature we first gather that tile's values (independent loads, so the CPU can have lots of them
+ * in flight) and then count them.
+ * For big views we count into HIST_COPIES sub-histograms per feature, round-robin, so that runs of
+ * repeated values (common in our data, e.g. lots of 0s) don't make each increment wait on the
+ * store from the previous one; the sub-histograms get summed at the end, and we get the weighted
+ * totals from the summed counts. For small views zeroing and summing the sub-histograms would cost
+ * more than it saves, so we count straight into ret_counts.
+ * sub_hists is scratch space for num_feats * HIST_COPIES * NUM_CHARS counts.
+ * Returns: ret_counts and ret_weighted_totals as for feature_column_to_bins, one after the other
+ *          for each feature (and added to, so they must start out zeroed).
+ */
+void features_to_bins(rownum_type *row_index, feature_type *feat_array, rownum_type num_rows,
+        const colnum_type *feat_nums, colnum_type num_feats, rownum_type index_start, rownum_type index_end,
+        stats_type *sub_hists,
+        // returns:
+        stats_type *ret_counts, stats_type *ret_weighted_totals) {
+    bool use_sub_hists = (index_end - index_start >= SUB_HIST_MIN_ROWS);
+    if (use_sub_hists) {
+        memset(sub_hists, 0, sizeof(stats_type) * num_feats * HIST_COPIES * NUM_CHARS);
+    }
+    feature_type tile[HIST_TILE_ROWS];
+    for (rownum_type tile_start = index_start; tile_start < index_end; tile_start += HIST_TILE_ROWS) {
+        rownum_type tile_rows = (index_end - tile_start < HIST_TILE_ROWS) ? index_end - tile_start : HIST_TILE_ROWS;
+        rownum_type *tile_row_index = &(row_index[tile_start]);
+        for (colnum_type f = 0; f < num_feats; f++) {
+            feature_type *column = &(feat_array[(size_t) num_rows * feat_nums[f]]);
+            for (rownum_type i = 0; i < tile_rows; i++) {
+                tile[i] = column[tile_row_index[i]];
+            }
+            if (use_sub_hists) {
+                stats_type *hists = &(sub_hists[f * HIST_COPIES * NUM_CHARS]);
+                rownum_type i = 0;
+                for (; i + HIST_COPIES <= tile_rows; i += HIST_COPIES) {
+                    for (int copy = 0; copy < HIST_COPIES; copy++) {
+                        hists[copy * NUM_CHARS + tile[i + copy]] += 1;
+                    }
+                }
+                for (; i < tile_rows; i++) {
+                    hists[tile[i]] += 1;
+                }
+            } else {
+                stats_type *counts = &(ret_counts[f * NUM_CHARS]);
+                stats_type weighted_total = 0;
+                for (rownum_type i = 0; i < tile_rows; i++) {
+                    counts[tile[i]] += 1;
+                    weighted_total += (stats_type) tile[i];
+                }
+                ret_weighted_totals[f] += weighted_total;
+            }
+        }
+    }
+    if (use_sub_hists) {
+        for (colnum_type f = 0; f < num_feats; f++) {
+            stats_type *hists = &(sub_hists[f * HIST_COPIES * NUM_CHARS]);
+            stats_type *counts = &(ret_counts[f * NUM_CHARS]);
+            stats_type weighted_total = 0;
+            for (size_t val = 0; val < NUM_CHARS; val++) {
+                stats_type count = 0;
+                for (int copy = 0; copy < HIST_COPIES; copy++) {
+                    count += hists[copy * NUM_CHARS + val];
+                }
+                counts[val] += count;
+                weighted_total += count * (stats_type) val;
+            }
+            ret_weighted_totals[f] += weighted_total;
+        }
+    }
+}
+
+
+void alloc_node_hists(node_hists *hists, colnum_type num_feats) {
+    hists->feat_subset = (colnum_type *) malloc(sizeof(colnum_type) * num_feats);
+    hists->feat_freqs = (stats_type *) malloc(sizeof(stats_type) * num_feats * NUM_CHARS);
+    hists->weighted_totals = (stats_type *) malloc(sizeof(stats_type) * num_feats);
+    if (!hists->feat_subset || !hists->feat_freqs || !hists->weighted_totals) {
+        die_alloc_err("alloc_node_hists", "feat_subset || feat_freqs || weighted_totals");
+    }
+}
+
+
+void free_node_hists(node_hists *hists) {
+    free(hists->feat_subset);
+    free(hists->feat_freqs);
+    free(hists->weighted_totals);
+}
+
+
+/*
+ * Histogram subtraction.
+ * A node's view is split into its children's views, so for any feature the node's histogram is the
+ * sum of its children's. So given the node's histograms for some features, we can get both
+ * children's histograms for those features by binning just the smaller child and subtracting its
+ * histograms from the node's for the bigger child, which is roughly half the work of binning both.
+ * (This is only useful if the children use the same features as their parent: see
+ * RbfConfig.share_features_levels.)
+ */
+void sibling_hists(rownum_type *row_index, feature_type *feat_array, rownum_type num_rows,
+        const node_hists *parent_hists, colnum_type num_feats,
+        rownum_type index_start, rownum_type index_split, rownum_type index_end, stats_type *sub_hists,
+        // returns:
+        node_hists *ret_left_hists, node_hists *ret_right_hists) {
+    bool left_is_smaller = (index_split - index_start <= index_end - index_split);
+    node_hists *smaller = left_is_smaller ? ret_left_hists : ret_right_hists;
+    node_hists *bigger = left_is_smaller ? ret_right_hists : ret_left_hists;
+    memcpy(ret_left_hists->feat_subset, parent_hists->feat_subset, sizeof(colnum_type) * num_feats);
+    memcpy(ret_right_hists->feat_subset, parent_hists->feat_subset, sizeof(colnum_type) * num_feats);
+
+    memset(smaller->feat_freqs, 0, sizeof(stats_type) * num_feats * NUM_CHARS);
+    memset(smaller->weighted_totals, 0, sizeof(stats_type) * num_feats);
+    features_to_bins(row_index, feat_array, num_rows, parent_hists->feat_subset, num_feats,
+                     left_is_smaller ? index_start : index_split, left_is_smaller ? index_split : index_end,
+                     sub_hists, smaller->feat_freqs, smaller->weighted_totals);
+    for (size_t i = 0; i < (size_t) num_feats * NUM_CHARS; i++) {
+        bigger->feat_freqs[i] = parent_hists->feat_freqs[i] - smaller->feat_freqs[i];
+    }
+    for (colnum_type i = 0; i < num_feats; i++) {
+        bigger->weighted_totals[i] = parent_hists->weighted_totals[i] - smaller->weighted_totals[i];
+    }
+}
+
+
+colnum_type get_random_feature(rbf_rng *rng, colnum_type num_features) {
+    return (colnum_type) (((rng_next(rng) >> 32) * (uint64_t) num_features) >> 32);
 }
 
 // Select a random subset of features and get the frequencies for those features.
 // Ugly to do two things here but ends up cleaner from a memory-management perspective.
+// sub_hists is scratch space for features_to_bins.
 void select_random_features_and_get_frequencies(rownum_type *row_index, feature_type *feat_array, bool *feats_already_selected,
-        RbfConfig *cfg, rownum_type index_start, rownum_type index_end,
+        RbfConfig *cfg, rbf_rng *rng, rownum_type index_start, rownum_type index_end, stats_type *sub_hists,
         // returns:
         colnum_type *ret_feat_subset, stats_type *ret_feat_freqs, stats_type *ret_feat_weighted_totals) {
     if (!feats_already_selected) {
         die_alloc_err("select_random_features_and_get_frequencies", "feats_already_selected");
     }
     for (colnum_type i = 0; i < cfg->num_features_to_compare; i++) {
-        colnum_type feat_num = (colnum_type) (get_random_feature(cfg->num_features));
+        colnum_type feat_num = (colnum_type) (get_random_feature(rng, cfg->num_features));
         while (feats_already_selected[(size_t) feat_num]) {
-            feat_num = get_random_feature(cfg->num_features);
+            feat_num = get_random_feature(rng, cfg->num_features);
         }
         feats_already_selected[feat_num] = true;
         ret_feat_subset[i] = feat_num;
-        feature_column_to_bins(row_index, feat_array,
-                               feat_num, cfg->num_rows, index_start, index_end,
-                               &(ret_feat_freqs[i * NUM_CHARS]), &(ret_feat_weighted_totals[i]));
     }
+    features_to_bins(row_index, feat_array, cfg->num_rows, ret_feat_subset, cfg->num_features_to_compare,
+                     index_start, index_end, sub_hists,
+                     ret_feat_freqs, ret_feat_weighted_totals);
 }
 
 
@@ -197,40 +358,276 @@ rownum_type quick_partition(rownum_type *row_index, feature_type *feat_array,
 }
 
 
-// Get a random subset of features, find the best one of those features,
-// and split this set of nodes on that feature.
-static void _split_node(rownum_type *row_index, feature_type *feat_array, RbfConfig *cfg,
-        rownum_type index_start, rownum_type index_end,
+/*
+ * Gives exactly the same split position and row order as quick_partition, so trees don't change,
+ * but without its data-dependent branches, which mispredict about half the time at the top of the
+ * tree. quick_partition swaps the first row left of the split position that belongs on the right
+ * with the last row right of it that belongs on the left, then the second with the second last,
+ * and so on. So:
+ * - gather the view's rows' values once, noting which rows go right, and count the ones going left
+ *   (that count is the split position),
+ * - list the misplaced rows on each side with predicated (unconditional) writes into scratch,
+ * - and swap them in pairs.
+ * goes_right and misplaced are scratch space for index_end - index_start values each.
+ */
+rownum_type branchless_partition(rownum_type *row_index, feature_type *feat_array,
+        rownum_type num_rows, rownum_type index_start, rownum_type index_end, colnum_type feat_num, feature_type split_val,
+        uint8_t *goes_right, rownum_type *misplaced) {
+    rownum_type *view = &(row_index[index_start]);
+    rownum_type view_rows = index_end - index_start;
+    feature_type *feat_column = &(feat_array[(size_t) num_rows * feat_num]);
+    rownum_type num_left = 0;
+    for (rownum_type i = 0; i < view_rows; i++) {
+        goes_right[i] = (feat_column[view[i]] > split_val);
+        num_left += 1 - goes_right[i];
+    }
+
+    // the left side's misplaced rows go at the start of `misplaced`, in order, and the right side's
+    // after them, from the end backwards, so the k-th of each pair up:
+    rownum_type num_misplaced = 0;
+    for (rownum_type i = 0; i < num_left; i++) {
+        misplaced[num_misplaced] = i;
+        num_misplaced += goes_right[i];
+    }
+    rownum_type num_misplaced_right = 0;
+    for (rownum_type i = view_rows - 1; i >= num_left; i--) {
+        misplaced[num_left + num_misplaced_right] = i;
+        num_misplaced_right += 1 - goes_right[i];
+    }
+    for (rownum_type k = 0; k < num_misplaced; k++) {
+        rownum_type left_pos = misplaced[k], right_pos = misplaced[num_left + k];
+        rownum_type tmp = view[left_pos];
+        view[left_pos] = view[right_pos];
+        view[right_pos] = tmp;
+    }
+    return index_start + num_left;
+}
+
+
+/*
+ * Scratch memory for _split_node.
+ * Each thread gets its own, allocated once per call to train_forest, so that splitting a node
+ * doesn't have to go to the (shared, locked) heap allocator. _split_node has no OpenMP task
+ * scheduling points, so a thread's scratch can't be in use by two nodes at once.
+ * The partition buffers are per row, so they're only grown to the biggest view the thread actually
+ * splits (see partition_scratch): a thread that only builds small subtree tasks stays small.
+ */
+split_scratch *alloc_split_scratch(RbfConfig *cfg, int num_threads) {
+    split_scratch *scratch = (split_scratch *) malloc(sizeof(split_scratch) * num_threads);
+    if (!scratch) {
+        die_alloc_err("alloc_split_scratch", "scratch");
+    }
+    for (int i = 0; i < num_threads; i++) {
+        scratch[i].feats_already_selected = (bool *) calloc(sizeof(bool), cfg->num_features);
+        scratch[i].feat_subset = (colnum_type *) malloc(sizeof(colnum_type) * cfg->num_features_to_compare);
+        scratch[i].feat_freqs = (stats_type *) malloc(sizeof(stats_type) * cfg->num_features_to_compare * NUM_CHARS);
+        scratch[i].weighted_totals = (stats_type *) malloc(sizeof(stats_type) * cfg->num_features_to_compare);
+        scratch[i].sub_hists = (stats_type *) malloc(sizeof(stats_type) * cfg->num_features_to_compare * HIST_COPIES * NUM_CHARS);
+        if (!scratch[i].feats_already_selected || !scratch[i].feat_subset || !scratch[i].feat_freqs
+                || !scratch[i].weighted_totals || !scratch[i].sub_hists) {
+            die_alloc_err("alloc_split_scratch", "feats_already_selected || feat_subset || feat_freqs || weighted_totals || sub_hists");
+        }
+        scratch[i].goes_right = NULL;   // see partition_scratch
+        scratch[i].misplaced = NULL;
+        scratch[i].partition_capacity = 0;
+        scratch[i].child_hists = NULL;
+        if (cfg->share_features_levels > 1) {
+            scratch[i].child_hists = (node_hists *) malloc(sizeof(node_hists) * 2 * cfg->tree_depth);
+            if (!scratch[i].child_hists) {
+                die_alloc_err("alloc_split_scratch", "child_hists");
+            }
+            for (size_t j = 0; j < 2 * cfg->tree_depth; j++) {
+                alloc_node_hists(&(scratch[i].child_hists[j]), cfg->num_features_to_compare);
+            }
+        }
+    }
+    scratch->num_threads = num_threads;
+    scratch->tree_depth = cfg->tree_depth;
+    return scratch;
+}
+
+
+void free_split_scratch(split_scratch *scratch) {
+    for (int i = 0; i < scratch->num_threads; i++) {
+        free(scratch[i].feats_already_selected);
+        free(scratch[i].feat_subset);
+        free(scratch[i].feat_freqs);
+        free(scratch[i].weighted_totals);
+        free(scratch[i].sub_hists);
+        free(scratch[i].goes_right);
+        free(scratch[i].misplaced);
+        if (scratch[i].child_hists) {
+            for (size_t j = 0; j < 2 * scratch->tree_depth; j++) {
+                free_node_hists(&(scratch[i].child_hists[j]));
+            }
+            free(scratch[i].child_hists);
+        }
+    }
+    free(scratch);
+}
+
+
+// Make sure a thread's partition buffers have room for a view of view_rows rows (5 bytes per row).
+static void partition_scratch(split_scratch *my_scratch, rownum_type view_rows) {
+    if (view_rows > my_scratch->partition_capacity) {
+        free(my_scratch->goes_right);
+        free(my_scratch->misplaced);
+        my_scratch->goes_right = (uint8_t *) malloc(sizeof(uint8_t) * view_rows);
+        my_scratch->misplaced = (rownum_type *) malloc(sizeof(rownum_type) * view_rows);
+        if (!my_scratch->goes_right || !my_scratch->misplaced) {
+            die_alloc_err("partition_scratch", "goes_right || misplaced");
+        }
+        my_scratch->partition_capacity = view_rows;
+    }
+}
+
+
+// Get a random subset of features (or use the ones in inherited_hists, if not NULL), find the best
+// one of those features, and split this set of nodes on that feature.
+// Also returns (in ret_hists) the features and histograms that the split was chosen from.
+static void _split_node(rownum_type *row_index, feature_type *feat_array, RbfConfig *cfg, rbf_rng *rng,
+        split_scratch *scratch, const node_hists *inherited_hists, rownum_type index_start, rownum_type index_end,
         // returns:
-        colnum_type *best_feat_num, feature_type *best_feat_split_val, rownum_type *split_pos) {
-    bool *feats_already_selected = (bool *) calloc(sizeof(bool), cfg->num_features);
-    *split_pos = index_start;
-    for (int attempt_num = 0; (attempt_num < 3) && ((*split_pos == index_start) || (*split_pos == index_end)); attempt_num++) {
-        colnum_type *feat_subset = (colnum_type *) calloc(sizeof(colnum_type), cfg->num_features_to_compare);
-        stats_type *feat_freqs = (stats_type *) calloc(sizeof(stats_type), cfg->num_features_to_compare * NUM_CHARS);
-        stats_type *weighted_totals = (stats_type *) calloc(sizeof(stats_type), cfg->num_features_to_compare);
-        if (!feat_subset || !feat_freqs || !weighted_totals) {
-            die_alloc_err("_split_node", "feat_subset || feat_freqs || weighted_totals");
+        colnum_type *best_feat_num, feature_type *best_feat_split_val, rownum_type *split_pos, node_hists *ret_hists) {
+    split_scratch *my_scratch = &(scratch[omp_get_thread_num()]);
+    bool *feats_already_selected = my_scratch->feats_already_selected;     // all false between calls
+    node_hists sampled_hists = {my_scratch->feat_subset, my_scratch->feat_freqs, my_scratch->weighted_totals};
+    partition_scratch(my_scratch, index_end - index_start);
+    int attempt_num = 0;
+    do {
+        if ((attempt_num == 0) && inherited_hists) {
+            *ret_hists = *inherited_hists;
+            for (colnum_type i = 0; i < cfg->num_features_to_compare; i++) {
+                feats_already_selected[inherited_hists->feat_subset[i]] = true;
+            }
+        } else {
+            memset(sampled_hists.feat_freqs, 0, sizeof(stats_type) * cfg->num_features_to_compare * NUM_CHARS);
+            memset(sampled_hists.weighted_totals, 0, sizeof(stats_type) * cfg->num_features_to_compare);
+            select_random_features_and_get_frequencies(row_index, feat_array, feats_already_selected,
+                    cfg, rng, index_start, index_end, my_scratch->sub_hists,
+                    sampled_hists.feat_subset, sampled_hists.feat_freqs, sampled_hists.weighted_totals);
+            *ret_hists = sampled_hists;
         }
         colnum_type _best_feat_index;
-
-        select_random_features_and_get_frequencies(row_index, feat_array, feats_already_selected,
-                cfg, index_start, index_end,
-                feat_subset, feat_freqs, weighted_totals);
-        get_simple_best_feature(feat_freqs, cfg->num_features_to_compare, weighted_totals, index_end - index_start,
-                &_best_feat_index, best_feat_split_val);
-        *best_feat_num = feat_subset[_best_feat_index];
+        get_simple_best_feature(ret_hists->feat_freqs, cfg->num_features_to_compare, ret_hists->weighted_totals,
+                index_end - index_start, &_best_feat_index, best_feat_split_val);
+        *best_feat_num = ret_hists->feat_subset[_best_feat_index];
         // return values:
-        *split_pos = quick_partition(row_index, feat_array, cfg->num_rows, index_start, index_end, *best_feat_num, *best_feat_split_val);
-        free(feat_subset);
-        free(feat_freqs);
-        free(weighted_totals);
-    }
-    free(feats_already_selected);
+        *split_pos = branchless_partition(row_index, feat_array, cfg->num_rows, index_start, index_end,
+                                          *best_feat_num, *best_feat_split_val, my_scratch->goes_right, my_scratch->misplaced);
+        attempt_num++;
+    // Retry if the split is at an edge. Retries select features not selected by earlier attempts,
+    // so stop before we'd run out.
+    } while ((attempt_num < 3) && ((attempt_num + 1) * cfg->num_features_to_compare <= cfg->num_features)
+             && ((*split_pos == index_start) || (*split_pos == index_end)));
+    memset(feats_already_selected, 0, sizeof(bool) * cfg->num_features);
     return;
 }
 
 
+// Make room in the tree arrays for `count` more nodes, growing them if needed.
+// Returns the node number of the first of the new nodes.
+static nodenum_type add_nodes(RandomBinaryTree *tree, treeindex_type count) {
+    if (tree->tree_size + count > tree->tree_capacity) {
+        treeindex_type new_capacity = 2 * tree->tree_capacity + count;
+        tree->tree_first = (rownum_type *) realloc(tree->tree_first, sizeof(rownum_type) * new_capacity);
+        tree->tree_second = (rownum_type *) realloc(tree->tree_second, sizeof(rownum_type) * new_capacity);
+        tree->tree_child = (nodenum_type *) realloc(tree->tree_child, sizeof(nodenum_type) * new_capacity);
+        tree->tree_split = (rownum_type *) realloc(tree->tree_split, sizeof(rownum_type) * new_capacity);
+        if (!(tree->tree_first) || !(tree->tree_second) || !(tree->tree_child) || !(tree->tree_split)) {
+            die_alloc_err("add_nodes", "tree arrays");
+        }
+        tree->tree_capacity = new_capacity;
+    }
+    nodenum_type first_new_node = (nodenum_type) tree->tree_size;
+    tree->tree_size += count;
+    return first_new_node;
+}
+
+
+// Release the unused tail of the tree arrays once the tree is built.
+static void shrink_to_fit(RandomBinaryTree *tree) {
+    tree->tree_first = (rownum_type *) realloc(tree->tree_first, sizeof(rownum_type) * tree->tree_size);
+    tree->tree_second = (rownum_type *) realloc(tree->tree_second, sizeof(rownum_type) * tree->tree_size);
+    tree->tree_child = (nodenum_type *) realloc(tree->tree_child, sizeof(nodenum_type) * tree->tree_size);
+    tree->tree_split = (rownum_type *) realloc(tree->tree_split, sizeof(rownum_type) * tree->tree_size);
+    if (!(tree->tree_first) || !(tree->tree_second) || !(tree->tree_child) || !(tree->tree_split)) {
+        die_alloc_err("shrink_to_fit", "tree arrays");
+    }
+    tree->tree_capacity = tree->tree_size;
+}
+
+
+static void make_leaf(RandomBinaryTree *tree, rownum_type index_start, rownum_type index_end, nodenum_type node) {
+    tree->tree_first[node] = (rownum_type) (HIGH_BIT_1 ^ index_start);
+    tree->tree_second[node] = (rownum_type) (HIGH_BIT_1 ^ index_end);
+    tree->tree_child[node] = 0;
+    tree->tree_split[node] = 0;
+    tree->num_leaves += 1;
+}
+
+
+static void calculate_one_node(RandomBinaryTree *tree, feature_type *feat_array, RbfConfig *config, split_scratch *scratch,
+        rownum_type index_start, rownum_type index_end, nodenum_type node, size_t depth, rbf_rng rng,
+        const node_hists *hists);
+
+static void alloc_node_arrays(RandomBinaryTree *tree, RbfConfig *config, rownum_type num_rows) {
+    // Initial guess at the number of nodes: a balanced tree with leaves of leaf_size / 2 rows
+    // (but no more than a full tree of depth tree_depth). The arrays grow if this is too small
+    // and are trimmed once the tree is built.
+    size_t leaf_size = (config->leaf_size > 2) ? config->leaf_size : 2;
+    treeindex_type capacity = 4 * (num_rows / leaf_size) + 1;
+    if ((config->tree_depth < 32) && (capacity > ((treeindex_type) 1 << config->tree_depth))) {
+        capacity = (treeindex_type) 1 << config->tree_depth;
+    }
+    tree->tree_first = (rownum_type *) malloc(sizeof(rownum_type) * capacity);
+    tree->tree_second = (rownum_type *) malloc(sizeof(rownum_type) * capacity);
+    tree->tree_child = (nodenum_type *) malloc(sizeof(nodenum_type) * capacity);
+    tree->tree_split = (rownum_type *) malloc(sizeof(rownum_type) * capacity);
+    if (!(tree->tree_first) || !(tree->tree_second) || !(tree->tree_child) || !(tree->tree_split)) {
+        die_alloc_err("alloc_node_arrays", "tree arrays");
+    }
+    tree->tree_capacity = capacity;
+    tree->tree_size = 0;
+    tree->num_internal_nodes = 0;
+    tree->num_leaves = 0;
+}
+
+
+// Build the subtree on the view index_start..index_end of tree's row index into a separate set of
+// node arrays (with its root at node 0), so that it can be built concurrently with the rest of
+// the tree. See splice_subtree.
+static void calculate_subtree(RandomBinaryTree *subtree, RandomBinaryTree *tree, feature_type *feat_array,
+        RbfConfig *config, split_scratch *scratch, rownum_type index_start, rownum_type index_end, size_t depth, rbf_rng rng,
+        const node_hists *hists) {
+    *subtree = *tree;
+    alloc_node_arrays(subtree, config, index_end - index_start);
+    nodenum_type root = add_nodes(subtree, 1);
+    calculate_one_node(subtree, feat_array, config, scratch, index_start, index_end, root, depth, rng, hists);
+}
+
+
+// Move a subtree built by calculate_subtree into the tree, with the subtree's root going into the
+// (already allocated) node `node` and the rest of it appended to the tree arrays.
+// Nodes come out numbered exactly as if the subtree had been built directly in the tree.
+static void splice_subtree(RandomBinaryTree *tree, RandomBinaryTree *subtree, nodenum_type node) {
+    nodenum_type base = add_nodes(tree, subtree->tree_size - 1) - 1;     // subtree node i goes to base + i
+    for (treeindex_type i = 0; i < subtree->tree_size; i++) {
+        nodenum_type dest = (i == 0) ? node : base + (nodenum_type) i;
+        tree->tree_first[dest] = subtree->tree_first[i];
+        tree->tree_second[dest] = subtree->tree_second[i];
+        tree->tree_child[dest] = (subtree->tree_first[i] >> HIGH_BIT == 0) ? base + subtree->tree_child[i] : 0;
+        tree->tree_split[dest] = subtree->tree_split[i];
+    }
+    tree->num_internal_nodes += subtree->num_internal_nodes;
+    tree->num_leaves += subtree->num_leaves;
+    free(subtree->tree_first);
+    free(subtree->tree_second);
+    free(subtree->tree_child);
+    free(subtree->tree_split);
+}
+
+
 /*
  * Calculate the split (or leaf) at one node (and its descendants).
  * So this is doing all the real work of building the tree.
@@ -239,61 +636,110 @@ static void _split_node(rownum_type *row_index, feature_type *feat_array, RbfCon
  * - feature array
  * - leaf size, total number of features, and number of features to compare
  *   (not adding these to the tree struct b/c they're only needed at training time)
+ * - per-thread scratch memory (see alloc_split_scratch)
  * - num_rows: number of rows in the feature-array and in the tree's row_index
  * - index_start and index_end: the view into row_index that we're considering right now
- * - tree_array_pos: the position of this node in the tree arrays
- * - TODO: REMOVE depth of this node in the tree
+ * - node: the (already allocated) position of this node in the tree arrays
+ * - depth of this node in the tree (the root is at depth 0)
+ * - rng: this node's random number generator (see rng_init)
+ * - hists: if this node reuses its parent's features, the features and this node's histograms for
+ *   them (see RbfConfig.share_features_levels); otherwise NULL
  * Guarantees:
  * - Parallel calls to `calculate_one_node` will look at non-intersecting views.
  * - Child calls will look at distinct sub-views of this view.
- * - No two calls to `calculate_one_node` will have the same tree_array_pos
+ * - No two calls to `calculate_one_node` will have the same node
+ * Children with at least config->task_min_rows rows are built as OpenMP tasks. Each task builds
+ * its subtree into its own node arrays (so tasks never grow the same arrays concurrently), and we
+ * splice them back in order, so the resulting tree doesn't depend on the cutoff or thread count.
+ * If the children reuse this node's features we work out their histograms here, while this node's
+ * are at hand. They go in the thread's scratch (one pair per level) unless this node could spawn
+ * tasks, in which case we can't rely on staying on this thread, so they go on the heap.
  */
-static void calculate_one_node(RandomBinaryTree *tree, feature_type *feat_array, RbfConfig *config,
-        rownum_type index_start, rownum_type index_end, treeindex_type tree_array_pos, size_t depth) {
-    if (2 * tree_array_pos + 2 >= tree->tree_size) {
+static void calculate_one_node(RandomBinaryTree *tree, feature_type *feat_array, RbfConfig *config, split_scratch *scratch,
+        rownum_type index_start, rownum_type index_end, nodenum_type node, size_t depth, rbf_rng rng,
+        const node_hists *hists) {
+    if (depth + 1 >= config->tree_depth) {
     // Special termination condition to regulate depth.
-        tree->tree_first[tree_array_pos] = (rownum_type) (HIGH_BIT_1 ^ index_start);
-        tree->tree_second[tree_array_pos] = (rownum_type) (HIGH_BIT_1 ^ index_end);
-        tree->num_leaves += 1;
-// fmt.Fprintf(tree_statsFile, "%d,%d,depth-based-leaf,%d,%d,%d,%d,%d,%d,\n", tree_array_pos, depth, index_start, index_end, index_end-index_start, 0, 0, 0)
+        make_leaf(tree, index_start, index_end, node);
+// fmt.Fprintf(tree_statsFile, "%d,%d,depth-based-leaf,%d,%d,%d,%d,%d,%d,\n", node, depth, index_start, index_end, index_end-index_start, 0, 0, 0)
         return;
     }
 
     if (index_end - index_start < config->leaf_size) {
     // Not enough items left to split. Make a leaf.
-        tree->tree_first[tree_array_pos] = (rownum_type) (HIGH_BIT_1 ^ index_start);
-        tree->tree_second[tree_array_pos] = (rownum_type) (HIGH_BIT_1 ^ index_end);
-        tree->num_leaves += 1;
-// fmt.Fprintf(tree_statsFile, "%d,%d,size-based-leaf,%d,%d,%d,%d,%d,%d,\n", tree_array_pos, depth, index_start, index_end, index_end-index_start, 0, 0, 0)
+        make_leaf(tree, index_start, index_end, node);
+// fmt.Fprintf(tree_statsFile, "%d,%d,size-based-leaf,%d,%d,%d,%d,%d,%d,\n", node, depth, index_start, index_end, index_end-index_start, 0, 0, 0)
     } else {
     // Not a leaf. Get a random subset of num_features_to_compare features, find the best one, and split this node.
         colnum_type best_feat_num;
         feature_type best_feat_split_val;
         rownum_type index_split;
-        _split_node(tree->row_index, feat_array, config, index_start, index_end,
-                    &best_feat_num, &best_feat_split_val, &index_split);
+        node_hists split_hists;
+        _split_node(tree->row_index, feat_array, config, &rng, scratch, hists, index_start, index_end,
+                    &best_feat_num, &best_feat_split_val, &index_split, &split_hists);
+        rbf_rng left_rng = rng_split(&rng);
+        rbf_rng right_rng = rng_split(&rng);
 
-        tree->tree_first[tree_array_pos] = best_feat_num;
-        tree->tree_second[tree_array_pos] = (rownum_type) best_feat_split_val;
-// fmt.Fprintf(tree_statsFile, "%d,%d,internal,%d,%d,%d,%d,%d,%d,%s\n", tree_array_pos, depth, index_start, index_end,
+        // (add_nodes can move the tree arrays, so don't hold on to pointers into them)
+        nodenum_type left_child = add_nodes(tree, 2);
+        tree->tree_first[node] = best_feat_num;
+        tree->tree_second[node] = (rownum_type) best_feat_split_val;
+        tree->tree_child[node] = left_child;
+        tree->tree_split[node] = index_split;
+// fmt.Fprintf(tree_statsFile, "%d,%d,internal,%d,%d,%d,%d,%d,%d,%s\n", node, depth, index_start, index_end,
 //        index_end - index_start, index_split, featureNum, featureSplitValue, features.CHAR_REVERSE_MAP[featureNum])
         tree->num_internal_nodes += 1;
-        calculate_one_node(tree, feat_array, config, index_start, index_split, (2*tree_array_pos)+1, depth+1);
-        calculate_one_node(tree, feat_array, config, index_split, index_end, (2*tree_array_pos)+2, depth+1);
+
+        node_hists *child_hists = NULL;
+        bool children_split = (depth + 2 < config->tree_depth)
+                              && ((index_split - index_start >= config->leaf_size) || (index_end - index_split >= config->leaf_size));
+        bool heap_child_hists = (config->task_min_rows > 0) && (index_end - index_start >= config->task_min_rows);
+        if ((config->share_features_levels > 1) && ((depth + 1) % config->share_features_levels != 0) && children_split) {
+            if (heap_child_hists) {
+                child_hists = (node_hists *) malloc(sizeof(node_hists) * 2);
+                if (!child_hists) {
+                    die_alloc_err("calculate_one_node", "child_hists");
+                }
+                alloc_node_hists(&(child_hists[0]), config->num_features_to_compare);
+                alloc_node_hists(&(child_hists[1]), config->num_features_to_compare);
+            } else {
+                child_hists = &(scratch[omp_get_thread_num()].child_hists[2 * (depth + 1)]);
+            }
+            sibling_hists(tree->row_index, feat_array, config->num_rows, &split_hists, config->num_features_to_compare,
+                          index_start, index_split, index_end, scratch[omp_get_thread_num()].sub_hists,
+                          &(child_hists[0]), &(child_hists[1]));
+        }
+        const node_hists *left_hists = child_hists ? &(child_hists[0]) : NULL;
+        const node_hists *right_hists = child_hists ? &(child_hists[1]) : NULL;
+
+        bool left_task = (config->task_min_rows > 0) && (index_split - index_start >= config->task_min_rows);
+        bool right_task = (config->task_min_rows > 0) && (index_end - index_split >= config->task_min_rows);
+        if (left_task || right_task) {
+            RandomBinaryTree subtrees[2];
+            #pragma omp task if(left_task) shared(subtrees)
+            calculate_subtree(&(subtrees[0]), tree, feat_array, config, scratch, index_start, index_split, depth+1, left_rng, left_hists);
+            #pragma omp task if(right_task) shared(subtrees)
+            calculate_subtree(&(subtrees[1]), tree, feat_array, config, scratch, index_split, index_end, depth+1, right_rng, right_hists);
+            #pragma omp taskwait
+            splice_subtree(tree, &(subtrees[0]), left_child);
+            splice_subtree(tree, &(subtrees[1]), left_child + 1);
+        } else {
+            calculate_one_node(tree, feat_array, config, scratch, index_start, index_split, left_child, depth+1, left_rng, left_hists);
+            calculate_one_node(tree, feat_array, config, scratch, index_split, index_end, left_child + 1, depth+1, right_rng, right_hists);
+        }
+        if (child_hists && heap_child_hists) {
+            free_node_hists(&(child_hists[0]));
+            free_node_hists(&(child_hists[1]));
+            free(child_hists);
+        }
     }
 }
 
 
-static RandomBinaryTree *create_rbt(RbfConfig *config) {
-    treeindex_type tree_size = (treeindex_type) (1 << config->tree_depth);
-    RandomBinaryTree *tree = (RandomBinaryTree *) malloc(sizeof(RandomBinaryTree));
-    if (!tree) {
-        die_alloc_err("create_rbt", "tree");
-    }
+// Set up an empty tree in place (in the forest's tree array, so there's no tree struct to leak).
+static void create_rbt(RandomBinaryTree *tree, RbfConfig *config) {
     tree->row_index = (rownum_type *) malloc(sizeof(rownum_type) * config->num_rows);
-    tree->tree_first = (rownum_type *) calloc(sizeof(rownum_type), (size_t) tree_size);
-    tree->tree_second = (rownum_type *) calloc(sizeof(rownum_type), (size_t) tree_size);
-    if (!(tree->row_index) || !(tree->tree_first) || !(tree->tree_second)) {
+    if (!(tree->row_index)) {
         die_alloc_err("create_rbt", "tree attributes");
     }
 
@@ -301,34 +747,134 @@ static RandomBinaryTree *create_rbt(RbfConfig *config) {
         tree->row_index[i] = i;
     }
     tree->num_rows = config->num_rows;
-    tree->tree_size = tree_size;
-    tree->num_internal_nodes = 0;
-    tree->num_leaves = 0;
+    tree->packed_row_index = NULL;
+    tree->row_index_bits = 0;
+    alloc_node_arrays(tree, config, config->num_rows);
+}
 
-    return tree;
+
+// Replace a trained tree's row index with its bit-packed form.
+void pack_tree_row_index(RandomBinaryTree *tree) {
+    tree->row_index_bits = row_index_bits(tree->num_rows);
+    tree->packed_row_index = pack_row_index(tree->row_index, tree->num_rows, tree->row_index_bits);
+    free(tree->row_index);
+    tree->row_index = NULL;
 }
 
 
-static RandomBinaryTree *train_one_tree(feature_type *feat_array, RbfConfig *config) {
-    RandomBinaryTree *tree = create_rbt(config);
-    calculate_one_node(tree, feat_array, config, 0, config->num_rows, 0, 0);
-    return tree;
+static void train_one_tree(feature_type *feat_array, RbfConfig *config, split_scratch *scratch, size_t tree_num,
+        RandomBinaryTree *tree) {
+    create_rbt(tree, config);
+    nodenum_type root = add_nodes(tree, 1);
+    calculate_one_node(tree, feat_array, config, scratch, 0, config->num_rows, root, 0, rng_init(config->seed, tree_num), NULL);
+    shrink_to_fit(tree);
+    if (config->pack_row_index) {
+        pack_tree_row_index(tree);
+    }
 }
 
 
 RandomBinaryForest *train_forest(feature_type *feat_array, RbfConfig *config) {
-    srand(2719);
-    print_time("start training");
     RandomBinaryForest *forest = (RandomBinaryForest *) malloc(sizeof(RandomBinaryForest));
     if (!forest) {
         die_alloc_err("train_forest", "forest");
     }
     forest->config = config;
+    forest->mapping = NULL;
+    forest->mapping_size = 0;
+    forest->ordered_points = NULL;
+    forest->ordered_positions = NULL;
+    forest->ordered_norms = NULL;
     forest->trees = (RandomBinaryTree *) malloc(sizeof(RandomBinaryTree) * config->num_trees);
-    #pragma omp parallel for
+    if (!forest->trees) {
+        die_alloc_err("train_forest", "trees");
+    }
+    split_scratch *scratch = alloc_split_scratch(config, omp_get_max_threads());
+    // One task per tree; trees can spawn more tasks for big subtrees (see calculate_one_node).
+    #pragma omp parallel num_threads(scratch->num_threads)
+    #pragma omp single
+    #pragma omp taskloop grainsize(1)
     for (size_t i = 0; i < config->num_trees; i++) {
-        forest->trees[i] = *train_one_tree(feat_array, config);
+        train_one_tree(feat_array, config, scratch, i, &(forest->trees[i]));
     }
-    print_time("finish training");
+    free_split_scratch(scratch);
     return forest;
 }
+
+
+/*
+ * Free a forest from train_forest or load_forest, and everything it owns. A loaded forest's trees
+ * point into its file mapping, which is unmapped, and its config is its own; a trained forest's
+ * config is the caller's (train_forest doesn't copy it), so that's left alone.
+ * Also frees the calling thread's query buffers (see rbf_release_thread_buffers), which are sized
+ * for the biggest forest it has queried.
+ */
+void free_forest(RandomBinaryForest *forest) {
+    if (!forest) {
+        return;
+    }
+    if (forest->mapping) {
+        munmap(forest->mapping, forest->mapping_size);
+        free(forest->config);
+    } else {
+        for (size_t i = 0; i < forest->config->num_trees; i++) {
+            RandomBinaryTree *tree = &(forest->trees[i]);
+            free(tree->row_index);
+            free(tree->packed_row_index);
+            free(tree->tree_first);
+            free(tree->tree_second);
+            free(tree->tree_child);
+            free(tree->tree_split);
+        }
+    }
+    free(forest->trees);
+    free(forest->ordered_points);
+    free(forest->ordered_positions);
+    free(forest->ordered_norms);
+    free(forest);
+    rbf_release_thread_buffers();
+}
+
+
+/*
+ * Optional step after training: store a copy of the (row-major) reference points permuted into the
+ * first tree's leaf order, the inverse permutation and the points' norms (see
+ * RandomBinaryForest.ordered_points). It costs num_rows * (num_features + 12) bytes.
+ */
+void store_ordered_points(RandomBinaryForest *forest, const feature_type *ref_points) {
+    const RandomBinaryTree *tree = &(forest->trees[0]);
+    rownum_type num_rows = tree->num_rows;
+    size_t num_features = forest->config->num_features;
+    rownum_type *order = tree->row_index;
+    if (tree->packed_row_index) {
+        order = (rownum_type *) malloc(sizeof(rownum_type) * num_rows);
+        if (!order) {
+            die_alloc_err("store_ordered_points", "order");
+        }
+        unpack_row_index(tree->packed_row_index, tree->row_index_bits, 0, num_rows, order);
+    }
+    feature_type *ordered_points = (feature_type *) malloc((size_t) num_rows * num_features);
+    rownum_type *ordered_positions = (rownum_type *) malloc(sizeof(rownum_type) * num_rows);
+    double *ordered_norms = (double *) malloc(sizeof(double) * num_rows);
+    if (!ordered_points || !ordered_positions || !ordered_norms) {
+        die_alloc_err("store_ordered_points", "ordered_points || ordered_positions || ordered_norms");
+    }
+    #pragma omp parallel for schedule(static)
+    for (rownum_type pos = 0; pos < num_rows; pos++) {
+        feature_type *point = &(ordered_points[(size_t) pos * num_features]);
+        memcpy(point, &(ref_points[(size_t) order[pos] * num_features]), num_features);
+        ordered_positions[order[pos]] = pos;
+        // (too many features for the kernels means no distances to use them in: see RBF_MAX_DISTANCE_DIMENSION)
+        ordered_norms[pos] = (num_features <= RBF_MAX_DISTANCE_DIMENSION)
+                             ? sqrt((double) dot_u8(point, point, num_features)) : 0;
+    }
+    if (order != tree->row_index) {
+        free(order);
+    }
+    free(forest->ordered_points);
+    free(forest->ordered_positions);
+    free(forest->ordered_norms);
+    forest->ordered_points = ordered_points;
+    forest->ordered_positions = ordered_positions;
+    forest->ordered_norms = ordered_norms;
+}
@@ -1,9 +1,12 @@
+#include <emmintrin.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "rbf.h"
 #include "_rbf_utils.h"
+#include "_rbf_distance.h"
 
 
 // Call when *alloc returns null
@@ -13,31 +16,166 @@ void die_alloc_err(char *func_name, char *vars) {
 }
 
 
-// Transpose an nxm matrix represented as a single array.
+/*
+ * Transposing.
+ * The straightforward loop writes every byte to a different output row, so for a training set
+ * (60000 x 784, say) each write is to a different page and it runs at TLB-miss speed. Instead we go
+ * a TRANSPOSE_TILE x TRANSPOSE_TILE tile at a time, so a tile's input and output rows stay in the
+ * cache and TLB, and within a tile a 16 x 16 block at a time with SSE2 byte unpacks: 16 loads,
+ * 64 unpacks and 16 stores instead of 256 single-byte moves. Tiles are independent, so big
+ * matrices are split between threads.
+ */
+#define TRANSPOSE_TILE 64
+#define TRANSPOSE_PARALLEL_MIN_BYTES (1 << 20)
+
+// Transpose the 16 x 16 block at in (rows in_stride apart) into out (rows out_stride apart).
+static inline void transpose_16x16(const feature_type *in, size_t in_stride, feature_type *out, size_t out_stride) {
+    __m128i a[16], b[16];
+    for (int r = 0; r < 16; r++) {
+        a[r] = _mm_loadu_si128((const __m128i *) &(in[r * in_stride]));
+    }
+    // b[2k] (b[2k + 1]) holds columns 0-7 (8-15) of rows 2k and 2k + 1, a byte from each per column:
+    for (int k = 0; k < 8; k++) {
+        b[2 * k] = _mm_unpacklo_epi8(a[2 * k], a[2 * k + 1]);
+        b[2 * k + 1] = _mm_unpackhi_epi8(a[2 * k], a[2 * k + 1]);
+    }
+    // a[4m + q] holds columns 4q..4q+3 of rows 4m..4m+3:
+    for (int m = 0; m < 4; m++) {
+        a[4 * m] = _mm_unpacklo_epi16(b[4 * m], b[4 * m + 2]);
+        a[4 * m + 1] = _mm_unpackhi_epi16(b[4 * m], b[4 * m + 2]);
+        a[4 * m + 2] = _mm_unpacklo_epi16(b[4 * m + 1], b[4 * m + 3]);
+        a[4 * m + 3] = _mm_unpackhi_epi16(b[4 * m + 1], b[4 * m + 3]);
+    }
+    // b[8p + s] holds columns 2s and 2s+1 of rows 8p..8p+7:
+    for (int p = 0; p < 2; p++) {
+        for (int q = 0; q < 4; q++) {
+            b[8 * p + 2 * q] = _mm_unpacklo_epi32(a[8 * p + q], a[8 * p + 4 + q]);
+            b[8 * p + 2 * q + 1] = _mm_unpackhi_epi32(a[8 * p + q], a[8 * p + 4 + q]);
+        }
+    }
+    // and column c is all 16 rows:
+    for (int s = 0; s < 8; s++) {
+        _mm_storeu_si128((__m128i *) &(out[(2 * s) * out_stride]), _mm_unpacklo_epi64(b[s], b[8 + s]));
+        _mm_storeu_si128((__m128i *) &(out[(2 * s + 1) * out_stride]), _mm_unpackhi_epi64(b[s], b[8 + s]));
+    }
+}
+
+// Transpose the part of a tile in rows [row_start, row_end) and columns [col_start, col_end).
+static void transpose_tile(const feature_type *input, size_t rows, size_t cols, size_t row_start, size_t row_end,
+        size_t col_start, size_t col_end, feature_type *output) {
+    size_t i = row_start;
+    for (; i + 16 <= row_end; i += 16) {
+        size_t j = col_start;
+        for (; j + 16 <= col_end; j += 16) {
+            transpose_16x16(&(input[i * cols + j]), cols, &(output[j * rows + i]), rows);
+        }
+        for (; j < col_end; j++) {
+            for (size_t k = i; k < i + 16; k++) {
+                output[j * rows + k] = input[k * cols + j];
+            }
+        }
+    }
+    for (; i < row_end; i++) {
+        for (size_t j = col_start; j < col_end; j++) {
+            output[j * rows + i] = input[i * cols + j];
+        }
+    }
+}
+
+// Transpose rows [row_start, row_end) of a rows x cols matrix into the cols x rows output, so a
+// big matrix can be transposed a chunk of input at a time (see train_forest_rows).
+void transpose_rows(const feature_type *input, size_t rows, size_t cols, size_t row_start, size_t row_end,
+        feature_type *output) {
+    if (row_end <= row_start) {
+        return;
+    }
+    size_t row_tiles = (row_end - row_start + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+    size_t col_tiles = (cols + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+    #pragma omp parallel for collapse(2) schedule(static) if((row_end - row_start) * cols >= TRANSPOSE_PARALLEL_MIN_BYTES)
+    for (size_t r = 0; r < row_tiles; r++) {
+        for (size_t c = 0; c < col_tiles; c++) {
+            size_t i = row_start + r * TRANSPOSE_TILE, j = c * TRANSPOSE_TILE;
+            transpose_tile(input, rows, cols, i, (i + TRANSPOSE_TILE < row_end) ? i + TRANSPOSE_TILE : row_end,
+                           j, (j + TRANSPOSE_TILE < cols) ? j + TRANSPOSE_TILE : cols, output);
+        }
+    }
+}
+
+// Transpose an nxm matrix represented as a single array into the caller's n*m-byte output.
 // (Alternatively: convert between row-major and column-major representations.)
+void transpose_into(const feature_type *input, size_t rows, size_t cols, feature_type *output) {
+    transpose_rows(input, rows, cols, 0, rows, output);
+}
+
+// Same, into a new array.
 feature_type *transpose(feature_type *input, size_t rows, size_t cols) {
     feature_type *output = (feature_type *) malloc(sizeof(feature_type) * rows * cols);
     if (!output) {
         die_alloc_err("transpose", "output");
     }
-    for (size_t i = 0; i < rows; i++) {
-        for (size_t j = 0; j < cols; j++) {
-            output[j * rows + i] = input[i * cols + j];
-        }
-    }
+    transpose_into(input, rows, cols, output);
     return output;
 }
 
 
-// Square of the L^2 distance between two points
-int l2_square_dist(feature_type *v1, feature_type *v2, size_t vec_size) {
-    int sum = 0;
+/*
+ * Bit-packed row indices.
+ * A tree's row index is a permutation of 0..num_rows-1, so each entry fits in
+ * ceil(log2(num_rows)) bits instead of the 32 of a rownum_type. Entry i is stored little-endian
+ * starting at bit i * bits. Since bits <= 31 an entry plus its bit-offset within its first byte
+ * always fits in one 8-byte load, so unpacking is a load, a shift and a mask per entry with no
+ * branches (and vectorizes into gathers). The packed array has 8 bytes of slack at the end so that
+ * load never runs off the end.
+ */
+
+// Number of bits needed to store the row numbers 0..num_rows-1.
+int row_index_bits(rownum_type num_rows) {
+    int bits = 1;
+    while ((bits < HIGH_BIT) && (((rownum_type) 1 << bits) < num_rows)) {
+        bits += 1;
+    }
+    return bits;
+}
+
+
+size_t packed_row_index_size(rownum_type num_rows, int bits) {
+    return (((size_t) num_rows * bits) + 7) / 8 + sizeof(uint64_t);
+}
+
+
+uint8_t *pack_row_index(const rownum_type *row_index, rownum_type num_rows, int bits) {
+    uint8_t *packed = (uint8_t *) calloc(1, packed_row_index_size(num_rows, bits));
+    if (!packed) {
+        die_alloc_err("pack_row_index", "packed");
+    }
+    for (rownum_type i = 0; i < num_rows; i++) {
+        size_t bit = (size_t) i * bits;
+        uint64_t word;
+        memcpy(&word, &(packed[bit >> 3]), sizeof(word));
+        word |= ((uint64_t) row_index[i]) << (bit & 7);
+        memcpy(&(packed[bit >> 3]), &word, sizeof(word));
+    }
+    return packed;
+}
+
+
+// Unpack entries index_start..index_end-1 of a packed row index into ret_rows.
+void unpack_row_index(const uint8_t *packed, int bits, rownum_type index_start, rownum_type index_end,
+        rownum_type *ret_rows) {
+    uint64_t mask = ((uint64_t) 1 << bits) - 1;
     #pragma omp simd
-    for (size_t i = 0; i < vec_size; i++) {
-        int coord_diff = (int) v1[i] - (int) v2[i];
-        sum += coord_diff * coord_diff;
+    for (rownum_type i = index_start; i < index_end; i++) {
+        size_t bit = (size_t) i * bits;
+        uint64_t word;
+        memcpy(&word, &(packed[bit >> 3]), sizeof(word));
+        ret_rows[i - index_start] = (rownum_type) ((word >> (bit & 7)) & mask);
     }
-    return sum;
+}
+
+
+// Square of the L^2 distance between two points
+int l2_square_dist(feature_type *v1, feature_type *v2, size_t vec_size) {
+    return l2_square_dist_u8(v1, v2, vec_size);
 }
 
 
@@ -0,0 +1,451 @@
+/*
+ * The `rbf` Python extension module: a Forest type over the C library, built with `make py_module`.
+ *
+ *     forest = rbf.Forest(train, num_trees=64, tree_depth=20, leaf_size=8, num_features_to_compare=28)
+ *     indptr, indices = forest.query(test)
+ *     indptr, indices, distances = forest.knn(test, 10, metric="l2")
+ *
+ * Points are anything with a C-contiguous uint8 buffer (numpy arrays, bytes, bytearrays, ...), read
+ * in place: one point per row of a 2-d array, or num_features bytes per point in a 1-d buffer.
+ * Results come back CSR-style (see RbfCsrResults) as memoryviews straight over the C arrays, so
+ * numpy.asarray() of them doesn't copy either; they keep the C results alive as long as they're used.
+ * Training and the queries run without the GIL, so Python threads can query a forest concurrently.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "rbf.h"
+
+
+/*
+ * A read-only one-dimensional buffer over an array in some C allocation, which `owner` (a capsule
+ * that frees the allocation) keeps alive.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *owner;
+    void *data;
+    Py_ssize_t length;
+    Py_ssize_t itemsize;
+    char *format;
+} CArrayObject;
+
+static int carray_getbuffer(CArrayObject *self, Py_buffer *view, int flags) {
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "rbf results are read-only");
+        return -1;
+    }
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->length * self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &(self->length) : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? &(self->itemsize) : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static void carray_dealloc(CArrayObject *self) {
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyBufferProcs carray_as_buffer = {(getbufferproc) carray_getbuffer, NULL};
+
+static PyTypeObject CArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "rbf._CArray",
+    .tp_basicsize = sizeof(CArrayObject),
+    .tp_dealloc = (destructor) carray_dealloc,
+    .tp_as_buffer = &carray_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Read-only buffer over an array of rbf results.",
+};
+
+// A memoryview over one of the owner's arrays.
+static PyObject *carray_view(PyObject *owner, void *data, size_t length, size_t itemsize, char *format) {
+    CArrayObject *array = PyObject_New(CArrayObject, &CArrayType);
+    if (!array) {
+        return NULL;
+    }
+    Py_INCREF(owner);
+    array->owner = owner;
+    array->data = data;
+    array->length = (Py_ssize_t) length;
+    array->itemsize = (Py_ssize_t) itemsize;
+    array->format = format;
+    PyObject *view = PyMemoryView_FromObject((PyObject *) array);
+    Py_DECREF(array);
+    return view;
+}
+
+static void csr_capsule_destructor(PyObject *capsule) {
+    free_csr_results((RbfCsrResults *) PyCapsule_GetPointer(capsule, "rbf.csr_results"));
+}
+
+// Hand CSR results over to Python: (indptr, indices), plus distances if it has them.
+static PyObject *csr_to_python(RbfCsrResults *results) {
+    PyObject *capsule = PyCapsule_New(results, "rbf.csr_results", csr_capsule_destructor);
+    if (!capsule) {
+        free_csr_results(results);
+        return NULL;
+    }
+    size_t num_results = results->indptr[results->num_points];
+    char *indptr_format = (sizeof(size_t) == sizeof(unsigned long long)) ? "Q" : "I";
+    PyObject *indptr = carray_view(capsule, results->indptr, results->num_points + 1, sizeof(size_t), indptr_format);
+    PyObject *indices = carray_view(capsule, results->indices, num_results, sizeof(rownum_type), "i");
+    PyObject *distances = results->distances
+            ? carray_view(capsule, results->distances, num_results, sizeof(double), "d") : NULL;
+    Py_DECREF(capsule);
+    PyObject *ret = NULL;
+    if (indptr && indices && (distances || !results->distances)) {
+        ret = distances ? PyTuple_Pack(3, indptr, indices, distances) : PyTuple_Pack(2, indptr, indices);
+    }
+    Py_XDECREF(indptr);
+    Py_XDECREF(indices);
+    Py_XDECREF(distances);
+    return ret;
+}
+
+
+/*
+ * Get a C-contiguous buffer of uint8 points with num_features per point: a 2-d buffer with that many
+ * columns, or any other shape with a multiple of that many bytes. On success the caller releases it.
+ */
+static int get_points(PyObject *obj, colnum_type num_features, Py_buffer *view, size_t *ret_num_points) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+        return -1;
+    }
+    if ((view->itemsize != 1) || (view->format && (strcmp(view->format, "B") != 0))) {
+        PyErr_SetString(PyExc_TypeError, "points must be uint8");
+    } else if ((view->ndim == 2) && (view->shape[1] != num_features)) {
+        PyErr_Format(PyExc_ValueError, "points have %zd features, not %d", view->shape[1], (int) num_features);
+    } else if ((num_features <= 0) || (view->len % num_features != 0)) {
+        PyErr_Format(PyExc_ValueError, "%zd bytes isn't a whole number of %d-feature points", view->len, (int) num_features);
+    } else {
+        *ret_num_points = (size_t) (view->len / num_features);
+        return 0;
+    }
+    PyBuffer_Release(view);
+    return -1;
+}
+
+
+typedef struct {
+    PyObject_HEAD
+    RandomBinaryForest *forest;
+    RbfConfig *config;      // our copy of a trained forest's config (a loaded forest has its own)
+} ForestObject;
+
+static PyTypeObject ForestType;
+
+static void forest_dealloc(ForestObject *self) {
+    free_forest(self->forest);
+    free(self->config);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int forest_init(ForestObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"data", "num_trees", "tree_depth", "leaf_size", "num_features_to_compare",
+                             "num_features", "pack_row_index", "seed", "task_min_rows", "share_features_levels",
+                             "parallel_query_min_trees", "store_points", NULL};
+    PyObject *data;
+    Py_ssize_t num_trees, tree_depth, leaf_size, num_features = 0, share_features_levels = 0,
+               parallel_query_min_trees = 0;
+    int num_features_to_compare, pack_row_index = 0, task_min_rows = 0, store_points = 1;
+    unsigned long long seed = 2719;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Onnni|npKinnp", kwlist, &data, &num_trees, &tree_depth,
+                                     &leaf_size, &num_features_to_compare, &num_features, &pack_row_index, &seed,
+                                     &task_min_rows, &share_features_levels, &parallel_query_min_trees,
+                                     &store_points)) {
+        return -1;
+    }
+    if (self->forest) {
+        PyErr_SetString(PyExc_RuntimeError, "Forest is already trained");
+        return -1;
+    }
+    if ((num_trees <= 0) || (tree_depth <= 0) || (leaf_size <= 0) || (num_features_to_compare <= 0)
+            || (share_features_levels < 0) || (parallel_query_min_trees < 0)) {
+        PyErr_SetString(PyExc_ValueError, "num_trees, tree_depth, leaf_size and num_features_to_compare must be positive");
+        return -1;
+    }
+    if (num_features <= 0) {
+        // then it's the data's number of columns
+        Py_buffer shape_view;
+        if (PyObject_GetBuffer(data, &shape_view, PyBUF_C_CONTIGUOUS) != 0) {
+            return -1;
+        }
+        num_features = (shape_view.ndim == 2) ? shape_view.shape[1] : 0;
+        PyBuffer_Release(&shape_view);
+        if (num_features <= 0) {
+            PyErr_SetString(PyExc_ValueError, "pass num_features for data that isn't 2-d");
+            return -1;
+        }
+    }
+    if (num_features_to_compare > num_features) {
+        PyErr_SetString(PyExc_ValueError, "num_features_to_compare is more than num_features");
+        return -1;
+    }
+    Py_buffer view;
+    size_t num_rows;
+    if (get_points(data, (colnum_type) num_features, &view, &num_rows) != 0) {
+        return -1;
+    }
+    if ((num_rows == 0) || (num_rows > INT32_MAX)) {
+        PyBuffer_Release(&view);
+        PyErr_SetString(PyExc_ValueError, "data needs at least one row and fewer than 2**31");
+        return -1;
+    }
+
+    RbfConfig *config = (RbfConfig *) malloc(sizeof(RbfConfig));
+    if (!config) {
+        PyBuffer_Release(&view);
+        PyErr_NoMemory();
+        return -1;
+    }
+    config->num_trees = (size_t) num_trees;
+    config->tree_depth = (size_t) tree_depth;
+    config->leaf_size = (size_t) leaf_size;
+    config->num_rows = (rownum_type) num_rows;
+    config->num_features = (colnum_type) num_features;
+    config->num_features_to_compare = (colnum_type) num_features_to_compare;
+    config->pack_row_index = pack_row_index;
+    config->seed = seed;
+    config->task_min_rows = (rownum_type) task_min_rows;
+    config->share_features_levels = (size_t) share_features_levels;
+    config->parallel_query_min_trees = (size_t) parallel_query_min_trees;
+
+    // training wants the data a feature at a time (and doesn't keep it); kNN wants it a point at a time
+    RandomBinaryForest *forest;
+    Py_BEGIN_ALLOW_THREADS
+    forest = train_forest_rows((const feature_type *) view.buf, config, NULL);
+    if (forest && store_points) {
+        store_ordered_points(forest, (const feature_type *) view.buf);
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    if (!forest) {
+        free(config);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->forest = forest;
+    self->config = config;
+    return 0;
+}
+
+static PyObject *forest_load(PyTypeObject *type, PyObject *args) {
+    PyObject *filename_obj;
+    if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &filename_obj)) {
+        return NULL;
+    }
+    RandomBinaryForest *forest;
+    Py_BEGIN_ALLOW_THREADS
+    forest = load_forest(PyBytes_AS_STRING(filename_obj));
+    Py_END_ALLOW_THREADS
+    if (!forest) {
+        PyErr_Format(PyExc_OSError, "can't load a forest from %s", PyBytes_AS_STRING(filename_obj));
+        Py_DECREF(filename_obj);
+        return NULL;
+    }
+    Py_DECREF(filename_obj);
+    ForestObject *self = (ForestObject *) type->tp_alloc(type, 0);
+    if (!self) {
+        free_forest(forest);
+        return NULL;
+    }
+    self->forest = forest;
+    self->config = NULL;
+    return (PyObject *) self;
+}
+
+static bool forest_ready(ForestObject *self) {
+    if (!self->forest) {
+        PyErr_SetString(PyExc_RuntimeError, "Forest isn't trained");
+    }
+    return self->forest != NULL;
+}
+
+static PyObject *forest_save(ForestObject *self, PyObject *args) {
+    PyObject *filename_obj;
+    if (!forest_ready(self) || !PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &filename_obj)) {
+        return NULL;
+    }
+    bool saved;
+    Py_BEGIN_ALLOW_THREADS
+    saved = save_forest(self->forest, PyBytes_AS_STRING(filename_obj));
+    Py_END_ALLOW_THREADS
+    if (!saved) {
+        PyErr_Format(PyExc_OSError, "can't save the forest to %s", PyBytes_AS_STRING(filename_obj));
+        Py_DECREF(filename_obj);
+        return NULL;
+    }
+    Py_DECREF(filename_obj);
+    Py_RETURN_NONE;
+}
+
+static PyObject *forest_query(ForestObject *self, PyObject *args) {
+    PyObject *points_obj;
+    if (!forest_ready(self) || !PyArg_ParseTuple(args, "O", &points_obj)) {
+        return NULL;
+    }
+    Py_buffer view;
+    size_t num_points;
+    if (get_points(points_obj, self->forest->config->num_features, &view, &num_points) != 0) {
+        return NULL;
+    }
+    RbfCsrResults *results;
+    Py_BEGIN_ALLOW_THREADS
+    results = batch_query_forest_dedup_csr(self->forest, (const feature_type *) view.buf,
+                                           self->forest->config->num_features, num_points);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    return csr_to_python(results);
+}
+
+static PyObject *forest_knn(ForestObject *self, PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"points", "k", "metric", "min_tree_rows", "ref_points", NULL};
+    static const char *metric_names[] = {"l2", "l1", "cosine", "dot", "hamming"};
+    static const RbfMetric metrics[] = {RBF_L2, RBF_L1, RBF_COSINE, RBF_DOT, RBF_HAMMING};
+    PyObject *points_obj, *ref_points_obj = Py_None;
+    Py_ssize_t k;
+    const char *metric_name = "l2";
+    int min_tree_rows = 0;
+    if (!forest_ready(self) || !PyArg_ParseTupleAndKeywords(args, kwargs, "On|siO", kwlist, &points_obj, &k,
+                                                             &metric_name, &min_tree_rows, &ref_points_obj)) {
+        return NULL;
+    }
+    size_t m = 0;
+    while ((m < sizeof(metrics) / sizeof(metrics[0])) && (strcmp(metric_name, metric_names[m]) != 0)) {
+        m++;
+    }
+    if (m == sizeof(metrics) / sizeof(metrics[0])) {
+        PyErr_Format(PyExc_ValueError, "unknown metric %s", metric_name);
+        return NULL;
+    }
+    if (k <= 0) {
+        PyErr_SetString(PyExc_ValueError, "k must be positive");
+        return NULL;
+    }
+    colnum_type num_features = self->forest->config->num_features;
+    rownum_type num_rows = self->forest->config->num_rows;
+    if (num_features > RBF_MAX_DISTANCE_DIMENSION) {
+        PyErr_Format(PyExc_ValueError, "knn needs at most %d features, not %d", RBF_MAX_DISTANCE_DIMENSION,
+                     (int) num_features);
+        return NULL;
+    }
+    Py_buffer ref_view = {0};
+    size_t num_ref_points = 0;
+    if (ref_points_obj != Py_None) {
+        if (get_points(ref_points_obj, num_features, &ref_view, &num_ref_points) != 0) {
+            return NULL;
+        }
+        if (num_ref_points != (size_t) num_rows) {
+            PyBuffer_Release(&ref_view);
+            PyErr_Format(PyExc_ValueError, "ref_points has %zu points, not the forest's %d", num_ref_points, (int) num_rows);
+            return NULL;
+        }
+    } else if (!self->forest->ordered_points) {
+        PyErr_SetString(PyExc_ValueError, "this forest has no stored points: pass ref_points");
+        return NULL;
+    }
+    Py_buffer view;
+    size_t num_points;
+    if (get_points(points_obj, num_features, &view, &num_points) != 0) {
+        if (ref_view.obj) {
+            PyBuffer_Release(&ref_view);
+        }
+        return NULL;
+    }
+    RbfCsrResults *results;
+    Py_BEGIN_ALLOW_THREADS
+    results = batch_query_forest_knn_csr(self->forest, ref_view.obj ? (const feature_type *) ref_view.buf : NULL,
+                                         (const feature_type *) view.buf, num_features, num_points, metrics[m],
+                                         (size_t) k, (rownum_type) min_tree_rows);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    if (ref_view.obj) {
+        PyBuffer_Release(&ref_view);
+    }
+    return csr_to_python(results);
+}
+
+static PyObject *forest_get_num_trees(ForestObject *self, void *closure) {
+    return forest_ready(self) ? PyLong_FromSize_t(self->forest->config->num_trees) : NULL;
+}
+
+static PyObject *forest_get_num_rows(ForestObject *self, void *closure) {
+    return forest_ready(self) ? PyLong_FromLong(self->forest->config->num_rows) : NULL;
+}
+
+static PyObject *forest_get_num_features(ForestObject *self, void *closure) {
+    return forest_ready(self) ? PyLong_FromLong(self->forest->config->num_features) : NULL;
+}
+
+static PyMethodDef forest_methods[] = {
+    {"load", (PyCFunction) forest_load, METH_VARARGS | METH_CLASS,
+     "load(filename): a forest saved with save(), with its parallel_query_min_trees (memory-mapped, so the file\n"
+     "must not change while it's in use)"},
+    {"save", (PyCFunction) forest_save, METH_VARARGS, "save(filename)"},
+    {"query", (PyCFunction) forest_query, METH_VARARGS,
+     "query(points) -> (indptr, indices): each point's deduped candidates from all the trees"},
+    {"knn", (PyCFunction) forest_knn, METH_VARARGS | METH_KEYWORDS,
+     "knn(points, k, metric='l2', min_tree_rows=0, ref_points=None) -> (indptr, indices, distances): each point's\n"
+     "k nearest candidates, nearest first, by l2 (squared), l1, cosine, dot or hamming. ref_points (the training\n"
+     "data) is only needed if the forest has no stored points (loaded forests, or store_points=False)."},
+    {NULL}
+};
+
+static PyGetSetDef forest_getset[] = {
+    {"num_trees", (getter) forest_get_num_trees, NULL, "number of trees", NULL},
+    {"num_rows", (getter) forest_get_num_rows, NULL, "number of training rows", NULL},
+    {"num_features", (getter) forest_get_num_features, NULL, "number of features per point", NULL},
+    {NULL}
+};
+
+static PyTypeObject ForestType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "rbf.Forest",
+    .tp_basicsize = sizeof(ForestObject),
+    .tp_dealloc = (destructor) forest_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Forest(data, num_trees, tree_depth, leaf_size, num_features_to_compare, num_features=0,\n"
+              "       pack_row_index=False, seed=2719, task_min_rows=0, share_features_levels=0,\n"
+              "       parallel_query_min_trees=0, store_points=True)\n"
+              "A random binary forest trained on data (uint8, one point per row). store_points keeps a copy\n"
+              "of the data (in the first tree's order) for knn.",
+    .tp_methods = forest_methods,
+    .tp_getset = forest_getset,
+    .tp_init = (initproc) forest_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static PyModuleDef rbf_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "rbf",
+    .m_doc = "Random binary forests for approximate nearest neighbors.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_rbf(void) {
+    if ((PyType_Ready(&CArrayType) < 0) || (PyType_Ready(&ForestType) < 0)) {
+        return NULL;
+    }
+    PyObject *module = PyModule_Create(&rbf_module);
+    if (!module) {
+        return NULL;
+    }
+    Py_INCREF(&ForestType);
+    if (PyModule_AddObject(module, "Forest", (PyObject *) &ForestType) < 0) {
+        Py_DECREF(&ForestType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
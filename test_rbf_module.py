@@ -0,0 +1,120 @@
+#!/usr/bin/env python
+# Tests for the rbf extension module (rbfmodule.c). Run with `make module_py_test`.
+# Uses only the standard library, so the data are bytes and the results are read as memoryviews.
+import os
+import random
+import tempfile
+import threading
+
+import rbf
+
+
+NUM_ROWS = 3000
+NUM_FEATURES = 16
+
+
+def random_points(num_points, seed):
+    rng = random.Random(seed)
+    return bytes(rng.randrange(256) for _ in range(num_points * NUM_FEATURES))
+
+
+def l2(data, row, point):
+    return sum((data[row * NUM_FEATURES + f] - point[f]) ** 2 for f in range(NUM_FEATURES))
+
+
+def test_query_and_knn(forest, data, points):
+    indptr, indices = forest.query(points)
+    knn_indptr, knn_indices, distances = forest.knn(points, 5)
+    num_points = len(points) // NUM_FEATURES
+    assert len(indptr) == num_points + 1 and indptr[0] == 0 and indptr[-1] == len(indices)
+    assert indices.format == "i" and distances.format == "d" and indices.readonly
+    for i in range(num_points):
+        point = points[i * NUM_FEATURES:(i + 1) * NUM_FEATURES]
+        candidates = list(indices[indptr[i]:indptr[i + 1]])
+        assert len(candidates) == len(set(candidates))
+        # the nearest 5 candidates, nearest (then lowest-numbered) first:
+        expected = sorted(candidates, key=lambda row: (l2(data, row, point), row))[:5]
+        assert list(knn_indices[knn_indptr[i]:knn_indptr[i + 1]]) == expected
+        assert list(distances[knn_indptr[i]:knn_indptr[i + 1]]) == [l2(data, row, point) for row in expected]
+
+
+def test_training_points_find_themselves(forest, data):
+    indptr, indices, distances = forest.knn(data[:50 * NUM_FEATURES], 1)
+    assert list(indices) == list(range(50)) and list(distances) == [0] * 50
+
+
+def test_save_load(forest, data, points):
+    with tempfile.TemporaryDirectory() as tmp:
+        filename = os.path.join(tmp, "forest.rbf")
+        forest.save(filename)
+        loaded = rbf.Forest.load(filename)
+    assert (loaded.num_trees, loaded.num_rows, loaded.num_features) == (forest.num_trees, NUM_ROWS, NUM_FEATURES)
+    assert [list(a) for a in loaded.query(points)] == [list(a) for a in forest.query(points)]
+    # a loaded forest doesn't have the training points, so kNN needs them passed in:
+    try:
+        loaded.knn(points, 3)
+        assert False, "knn without ref_points should fail"
+    except ValueError:
+        pass
+    assert [list(a) for a in loaded.knn(points, 3, metric="l1", ref_points=data)] \
+        == [list(a) for a in forest.knn(points, 3, metric="l1")]
+
+
+def test_results_outlive_forest(data, points):
+    forest = rbf.Forest(data, 4, 12, 8, 4, num_features=NUM_FEATURES)
+    expected = [list(a) for a in forest.query(points)]
+    indptr, indices = forest.query(points)
+    del forest
+    assert [list(indptr), list(indices)] == expected
+
+
+def test_threads(forest, points):
+    expected = [list(a) for a in forest.knn(points, 4, metric="cosine")]
+    results = [None] * 4
+
+    def worker(i):
+        results[i] = [list(a) for a in forest.knn(points, 4, metric="cosine")]
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert all(r == expected for r in results)
+
+
+def test_bad_input(forest):
+    for bad_call, error in [(lambda: forest.query(b"x" * (NUM_FEATURES + 1)), ValueError),
+                            (lambda: forest.query(memoryview(b"x" * NUM_FEATURES * 2).cast("H")), TypeError),
+                            (lambda: forest.knn(b"x" * NUM_FEATURES, 3, metric="nope"), ValueError),
+                            (lambda: rbf.Forest(b"x" * 100, 2, 5, 4, 3), ValueError)]:
+        try:
+            bad_call()
+            assert False, "should have raised"
+        except error:
+            pass
+
+
+def test_too_many_features_for_knn():
+    # (the distance kernels sum in 32-bit ints, so they'd overflow)
+    num_features = 40000
+    forest = rbf.Forest(bytes(5 * num_features), 1, 2, 8, 1, num_features=num_features)
+    try:
+        forest.knn(bytes(num_features), 1)
+        assert False, "knn should refuse"
+    except ValueError:
+        pass
+    assert list(forest.query(bytes(num_features))[1]) == list(range(5))
+
+
+if __name__ == '__main__':
+    data = random_points(NUM_ROWS, 1)
+    points = random_points(70, 2)
+    forest = rbf.Forest(bytearray(data), 8, 14, 8, 4, num_features=NUM_FEATURES, pack_row_index=True)
+    test_query_and_knn(forest, data, points)
+    test_training_points_find_themselves(forest, data)
+    test_save_load(forest, data, points)
+    test_results_outlive_forest(data, points)
+    test_threads(forest, points)
+    test_bad_input(forest)
+    test_too_many_features_for_knn()
+    print("all rbf module tests passed")
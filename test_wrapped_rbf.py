@@ -1,5 +1,6 @@
 #!/usr/bin/env python
 import ctypes
+import sys
 
 
 rbf = ctypes.CDLL("librbf.so")
@@ -18,18 +19,29 @@ class RbfConfig(ctypes.Structure):
                 ("leaf_size", ctypes.c_size_t),
                 ("num_rows", rownum_type),
                 ("num_features", colnum_type),
-                ("num_features_to_compare", colnum_type)]
-
-    def __init__(self, num_trees, tree_depth, leaf_size, num_rows, num_features, num_features_to_compare):
+                ("num_features_to_compare", colnum_type),
+                ("pack_row_index", ctypes.c_bool),
+                ("seed", ctypes.c_uint64),
+                ("task_min_rows", rownum_type),
+                ("share_features_levels", ctypes.c_size_t),
+                ("parallel_query_min_trees", ctypes.c_size_t)]
+
+    def __init__(self, num_trees, tree_depth, leaf_size, num_rows, num_features, num_features_to_compare,
+                 pack_row_index=False, seed=2719, task_min_rows=0, share_features_levels=0, parallel_query_min_trees=0):
         self.num_trees = num_trees
         self.tree_depth = tree_depth
         self.leaf_size = leaf_size
         self.num_rows = num_rows
         self.num_features = num_features
         self.num_features_to_compare = num_features_to_compare
+        self.pack_row_index = pack_row_index
+        self.seed = seed
+        self.task_min_rows = task_min_rows
+        self.share_features_levels = share_features_levels
+        self.parallel_query_min_trees = parallel_query_min_trees
 
     def __repr__(self):
-        return f"num_trees: {self.num_trees}, tree_depth: {self.tree_depth}, leaf_size: {self.leaf_size}, num_rows: {self.num_rows}, num_features: {self.num_features}, num_features_to_compare: {self.num_features_to_compare}"
+        return f"num_trees: {self.num_trees}, tree_depth: {self.tree_depth}, leaf_size: {self.leaf_size}, num_rows: {self.num_rows}, num_features: {self.num_features}, num_features_to_compare: {self.num_features_to_compare}, pack_row_index: {self.pack_row_index}, seed: {self.seed}, task_min_rows: {self.task_min_rows}, share_features_levels: {self.share_features_levels}, parallel_query_min_trees: {self.parallel_query_min_trees}"
 
 # These don't need to be visible in Python: just treat the RBF* as a void*.
 #
@@ -38,13 +50,23 @@ class RbfConfig(ctypes.Structure):
 #                 ("num_rows", rownum_type),
 #                 ("tree_first", ctypes.POINTER(rownum_type)),
 #                 ("tree_second", ctypes.POINTER(rownum_type)),
+#                 ("tree_child", ctypes.POINTER(ctypes.c_uint32)),
 #                 ("tree_size", treeindex_type),
 #                 ("num_internal_nodes", treeindex_type),
-#                 ("num_leaves", treeindex_type)]
+#                 ("num_leaves", treeindex_type),
+#                 ("tree_capacity", treeindex_type),
+#                 ("packed_row_index", ctypes.POINTER(ctypes.c_uint8)),
+#                 ("row_index_bits", ctypes.c_int),
+#                 ("tree_split", ctypes.POINTER(rownum_type))]
 #
 # class RandomBinaryForest(ctypes.Structure):
 #     _fields_ = [("config", ctypes.POINTER(RbfConfig)),
-#                 ("trees", ctypes.POINTER(RandomBinaryTree))]
+#                 ("trees", ctypes.POINTER(RandomBinaryTree)),
+#                 ("mapping", ctypes.c_void_p),
+#                 ("mapping_size", ctypes.c_size_t),
+#                 ("ordered_points", ctypes.POINTER(ctypes.c_uint8)),
+#                 ("ordered_positions", ctypes.POINTER(rownum_type)),
+#                 ("ordered_norms", ctypes.POINTER(ctypes.c_double))]
 
 
 rbf_type = ctypes.c_void_p
@@ -54,6 +76,18 @@ class RbfResults(ctypes.Structure):
                 ("tree_results_counts", ctypes.POINTER(ctypes.c_size_t)),
                 ("total_count", ctypes.c_size_t)]
 
+class RbfBatchResults(ctypes.Structure):
+    _fields_ = [("num_points", ctypes.c_size_t),
+                ("num_trees", ctypes.c_size_t),
+                ("offsets", ctypes.POINTER(ctypes.c_size_t)),
+                ("ids", ctypes.POINTER(rownum_type))]
+
+class RbfCsrResults(ctypes.Structure):
+    _fields_ = [("num_points", ctypes.c_size_t),
+                ("indptr", ctypes.POINTER(ctypes.c_size_t)),
+                ("indices", ctypes.POINTER(rownum_type)),
+                ("distances", ctypes.POINTER(ctypes.c_double))]
+
 
 transpose = rbf.__getattr__("transpose")
 transpose.restype = ctypes.POINTER(feature_type)
@@ -63,14 +97,35 @@ train_forest = rbf.__getattr__("train_forest")
 train_forest.restype = rbf_type
 train_forest.argtypes = [ctypes.POINTER(feature_type), ctypes.POINTER(RbfConfig)]
 
+# Trains straight from a row-major feature file (no read + transpose copies in Python); scratch may be None.
+train_forest_from_file = rbf.__getattr__("train_forest_from_file")
+train_forest_from_file.restype = rbf_type
+train_forest_from_file.argtypes = [ctypes.c_char_p, ctypes.POINTER(RbfConfig), ctypes.c_char_p]
+
 query_forest_all_results = rbf.__getattr__("query_forest_all_results")
 query_forest_all_results.restype = ctypes.POINTER(RbfResults)
 query_forest_all_results.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t]
 
 batch_query_forest_all_results = rbf.__getattr__("batch_query_forest_all_results")
-batch_query_forest_all_results.restype = ctypes.POINTER(RbfResults)
+batch_query_forest_all_results.restype = ctypes.POINTER(RbfBatchResults)
 batch_query_forest_all_results.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.c_size_t]
 
+free_forest = rbf.__getattr__("free_forest")
+free_forest.restype = None
+free_forest.argtypes = [rbf_type]
+
+free_results = rbf.__getattr__("free_results")
+free_results.restype = None
+free_results.argtypes = [ctypes.POINTER(RbfResults)]
+
+free_batch_results = rbf.__getattr__("free_batch_results")
+free_batch_results.restype = None
+free_batch_results.argtypes = [ctypes.POINTER(RbfBatchResults)]
+
+rbf_release_thread_buffers = rbf.__getattr__("rbf_release_thread_buffers")
+rbf_release_thread_buffers.restype = None
+rbf_release_thread_buffers.argtypes = []
+
 query_forest_dedup_results = rbf.__getattr__("query_forest_dedup_results")
 query_forest_dedup_results.restype = ctypes.POINTER(rownum_type)
 query_forest_dedup_results.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
@@ -79,6 +134,60 @@ batch_query_forest_dedup_results = rbf.__getattr__("batch_query_forest_dedup_res
 batch_query_forest_dedup_results.restype = ctypes.POINTER(ctypes.POINTER(rownum_type))
 batch_query_forest_dedup_results.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
 
+batch_query_forest_dedup_csr = rbf.__getattr__("batch_query_forest_dedup_csr")
+batch_query_forest_dedup_csr.restype = ctypes.POINTER(RbfCsrResults)
+batch_query_forest_dedup_csr.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.c_size_t]
+
+batch_query_forest_knn_csr = rbf.__getattr__("batch_query_forest_knn_csr")
+batch_query_forest_knn_csr.restype = ctypes.POINTER(RbfCsrResults)
+batch_query_forest_knn_csr.argtypes = [rbf_type, ctypes.POINTER(ctypes.c_char), ctypes.POINTER(ctypes.c_char), ctypes.c_size_t,
+                                       ctypes.c_size_t, ctypes.c_int, ctypes.c_size_t, rownum_type]
+
+free_csr_results = rbf.__getattr__("free_csr_results")
+free_csr_results.restype = None
+free_csr_results.argtypes = [ctypes.POINTER(RbfCsrResults)]
+
+# RbfMetric
+RBF_L2, RBF_L1, RBF_COSINE, RBF_DOT, RBF_HAMMING = range(5)
+
+
+_ENDIAN = "<" if sys.byteorder == "little" else ">"
+
+class _CsrArray:
+    """One of a CsrResults' arrays, as something numpy.asarray can wrap without copying.
+    The numpy array keeps this (and so the CsrResults, and so the C allocation) alive."""
+    def __init__(self, owner, pointer, typestr, length):
+        self._owner = owner
+        self.__array_interface__ = {"shape": (length,), "typestr": typestr, "version": 3,
+                                    "data": (ctypes.addressof(pointer.contents) if length else 0, True)}
+
+
+class CsrResults:
+    """Owns the RbfCsrResults from a *_csr batch query (and frees it when it goes away).
+    Point i's results are indices[indptr[i]:indptr[i + 1]] (and the same slice of distances, if any),
+    so e.g. scipy.sparse.csr_matrix((distances, indices, indptr)) needs no copies either."""
+    def __init__(self, results):
+        self._results = results
+        c = results.contents
+        self.num_points = c.num_points
+        num_results = c.indptr[c.num_points]
+        self.indptr = _CsrArray(self, c.indptr, _ENDIAN + "u%d" % ctypes.sizeof(ctypes.c_size_t), c.num_points + 1)
+        self.indices = _CsrArray(self, c.indices, _ENDIAN + "i4", num_results)
+        self.distances = _CsrArray(self, c.distances, _ENDIAN + "f8", num_results) if c.distances else None
+
+    def __del__(self):
+        free_csr_results(self._results)
+
+
+def query_dedup_csr(forest, points, point_dimension, num_points):
+    return CsrResults(batch_query_forest_dedup_csr(forest, points, point_dimension, num_points))
+
+
+def query_knn_csr(forest, ref_points, points, point_dimension, num_points, metric, k, min_tree_rows=0):
+    return CsrResults(batch_query_forest_knn_csr(forest, ref_points, points, point_dimension, num_points,
+                                                 metric, k, min_tree_rows))
+
+
 l2_square_dist = rbf.__getattr__("l2_square_dist")
 l2_square_dist.restype = ctypes.c_int
 # TODO: fix the type issues here: they should both be of the same type.